@@ -0,0 +1,678 @@
+/*
+ * Microbenchmarks of the snapshot and simulation hot paths.
+ * Every case reports ns/op, bytes/op (wire bytes, when it makes sense) and heap allocations/op,
+ * `--json FILE` also writes the results in a machine-readable form to compare builds.
+ * Exits with 1 when a steady-state case (NO_ALLOC_CASES) allocated, so a regression fails the run.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <print>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.h"
+#include "entity_store.h"
+#include "jobs.h"
+#include "protocol.h"
+#include "sim.h"
+#include "spsc_ring.h"
+
+using namespace std;
+
+/*
+ * Allocation counting, every heap allocation of the process goes through these
+ */
+static atomic<uint64_t> num_allocs = 0;
+
+void* operator new(size_t size) {
+    num_allocs.fetch_add(1, memory_order_relaxed);
+    if (void* ptr = malloc(size ? size : 1)) return ptr;
+    throw bad_alloc();
+}
+void* operator new[](size_t size) {
+    num_allocs.fetch_add(1, memory_order_relaxed);
+    if (void* ptr = malloc(size ? size : 1)) return ptr;
+    throw bad_alloc();
+}
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+
+// Keeps the compiler from optimizing a result away
+template <typename T>
+static void keep(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+const uint32_t ENTITY_COUNTS[] = {100, 1000, 10000, 100000, 1000000};
+
+// Building, decoding and applying snapshots reuses buffers once warmed up, a case whose name contains one of these must not allocate
+const char* const NO_ALLOC_CASES[] = {"serialize_game_state", "deserialize_game_state", "interp_game_states", "apply_game_state"};
+
+struct Options {
+    const char* json_path = nullptr;
+    const char* filter = nullptr;
+    double min_time_s = 0.2;
+    int repetitions = 3;
+    uint32_t max_entities = 1000000;
+};
+
+struct Result {
+    string name;
+    uint32_t entities = 0;
+    uint64_t iterations = 0;
+    double ns_per_op = 0.0;
+    double bytes_per_op = 0.0;
+    double allocs_per_op = 0.0;
+    string skipped;
+};
+
+static Options options;
+static vector<Result> results;
+// Names of the NO_ALLOC_CASES that allocated anyway
+static vector<string> alloc_failures;
+
+using Clock = chrono::steady_clock;
+
+/*
+ * Runs `op` in batches until min_time is reached, keeps the median batch of the repetitions.
+ * `op` takes the number of iterations to run and returns the bytes produced/consumed per iteration.
+ */
+template <typename Op>
+static void run(const string& name, uint32_t entities, Op op) {
+    if (options.filter && name.find(options.filter) == string::npos) return;
+
+    // Warm up and find how many iterations fill min_time
+    uint64_t iterations = 1;
+    while (true) {
+        Clock::time_point start = Clock::now();
+        op(iterations);
+        double elapsed = chrono::duration<double>(Clock::now() - start).count();
+        if (elapsed >= options.min_time_s / 10.0 || iterations >= (1ull << 40)) {
+            double target = options.min_time_s / max(elapsed, 1e-9) * (double)iterations;
+            iterations = max<uint64_t>(1, (uint64_t)target);
+            break;
+        }
+        iterations *= 10;
+    }
+
+    vector<double> ns_per_op;
+    double bytes_per_op = 0.0;
+    uint64_t allocs = 0;
+    for (int rep = 0; rep < options.repetitions; ++rep) {
+        uint64_t allocs_before = num_allocs.load(memory_order_relaxed);
+        Clock::time_point start = Clock::now();
+        bytes_per_op = op(iterations);
+        double elapsed = chrono::duration<double, nano>(Clock::now() - start).count();
+        allocs += num_allocs.load(memory_order_relaxed) - allocs_before;
+        ns_per_op.push_back(elapsed / (double)iterations);
+    }
+    sort(ns_per_op.begin(), ns_per_op.end());
+
+    Result result = {
+        .name = name,
+        .entities = entities,
+        .iterations = iterations,
+        .ns_per_op = ns_per_op[ns_per_op.size() / 2],
+        .bytes_per_op = bytes_per_op,
+        .allocs_per_op = (double)allocs / (double)(iterations * options.repetitions),
+        .skipped = {},
+    };
+    println("{:<40} {:>9} {:>14.1f} ns/op {:>12.1f} B/op {:>8.3f} allocs/op", name, entities, result.ns_per_op,
+            result.bytes_per_op, result.allocs_per_op);
+    results.push_back(result);
+
+    bool must_not_allocate = any_of(begin(NO_ALLOC_CASES), end(NO_ALLOC_CASES), [&](const char* no_alloc) {
+        return name.find(no_alloc) != string::npos;
+    });
+    if (must_not_allocate && allocs > 0) {
+        alloc_failures.push_back(name);
+    }
+}
+
+static void skip(const string& name, uint32_t entities, const string& reason) {
+    if (options.filter && name.find(options.filter) == string::npos) return;
+    println("{:<40} {:>9} skipped: {}", name, entities, reason);
+    results.push_back({.name = name, .entities = entities, .skipped = reason});
+}
+
+static mt19937 rng(42);
+
+// Random positions, ids sorted as the host sends them
+static GameStatePayload make_state(uint32_t num_entities, uint64_t frame) {
+    GameStatePayload state = {
+        .server_command_frame = frame,
+        .player_pos = {(float)(WIN_WIDTH / 2), (float)(WIN_HEIGHT / 2)},
+        .player_angle = 1.f,
+        .first_slot = 0,
+        .end_slot = 0,
+        .num_entities = num_entities,
+        .entities = acquire_entity_buffer(),
+    };
+    for (uint32_t i = 0; i < num_entities; ++i) {
+        state.entities[i] = {
+            .id = make_entity_id(i, 0),
+            .pos = {(float)uniform_int_distribution<int>(0, WIN_WIDTH)(rng), (float)uniform_int_distribution<int>(0, WIN_HEIGHT)(rng)},
+        };
+    }
+    return state;
+}
+
+// Same entities as `state` one tick later: a few pixels of movement each
+static GameStatePayload make_next_state(const GameStatePayload& state) {
+    GameStatePayload next = make_state(0, state.server_command_frame + 2);
+    next.num_entities = state.num_entities;
+    for (uint32_t i = 0; i < state.num_entities; ++i) {
+        next.entities[i] = state.entities[i];
+        next.entities[i].pos.x = min<float>(WIN_WIDTH, next.entities[i].pos.x + 3.f);
+        next.entities[i].pos.y = max<float>(0.f, next.entities[i].pos.y - 3.f);
+    }
+    return next;
+}
+
+static void bench_serialization(uint32_t n) {
+    string suffix = "/" + to_string(n);
+
+    set_entity_buffer_capacity(n);
+    {
+        GameStatePayload state = make_state(n, 100);
+        GameStatePayload next = make_next_state(state);
+        size_t buff_len = 64 + (size_t)n * 8;
+        unique_ptr<char[]> buff(new char[buff_len]);
+
+        run("serialize_game_state" + suffix, n, [&](uint64_t iterations) {
+            size_t len = 0;
+            for (uint64_t i = 0; i < iterations; ++i) {
+                len = serialize_game_state(buff.get(), buff_len, state);
+                keep(buff[0]);
+            }
+            return (double)len;
+        });
+
+        size_t encoded_len = serialize_game_state(buff.get(), buff_len, state);
+        GameStatePayload decoded;
+        run("deserialize_game_state" + suffix, n, [&](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                bool ok = deserialize_game_state(buff.get(), encoded_len, decoded);
+                keep(ok);
+            }
+            return (double)encoded_len;
+        });
+
+        // What the snapshots cost before bit-packing: the payload copied as is
+        size_t raw_len = sizeof(uint64_t) + sizeof(float) * 3 + sizeof(uint32_t) + sizeof(EntityPayload) * n;
+        unique_ptr<char[]> raw(new char[raw_len]);
+        run("memcpy_game_state" + suffix, n, [&](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                size_t offset = 0;
+                memcpy(raw.get() + offset, &state.server_command_frame, sizeof(uint64_t));
+                offset += sizeof(uint64_t);
+                memcpy(raw.get() + offset, state.player_pos, sizeof(float) * 2);
+                offset += sizeof(float) * 2;
+                memcpy(raw.get() + offset, &state.player_angle, sizeof(float));
+                offset += sizeof(float);
+                memcpy(raw.get() + offset, &state.num_entities, sizeof(uint32_t));
+                offset += sizeof(uint32_t);
+                memcpy(raw.get() + offset, state.entities.get(), sizeof(EntityPayload) * n);
+                keep(raw[0]);
+            }
+            return (double)raw_len;
+        });
+
+        run("serialize_game_state_delta" + suffix, n, [&](uint64_t iterations) {
+            size_t len = 0;
+            for (uint64_t i = 0; i < iterations; ++i) {
+                len = serialize_game_state_delta(buff.get(), buff_len, state, next);
+                keep(buff[0]);
+            }
+            return (double)len;
+        });
+
+        SnapshotHistory history;
+        history_init(history);
+        history_store(history, state);
+        size_t delta_len = serialize_game_state_delta(buff.get(), buff_len, state, next);
+        run("deserialize_game_state_delta" + suffix, n, [&](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                bool ok = deserialize_game_state_delta(buff.get(), delta_len, history, decoded);
+                keep(ok);
+            }
+            return (double)delta_len;
+        });
+    }
+    set_entity_buffer_capacity(DEFAULT_ENTITY_COUNT);
+}
+
+// The array-of-structs layout and update the simulation used before EntityStore, kept as the baseline
+struct AosEntity {
+    uint16_t id;
+    EntityState state = EntityState::No;
+    Vector2 pos = {};
+    Vector2 prev_pos = {};
+    float dir_x = 0.f;
+    float dir_y = 0.f;
+};
+
+const float BENCH_MOVE_STEP = 200.f * CF_UPDATE_RATE;
+
+static void aos_entity_update(AosEntity& entity) {
+    entity.pos.x += entity.dir_x * BENCH_MOVE_STEP;
+    entity.pos.y += entity.dir_y * BENCH_MOVE_STEP;
+
+    if (entity.pos.x >= WIN_WIDTH || entity.pos.x <= 0) {
+        entity.dir_x *= -1;
+    }
+    if (entity.pos.y >= WIN_HEIGHT || entity.pos.y <= 0) {
+        entity.dir_y *= -1;
+    }
+}
+
+/*
+ * One host tick worth of entity updates, every entity live
+ */
+static void bench_entity_update(uint32_t n) {
+    vector<AosEntity> updated(n);
+    EntityStore store;
+    entity_store_init(store, n);
+    for (uint32_t i = 0; i < n; ++i) {
+        updated[i] = {
+            .id = (uint16_t)i,
+            .state = EntityState::ServerHandled,
+            .pos = {(float)uniform_int_distribution<int>(0, WIN_WIDTH)(rng), (float)uniform_int_distribution<int>(0, WIN_HEIGHT)(rng)},
+            .dir_x = i % 2 == 0 ? 1.f : -1.f,
+            .dir_y = i % 3 == 0 ? 1.f : -1.f,
+        };
+        store.state[i] = EntityState::ServerHandled;
+        store.x[i] = updated[i].pos.x;
+        store.y[i] = updated[i].pos.y;
+        store.dx[i] = updated[i].dir_x;
+        store.dy[i] = updated[i].dir_y;
+    }
+
+    string suffix = "/" + to_string(n);
+    run("entity_update/aos" + suffix, n, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            for (AosEntity& entity : updated) {
+                if (entity.state == EntityState::No) continue;
+                aos_entity_update(entity);
+            }
+            keep(updated[0]);
+        }
+        return 0.0;
+    });
+
+    for (EntityKernel kernel : {EntityKernel::Scalar, EntityKernel::Sse2, EntityKernel::Avx2}) {
+        string name = string("entity_update/soa_") + entity_kernel_name(kernel) + suffix;
+        if (!entity_kernel_supported(kernel)) {
+            skip(name, n, "not supported by this CPU");
+            continue;
+        }
+
+        run(name, n, [&](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                entity_store_update_with(kernel, store, EntityFilter::Active, BENCH_MOVE_STEP, WIN_WIDTH, WIN_HEIGHT);
+                keep(store.x[0]);
+            }
+            return 0.0;
+        });
+    }
+}
+
+/*
+ * Finding one entity by id: the index against the linear scan snapshots used to do for every entity
+ */
+static void bench_id_lookup(uint32_t n) {
+    EntityStore store;
+    entity_store_init(store, n);
+    vector<uint32_t> ids(1024);
+    for (uint32_t& id : ids) {
+        id = make_entity_id(uniform_int_distribution<uint32_t>(0, n - 1)(rng), 0);
+    }
+
+    string suffix = "/" + to_string(n);
+    run("entity_lookup/index" + suffix, n, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            keep(entity_slot(store, ids[i & 1023]));
+        }
+        return 0.0;
+    });
+
+    run("entity_lookup/scan" + suffix, n, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            uint32_t id = ids[i & 1023];
+            uint32_t slot = ENTITY_NO_SLOT;
+            for (uint32_t j = 0; j < store.capacity; ++j) {
+                if (store.id[j] == id) {
+                    slot = j;
+                    break;
+                }
+            }
+            keep(slot);
+        }
+        return 0.0;
+    });
+}
+
+static void bench_apply(uint32_t n) {
+    string suffix = "/" + to_string(n);
+
+    set_entity_buffer_capacity(n);
+    entity_store_init(entities, n);
+    {
+        GameStatePayload from = make_state(n, 100);
+        GameStatePayload to = make_next_state(from);
+
+        run("interp_game_states" + suffix, n, [&](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                interp_game_states(from, to, (float)(i & 7) / 8.f);
+                keep(entities.x[0]);
+            }
+            return 0.0;
+        });
+
+        run("apply_game_state" + suffix, n, [&](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                apply_game_state(to);
+                keep(entities.x[0]);
+            }
+            return 0.0;
+        });
+    }
+    set_entity_buffer_capacity(DEFAULT_ENTITY_COUNT);
+}
+
+/*
+ * Hand-over of received snapshots from the net thread to the game thread, one item per op
+ */
+const size_t QUEUE_CAPACITY = 8;
+
+static void bench_state_queues() {
+    static SpscRing<uint64_t, QUEUE_CAPACITY> ring;
+    run("state_queue/spsc_ring", 1, [&](uint64_t iterations) {
+        thread producer([iterations] {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                uint64_t* slot;
+                while ((slot = ring.begin_push()) == nullptr) this_thread::yield();
+                *slot = i;
+                ring.commit_push();
+            }
+        });
+        for (uint64_t i = 0; i < iterations; ++i) {
+            uint64_t* item;
+            while ((item = ring.front()) == nullptr) this_thread::yield();
+            keep(*item);
+            ring.pop();
+        }
+        producer.join();
+        return 0.0;
+    });
+
+    // The mutex + deque pair the game used before the ring
+    run("state_queue/mutex_deque", 1, [&](uint64_t iterations) {
+        mutex mtx;
+        deque<uint64_t> queue;
+        thread producer([&] {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                while (true) {
+                    {
+                        lock_guard<mutex> lock(mtx);
+                        if (queue.size() < QUEUE_CAPACITY) {
+                            queue.push_back(i);
+                            break;
+                        }
+                    }
+                    this_thread::yield();
+                }
+            }
+        });
+        for (uint64_t i = 0; i < iterations;) {
+            {
+                lock_guard<mutex> lock(mtx);
+                if (!queue.empty()) {
+                    keep(queue.front());
+                    queue.pop_front();
+                    ++i;
+                    continue;
+                }
+            }
+            this_thread::yield();
+        }
+        producer.join();
+        return 0.0;
+    });
+}
+
+// Entities moved a few ticks from the same start, hashed bit for bit
+static uint64_t entity_update_checksum(uint32_t n, uint32_t grain) {
+    EntityStore store;
+    entity_store_init(store, n);
+    mt19937 checksum_rng(7);
+    for (uint32_t i = 0; i < n; ++i) {
+        store.state[i] = i % 5 == 0 ? EntityState::No : EntityState::ServerHandled;
+        store.x[i] = (float)uniform_int_distribution<int>(0, WIN_WIDTH)(checksum_rng);
+        store.y[i] = (float)uniform_int_distribution<int>(0, WIN_HEIGHT)(checksum_rng);
+        store.dx[i] = i % 2 == 0 ? 1.f : -1.f;
+        store.dy[i] = i % 3 == 0 ? 1.f : -1.f;
+    }
+
+    for (int tick = 0; tick < 64; ++tick) {
+        parallel_for(0, store.padded, grain, [&](uint32_t begin, uint32_t end) {
+            entity_store_update_range(store, begin, end, EntityFilter::Active, BENCH_MOVE_STEP, WIN_WIDTH, WIN_HEIGHT);
+        });
+    }
+
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (const float* field : {store.x.get(), store.y.get(), store.dx.get(), store.dy.get()}) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(field);
+        for (size_t i = 0; i < sizeof(float) * store.padded; ++i) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+/*
+ * Scaling of the parallel loops the host runs, from 1 thread to one per core: a tick of entity updates and
+ * the snapshot encodings for clients acking different baselines. Every thread count has to give the same entities.
+ */
+const uint32_t JOBS_ENTITIES = 1000000;
+const uint32_t JOBS_ENTITY_GRAIN = 16384;
+const uint32_t JOBS_SNAPSHOT_ENTITIES = 500;
+
+static void bench_jobs() {
+    uint32_t max_threads = max(1u, thread::hardware_concurrency());
+    vector<uint32_t> thread_counts;
+    for (uint32_t threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    EntityStore store;
+    entity_store_init(store, JOBS_ENTITIES);
+    for (uint32_t i = 0; i < JOBS_ENTITIES; ++i) {
+        store.state[i] = EntityState::ServerHandled;
+        store.x[i] = (float)uniform_int_distribution<int>(0, WIN_WIDTH)(rng);
+        store.y[i] = (float)uniform_int_distribution<int>(0, WIN_HEIGHT)(rng);
+        store.dx[i] = i % 2 == 0 ? 1.f : -1.f;
+        store.dy[i] = i % 3 == 0 ? 1.f : -1.f;
+    }
+
+    // Every baseline the host history can hold, each encoded into its own buffer
+    set_entity_buffer_capacity(JOBS_SNAPSHOT_ENTITIES);
+    {
+        vector<GameStatePayload> baselines;
+        GameStatePayload state = make_state(JOBS_SNAPSHOT_ENTITIES, 1000);
+        for (size_t i = 0; i < SNAPSHOT_HISTORY_SIZE; ++i) {
+            baselines.push_back(make_state(JOBS_SNAPSHOT_ENTITIES, 1000 - 2 * (i + 1)));
+        }
+        size_t buff_len = 64 + (size_t)JOBS_SNAPSHOT_ENTITIES * 8;
+        unique_ptr<char[]> buffs(new char[buff_len * SNAPSHOT_HISTORY_SIZE]);
+
+        uint64_t reference = 0;
+        for (uint32_t threads : thread_counts) {
+            jobs_init(threads - 1);
+            string suffix = "/threads=" + to_string(threads);
+
+            uint64_t checksum = entity_update_checksum(JOBS_ENTITIES / 10, JOBS_ENTITY_GRAIN);
+            if (threads == 1) reference = checksum;
+            if (checksum != reference) {
+                println("Warning: entity updates with {} threads differ from the single-threaded run", threads);
+            }
+
+            run("jobs/entity_update" + suffix, JOBS_ENTITIES, [&](uint64_t iterations) {
+                for (uint64_t i = 0; i < iterations; ++i) {
+                    parallel_for(0, store.padded, JOBS_ENTITY_GRAIN, [&](uint32_t begin, uint32_t end) {
+                        entity_store_update_range(store, begin, end, EntityFilter::Active, BENCH_MOVE_STEP, WIN_WIDTH, WIN_HEIGHT);
+                    });
+                    keep(store.x[0]);
+                }
+                return 0.0;
+            });
+
+            run("jobs/encode_deltas" + suffix, JOBS_SNAPSHOT_ENTITIES, [&](uint64_t iterations) {
+                atomic<size_t> total_len = 0;
+                for (uint64_t i = 0; i < iterations; ++i) {
+                    parallel_for(0, (uint32_t)SNAPSHOT_HISTORY_SIZE, 1, [&](uint32_t begin, uint32_t end) {
+                        for (uint32_t k = begin; k < end; ++k) {
+                            size_t len = serialize_game_state_delta(buffs.get() + k * buff_len, buff_len, baselines[k], state);
+                            total_len.fetch_add(len, memory_order_relaxed);
+                        }
+                    });
+                }
+                return (double)total_len.load() / (double)iterations;
+            });
+        }
+        jobs_shutdown();
+    }
+    set_entity_buffer_capacity(DEFAULT_ENTITY_COUNT);
+}
+
+/*
+ * Cost of recording one sample, the clock reads around timed sections are measured separately
+ */
+static void bench_metrics() {
+    run("metrics/counter_add", 1, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            metrics_add(Counter::BytesSent, i);
+        }
+        return 0.0;
+    });
+
+    run("metrics/histogram_observe", 1, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            metrics_observe(Histogram::SerializeDuration, i * 977);
+        }
+        return 0.0;
+    });
+
+    run("metrics/now_ns", 1, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            keep(metrics_now_ns());
+        }
+        return 0.0;
+    });
+}
+
+static void write_json(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) {
+        println("Failed to open {}", path);
+        return;
+    }
+
+    time_t now = time(nullptr);
+    char date[32];
+    strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    fprintf(file, "{\n  \"context\": {\n");
+    fprintf(file, "    \"date\": \"%s\",\n", date);
+    fprintf(file, "    \"compiler\": \"%s\",\n", __VERSION__);
+#ifdef NDEBUG
+    fprintf(file, "    \"assertions\": false,\n");
+#else
+    fprintf(file, "    \"assertions\": true,\n");
+#endif
+    fprintf(file, "    \"num_cpus\": %u,\n", thread::hardware_concurrency());
+    fprintf(file, "    \"min_time_s\": %g,\n", options.min_time_s);
+    fprintf(file, "    \"repetitions\": %d\n", options.repetitions);
+    fprintf(file, "  },\n  \"benchmarks\": [\n");
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"entities\": %u, ", r.name.c_str(), r.entities);
+        if (!r.skipped.empty()) {
+            fprintf(file, "\"skipped\": \"%s\"}", r.skipped.c_str());
+        } else {
+            fprintf(file, "\"iterations\": %llu, \"ns_per_op\": %.3f, \"bytes_per_op\": %.1f, \"allocs_per_op\": %.4f}",
+                    (unsigned long long)r.iterations, r.ns_per_op, r.bytes_per_op, r.allocs_per_op);
+        }
+        fprintf(file, "%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    println("Results written to {}", path);
+}
+
+static void usage() {
+    println("Usage: net_bench [--json FILE] [--filter SUBSTRING] [--min-time S] [--repetitions N] [--max-entities N]");
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--json") == 0 && has_value) {
+            options.json_path = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && has_value) {
+            options.filter = argv[++i];
+        } else if (strcmp(argv[i], "--min-time") == 0 && has_value) {
+            options.min_time_s = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--repetitions") == 0 && has_value) {
+            options.repetitions = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--max-entities") == 0 && has_value) {
+            options.max_entities = (uint32_t)atol(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+#ifndef NDEBUG
+    println("Warning: assertions are enabled, build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers");
+#endif
+
+    for (uint32_t n : ENTITY_COUNTS) {
+        if (n > options.max_entities) break;
+        bench_serialization(n);
+        bench_entity_update(n);
+        bench_id_lookup(n);
+        bench_apply(n);
+    }
+    bench_state_queues();
+    bench_jobs();
+    bench_metrics();
+
+    if (options.json_path) {
+        write_json(options.json_path);
+    }
+
+    if (!alloc_failures.empty()) {
+        println("{} steady-state case(s) allocated:", alloc_failures.size());
+        for (const string& name : alloc_failures) {
+            println("  {}", name);
+        }
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Bit-level writer/reader used by the snapshot encoding.
+ * Bits are packed LSB first, one byte at a time, so the output doesn't depend on the host endianness.
+ * Both never write/read out of bounds, they raise `overflow` instead and the caller checks it once done.
+ */
+
+struct BitWriter {
+    uint8_t* buff = nullptr;
+    size_t buff_len = 0;
+    size_t offset = 0;
+    uint64_t scratch = 0;
+    int scratch_bits = 0;
+    bool overflow = false;
+
+    // num_bits <= 32
+    void write_bits(uint32_t value, int num_bits) {
+        scratch |= (uint64_t)value << scratch_bits;
+        scratch_bits += num_bits;
+
+        while (scratch_bits >= 8) {
+            if (offset == buff_len) {
+                overflow = true;
+            } else {
+                buff[offset++] = (uint8_t)scratch;
+            }
+            scratch >>= 8;
+            scratch_bits -= 8;
+        }
+    }
+
+    // 7 bits per byte, for values that are usually small but unbounded
+    void write_varint(uint64_t value) {
+        while (value >= 0x80) {
+            write_bits((uint32_t)(value & 0x7f) | 0x80, 8);
+            value >>= 7;
+        }
+        write_bits((uint32_t)value, 8);
+    }
+
+    // Exp-Golomb: 0 takes 1 bit, 1-2 take 3 bits, 3-6 take 5 bits... value < 2^31
+    void write_exp_golomb(uint32_t value) {
+        uint32_t v = value + 1;
+        int k = 31 - __builtin_clz(v);
+        write_bits(1u << k, k + 1);
+        write_bits(v & ((1u << k) - 1), k);
+    }
+
+    void write_signed(int32_t value) {
+        write_exp_golomb(((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+    }
+
+    // Pads the last byte, returns the number of bytes written
+    size_t flush() {
+        if (scratch_bits > 0) {
+            write_bits(0, 8 - scratch_bits);
+        }
+        return offset;
+    }
+};
+
+struct BitReader {
+    const uint8_t* buff = nullptr;
+    size_t buff_len = 0;
+    size_t offset = 0;
+    uint64_t scratch = 0;
+    int scratch_bits = 0;
+    bool overflow = false;
+
+    // num_bits <= 32
+    uint32_t read_bits(int num_bits) {
+        while (scratch_bits < num_bits) {
+            if (offset == buff_len) {
+                overflow = true;
+                return 0;
+            }
+            scratch |= (uint64_t)buff[offset++] << scratch_bits;
+            scratch_bits += 8;
+        }
+
+        uint32_t value = (uint32_t)(scratch & ((1ull << num_bits) - 1));
+        scratch >>= num_bits;
+        scratch_bits -= num_bits;
+        return value;
+    }
+
+    uint64_t read_varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint32_t byte = read_bits(8);
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80) || overflow) return value;
+        }
+        overflow = true;
+        return value;
+    }
+
+    uint32_t read_exp_golomb() {
+        int k = 0;
+        while (read_bits(1) == 0) {
+            if (overflow || ++k > 31) {
+                overflow = true;
+                return 0;
+            }
+        }
+        return ((1u << k) | read_bits(k)) - 1;
+    }
+
+    int32_t read_signed() {
+        uint32_t value = read_exp_golomb();
+        return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+    }
+
+    size_t bits_left() const {
+        return (buff_len - offset) * 8 + scratch_bits;
+    }
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * An entity id is its slot plus the slot's generation, bumped every time the slot is freed. A message naming an
+ * entity that has since been despawned (and maybe its slot reused) carries an older generation and is told apart
+ * with one compare. Ids compare in slot order, so lists sorted by slot are sorted by id as well.
+ */
+const uint32_t ENTITY_GENERATION_BITS = 8;
+const uint32_t ENTITY_GENERATION_MASK = (1u << ENTITY_GENERATION_BITS) - 1;
+// One short of what the slot bits hold, the last slot's last generation would be ENTITY_NO_ID
+const uint32_t ENTITY_MAX_SLOTS = (1u << (32 - ENTITY_GENERATION_BITS)) - 1;
+const uint32_t ENTITY_NO_ID = UINT32_MAX;
+
+inline uint32_t make_entity_id(uint32_t slot, uint32_t generation) {
+    return slot << ENTITY_GENERATION_BITS | (generation & ENTITY_GENERATION_MASK);
+}
+
+inline uint32_t entity_id_slot(uint32_t id) {
+    return id >> ENTITY_GENERATION_BITS;
+}
+
+inline uint32_t entity_id_generation(uint32_t id) {
+    return id & ENTITY_GENERATION_MASK;
+}
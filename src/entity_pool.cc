@@ -0,0 +1,70 @@
+#include "entity_pool.h"
+#include "game.h"
+#include "protocol.h"
+#include <cstddef>
+#include <mutex>
+
+using namespace std;
+
+// Buffers released beyond that are freed, the pool only needs to cover what's in flight at once
+const size_t MAX_POOLED_BUFFERS = 32;
+
+struct EntityBufferPool {
+    mutex mtx;
+    uint32_t capacity = DEFAULT_ENTITY_COUNT;
+    size_t num_in_use = 0;
+    size_t num_free = 0;
+    EntityPayload* free_buffers[MAX_POOLED_BUFFERS];
+};
+
+// Never destroyed: snapshots held by globals are released during static destruction
+static EntityBufferPool& pool() {
+    static EntityBufferPool* instance = new EntityBufferPool();
+    return *instance;
+}
+
+uint32_t entity_buffer_capacity() {
+    EntityBufferPool& p = pool();
+    lock_guard<mutex> lock(p.mtx);
+    return p.capacity;
+}
+
+bool set_entity_buffer_capacity(uint32_t capacity) {
+    EntityBufferPool& p = pool();
+    lock_guard<mutex> lock(p.mtx);
+    if (p.num_in_use > 0) return false;
+
+    for (size_t i = 0; i < p.num_free; ++i) {
+        delete[] p.free_buffers[i];
+    }
+    p.num_free = 0;
+    p.capacity = capacity;
+    return true;
+}
+
+EntityBuffer acquire_entity_buffer() {
+    EntityBufferPool& p = pool();
+    uint32_t capacity;
+    {
+        lock_guard<mutex> lock(p.mtx);
+        ++p.num_in_use;
+        if (p.num_free > 0) {
+            return EntityBuffer(p.free_buffers[--p.num_free]);
+        }
+        capacity = p.capacity;
+    }
+    return EntityBuffer(new EntityPayload[capacity]);
+}
+
+void EntityBufferReleaser::operator()(EntityPayload* buff) const {
+    EntityBufferPool& p = pool();
+    {
+        lock_guard<mutex> lock(p.mtx);
+        --p.num_in_use;
+        if (p.num_free < MAX_POOLED_BUFFERS) {
+            p.free_buffers[p.num_free++] = buff;
+            return;
+        }
+    }
+    delete[] buff;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+struct EntityPayload;
+
+/*
+ * Snapshots get their entity arrays from a shared pool of fixed-capacity buffers (DEFAULT_ENTITY_COUNT entries each by default).
+ * A buffer goes back to the pool when its EntityBuffer is destroyed, on whichever thread that happens,
+ * so once the pool is warm, building, sending and decoding snapshots doesn't hit the allocator anymore.
+ */
+struct EntityBufferReleaser {
+    void operator()(EntityPayload* buff) const;
+};
+
+using EntityBuffer = std::unique_ptr<EntityPayload[], EntityBufferReleaser>;
+
+uint32_t entity_buffer_capacity();
+
+/*
+ * Only possible while no buffer is in use, returns false otherwise. Pooled buffers are freed.
+ */
+bool set_entity_buffer_capacity(uint32_t capacity);
+
+/*
+ * Only allocates while the pool is empty
+ */
+EntityBuffer acquire_entity_buffer();
@@ -0,0 +1,348 @@
+#include "entity_store.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ENTITY_STORE_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+template <typename T>
+static AlignedArray<T> allocate_array(uint32_t count) {
+    T* ptr = static_cast<T*>(::operator new[](sizeof(T) * count, align_val_t{ENTITY_ALIGNMENT}));
+    memset(ptr, 0, sizeof(T) * count);
+    return AlignedArray<T>(ptr);
+}
+
+void entity_store_init(EntityStore& store, uint32_t capacity, bool fixed_point) {
+    uint32_t padded = (capacity + ENTITY_LANES - 1) / ENTITY_LANES * ENTITY_LANES;
+
+    store.capacity = capacity;
+    store.padded = padded;
+    store.id = allocate_array<uint32_t>(padded);
+    store.state = allocate_array<EntityState>(padded);
+    store.x = allocate_array<float>(padded);
+    store.y = allocate_array<float>(padded);
+    store.prev_x = allocate_array<float>(padded);
+    store.prev_y = allocate_array<float>(padded);
+    store.dx = allocate_array<float>(padded);
+    store.dy = allocate_array<float>(padded);
+    if (fixed_point) {
+        store.fixed_x = allocate_array<int32_t>(padded);
+        store.fixed_y = allocate_array<int32_t>(padded);
+        store.fixed_vx = allocate_array<int32_t>(padded);
+        store.fixed_vy = allocate_array<int32_t>(padded);
+    } else {
+        store.fixed_x.reset();
+        store.fixed_y.reset();
+        store.fixed_vx.reset();
+        store.fixed_vy.reset();
+    }
+
+    store.free_slots = make_unique<uint32_t[]>(capacity);
+    store.free_listed = make_unique<bool[]>(capacity);
+    store.num_free = 0;
+
+    for (uint32_t i = 0; i < padded; ++i) {
+        store.id[i] = make_entity_id(i, 0);
+    }
+    // Lowest slot on top, the first spawns fill the store from the start
+    for (uint32_t i = capacity; i-- > 0;) {
+        store.free_slots[store.num_free++] = i;
+        store.free_listed[i] = true;
+    }
+}
+
+uint32_t entity_alloc(EntityStore& store) {
+    while (store.num_free > 0) {
+        uint32_t slot = store.free_slots[--store.num_free];
+        store.free_listed[slot] = false;
+        if (store.state[slot] == EntityState::No) return store.id[slot];
+    }
+    return ENTITY_NO_ID;
+}
+
+uint32_t entity_claim(EntityStore& store, uint32_t id) {
+    uint32_t slot = entity_id_slot(id);
+    if (slot >= store.capacity) return ENTITY_NO_SLOT;
+    store.id[slot] = id;
+    return slot;
+}
+
+bool entity_free(EntityStore& store, uint32_t id) {
+    uint32_t slot = entity_slot(store, id);
+    if (slot == ENTITY_NO_SLOT) return false;
+
+    store.state[slot] = EntityState::No;
+    store.id[slot] = make_entity_id(slot, entity_id_generation(id) + 1);
+    if (!store.free_listed[slot]) {
+        store.free_slots[store.num_free++] = slot;
+        store.free_listed[slot] = true;
+    }
+    return true;
+}
+
+void entity_store_save_previous(EntityStore& store) {
+    memcpy(store.prev_x.get(), store.x.get(), sizeof(float) * store.padded);
+    memcpy(store.prev_y.get(), store.y.get(), sizeof(float) * store.padded);
+}
+
+static bool passes(EntityState state, EntityFilter filter) {
+    return filter == EntityFilter::Ghosts ? state == EntityState::Ghost : state != EntityState::No;
+}
+
+// The reference every kernel matches: flipping a direction is exactly a sign flip, no fused multiply-add anywhere
+// (GameSim is built with -ffp-contract=off so the compiler doesn't fuse them either)
+static void update_one(float& x, float& y, float& dx, float& dy, float step, float width, float height) {
+    x += dx * step;
+    y += dy * step;
+
+    if (x >= width || x <= 0) {
+        dx *= -1;
+    }
+    if (y >= height || y <= 0) {
+        dy *= -1;
+    }
+}
+
+static void update_scalar(EntityStore& store, uint32_t begin, uint32_t end, EntityFilter filter, float step, float width, float height) {
+    for (uint32_t i = begin; i < end; ++i) {
+        if (!passes(store.state[i], filter)) continue;
+        update_one(store.x[i], store.y[i], store.dx[i], store.dy[i], step, width, height);
+    }
+}
+
+#ifdef ENTITY_STORE_X86
+/*
+ * Both SIMD kernels compute every lane and blend the result back in under the filter mask.
+ * States are bytes, they get widened to one 32 bit lane each to build the mask.
+ */
+
+static __m128i sse2_state_lanes(const EntityState* state) {
+    int32_t packed;
+    memcpy(&packed, state, sizeof packed);
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_cvtsi32_si128(packed);
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+}
+
+static void update_sse2(EntityStore& store, uint32_t begin, uint32_t end, EntityFilter filter, float step, float width, float height) {
+    const __m128 vstep = _mm_set1_ps(step);
+    const __m128 vwidth = _mm_set1_ps(width);
+    const __m128 vheight = _mm_set1_ps(height);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 sign = _mm_set1_ps(-0.f);
+    const __m128i match = _mm_set1_epi32(filter == EntityFilter::Ghosts ? (int)EntityState::Ghost : (int)EntityState::No);
+
+    for (uint32_t i = begin; i < end; i += 4) {
+        __m128 mask = _mm_castsi128_ps(_mm_cmpeq_epi32(sse2_state_lanes(&store.state[i]), match));
+        // Active means "not No", so the comparison is inverted
+        if (filter == EntityFilter::Active) mask = _mm_xor_ps(mask, _mm_castsi128_ps(_mm_set1_epi32(-1)));
+        if (_mm_movemask_ps(mask) == 0) continue;
+
+        __m128 x = _mm_load_ps(&store.x[i]);
+        __m128 y = _mm_load_ps(&store.y[i]);
+        __m128 dx = _mm_load_ps(&store.dx[i]);
+        __m128 dy = _mm_load_ps(&store.dy[i]);
+
+        __m128 nx = _mm_add_ps(x, _mm_mul_ps(dx, vstep));
+        __m128 ny = _mm_add_ps(y, _mm_mul_ps(dy, vstep));
+        __m128 flip_x = _mm_or_ps(_mm_cmpge_ps(nx, vwidth), _mm_cmple_ps(nx, zero));
+        __m128 flip_y = _mm_or_ps(_mm_cmpge_ps(ny, vheight), _mm_cmple_ps(ny, zero));
+        __m128 ndx = _mm_xor_ps(dx, _mm_and_ps(flip_x, sign));
+        __m128 ndy = _mm_xor_ps(dy, _mm_and_ps(flip_y, sign));
+
+        // No blendv before SSE4.1
+        _mm_store_ps(&store.x[i], _mm_or_ps(_mm_and_ps(mask, nx), _mm_andnot_ps(mask, x)));
+        _mm_store_ps(&store.y[i], _mm_or_ps(_mm_and_ps(mask, ny), _mm_andnot_ps(mask, y)));
+        _mm_store_ps(&store.dx[i], _mm_or_ps(_mm_and_ps(mask, ndx), _mm_andnot_ps(mask, dx)));
+        _mm_store_ps(&store.dy[i], _mm_or_ps(_mm_and_ps(mask, ndy), _mm_andnot_ps(mask, dy)));
+    }
+}
+
+// Built for AVX2 whatever the compiler flags are, only called once the CPU says it has it
+__attribute__((target("avx2")))
+static void update_avx2(EntityStore& store, uint32_t begin, uint32_t end, EntityFilter filter, float step, float width, float height) {
+    const __m256 vstep = _mm256_set1_ps(step);
+    const __m256 vwidth = _mm256_set1_ps(width);
+    const __m256 vheight = _mm256_set1_ps(height);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    const __m256i match = _mm256_set1_epi32(filter == EntityFilter::Ghosts ? (int)EntityState::Ghost : (int)EntityState::No);
+
+    for (uint32_t i = begin; i < end; i += 8) {
+        __m256i states = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&store.state[i])));
+        __m256 mask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(states, match));
+        if (filter == EntityFilter::Active) mask = _mm256_xor_ps(mask, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+        if (_mm256_movemask_ps(mask) == 0) continue;
+
+        __m256 x = _mm256_load_ps(&store.x[i]);
+        __m256 y = _mm256_load_ps(&store.y[i]);
+        __m256 dx = _mm256_load_ps(&store.dx[i]);
+        __m256 dy = _mm256_load_ps(&store.dy[i]);
+
+        __m256 nx = _mm256_add_ps(x, _mm256_mul_ps(dx, vstep));
+        __m256 ny = _mm256_add_ps(y, _mm256_mul_ps(dy, vstep));
+        __m256 flip_x = _mm256_or_ps(_mm256_cmp_ps(nx, vwidth, _CMP_GE_OQ), _mm256_cmp_ps(nx, zero, _CMP_LE_OQ));
+        __m256 flip_y = _mm256_or_ps(_mm256_cmp_ps(ny, vheight, _CMP_GE_OQ), _mm256_cmp_ps(ny, zero, _CMP_LE_OQ));
+        __m256 ndx = _mm256_xor_ps(dx, _mm256_and_ps(flip_x, sign));
+        __m256 ndy = _mm256_xor_ps(dy, _mm256_and_ps(flip_y, sign));
+
+        _mm256_store_ps(&store.x[i], _mm256_blendv_ps(x, nx, mask));
+        _mm256_store_ps(&store.y[i], _mm256_blendv_ps(y, ny, mask));
+        _mm256_store_ps(&store.dx[i], _mm256_blendv_ps(dx, ndx, mask));
+        _mm256_store_ps(&store.dy[i], _mm256_blendv_ps(dy, ndy, mask));
+    }
+}
+#endif
+
+// Branchless so it reads like the SSE2 version: flip is all ones when the velocity changes sign
+static void update_fixed_one(int32_t& x, int32_t& vx, int32_t bound) {
+    x += vx;
+    int32_t flip = -(int32_t)(x >= bound || x <= 0);
+    vx = (vx ^ flip) - flip;
+}
+
+static void update_fixed_scalar(EntityStore& store, uint32_t begin, uint32_t end, int32_t width, int32_t height) {
+    for (uint32_t i = begin; i < end; ++i) {
+        if (store.state[i] == EntityState::No) continue;
+        update_fixed_one(store.fixed_x[i], store.fixed_vx[i], width);
+        update_fixed_one(store.fixed_y[i], store.fixed_vy[i], height);
+        store.x[i] = (float)store.fixed_x[i] * (1.f / ENTITY_FIXED_ONE);
+        store.y[i] = (float)store.fixed_y[i] * (1.f / ENTITY_FIXED_ONE);
+    }
+}
+
+#ifdef ENTITY_STORE_X86
+static void update_fixed_sse2(EntityStore& store, uint32_t begin, uint32_t end, int32_t width, int32_t height) {
+    // x >= bound is x > bound - 1 and x <= 0 is 1 > x, SSE2 only has greater-than
+    const __m128i max_x = _mm_set1_epi32(width - 1);
+    const __m128i max_y = _mm_set1_epi32(height - 1);
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128 to_float = _mm_set1_ps(1.f / ENTITY_FIXED_ONE);
+
+    for (uint32_t i = begin; i < end; i += 4) {
+        __m128i mask = _mm_cmpeq_epi32(sse2_state_lanes(&store.state[i]), _mm_setzero_si128());
+        if (_mm_movemask_ps(_mm_castsi128_ps(mask)) == 0xf) continue;
+        // Live lanes, not No
+        mask = _mm_xor_si128(mask, _mm_set1_epi32(-1));
+
+        __m128i x = _mm_load_si128(reinterpret_cast<const __m128i*>(&store.fixed_x[i]));
+        __m128i y = _mm_load_si128(reinterpret_cast<const __m128i*>(&store.fixed_y[i]));
+        __m128i vx = _mm_load_si128(reinterpret_cast<const __m128i*>(&store.fixed_vx[i]));
+        __m128i vy = _mm_load_si128(reinterpret_cast<const __m128i*>(&store.fixed_vy[i]));
+
+        __m128i nx = _mm_add_epi32(x, vx);
+        __m128i ny = _mm_add_epi32(y, vy);
+        __m128i flip_x = _mm_and_si128(mask, _mm_or_si128(_mm_cmpgt_epi32(nx, max_x), _mm_cmpgt_epi32(one, nx)));
+        __m128i flip_y = _mm_and_si128(mask, _mm_or_si128(_mm_cmpgt_epi32(ny, max_y), _mm_cmpgt_epi32(one, ny)));
+        nx = _mm_or_si128(_mm_and_si128(mask, nx), _mm_andnot_si128(mask, x));
+        ny = _mm_or_si128(_mm_and_si128(mask, ny), _mm_andnot_si128(mask, y));
+
+        _mm_store_si128(reinterpret_cast<__m128i*>(&store.fixed_x[i]), nx);
+        _mm_store_si128(reinterpret_cast<__m128i*>(&store.fixed_y[i]), ny);
+        _mm_store_si128(reinterpret_cast<__m128i*>(&store.fixed_vx[i]), _mm_sub_epi32(_mm_xor_si128(vx, flip_x), flip_x));
+        _mm_store_si128(reinterpret_cast<__m128i*>(&store.fixed_vy[i]), _mm_sub_epi32(_mm_xor_si128(vy, flip_y), flip_y));
+        __m128 fmask = _mm_castsi128_ps(mask);
+        __m128 fx = _mm_mul_ps(_mm_cvtepi32_ps(nx), to_float);
+        __m128 fy = _mm_mul_ps(_mm_cvtepi32_ps(ny), to_float);
+        _mm_store_ps(&store.x[i], _mm_or_ps(_mm_and_ps(fmask, fx), _mm_andnot_ps(fmask, _mm_load_ps(&store.x[i]))));
+        _mm_store_ps(&store.y[i], _mm_or_ps(_mm_and_ps(fmask, fy), _mm_andnot_ps(fmask, _mm_load_ps(&store.y[i]))));
+    }
+}
+#endif
+
+void entity_store_update_fixed_range(EntityStore& store, uint32_t begin, uint32_t end, int32_t width, int32_t height) {
+    end = min(end, store.padded);
+#ifdef ENTITY_STORE_X86
+    if (entity_kernel_supported(EntityKernel::Sse2)) {
+        update_fixed_sse2(store, begin, end, width, height);
+        return;
+    }
+#endif
+    update_fixed_scalar(store, begin, end, width, height);
+}
+
+static uint32_t fnv1a(uint32_t hash, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        hash = (hash ^ ((value >> (i * 8)) & 0xff)) * 16777619u;
+    }
+    return hash;
+}
+
+uint32_t entity_store_checksum(const EntityStore& store) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < store.capacity; ++i) {
+        if (store.state[i] == EntityState::No) continue;
+        hash = fnv1a(hash, store.id[i]);
+        hash = fnv1a(hash, (uint32_t)store.fixed_x[i]);
+        hash = fnv1a(hash, (uint32_t)store.fixed_y[i]);
+        hash = fnv1a(hash, (uint32_t)store.fixed_vx[i]);
+        hash = fnv1a(hash, (uint32_t)store.fixed_vy[i]);
+    }
+    return hash;
+}
+
+bool entity_kernel_supported(EntityKernel kernel) {
+    switch (kernel) {
+    case EntityKernel::Scalar:
+        return true;
+#ifdef ENTITY_STORE_X86
+    case EntityKernel::Sse2:
+        return __builtin_cpu_supports("sse2");
+    case EntityKernel::Avx2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+EntityKernel best_entity_kernel() {
+    static const EntityKernel best = entity_kernel_supported(EntityKernel::Avx2) ? EntityKernel::Avx2
+                                   : entity_kernel_supported(EntityKernel::Sse2) ? EntityKernel::Sse2
+                                   : EntityKernel::Scalar;
+    return best;
+}
+
+const char* entity_kernel_name(EntityKernel kernel) {
+    switch (kernel) {
+    case EntityKernel::Scalar: return "scalar";
+    case EntityKernel::Sse2: return "sse2";
+    case EntityKernel::Avx2: return "avx2";
+    }
+    return "unknown";
+}
+
+static void update_range(EntityKernel kernel, EntityStore& store, uint32_t begin, uint32_t end, EntityFilter filter,
+                         float step, float width, float height) {
+#ifdef ENTITY_STORE_X86
+    if (kernel == EntityKernel::Avx2) {
+        update_avx2(store, begin, end, filter, step, width, height);
+        return;
+    }
+    if (kernel == EntityKernel::Sse2) {
+        update_sse2(store, begin, end, filter, step, width, height);
+        return;
+    }
+#endif
+    update_scalar(store, begin, end, filter, step, width, height);
+}
+
+void entity_store_update_with(EntityKernel kernel, EntityStore& store, EntityFilter filter, float step, float width, float height) {
+    update_range(kernel, store, 0, store.padded, filter, step, width, height);
+}
+
+void entity_store_update(EntityStore& store, EntityFilter filter, float step, float width, float height) {
+    update_range(best_entity_kernel(), store, 0, store.padded, filter, step, width, height);
+}
+
+void entity_store_update_range(EntityStore& store, uint32_t begin, uint32_t end, EntityFilter filter, float step, float width, float height) {
+    update_range(best_entity_kernel(), store, begin, min(end, store.padded), filter, step, width, height);
+}
+
+void entity_update_slot(EntityStore& store, uint32_t slot, float step, float width, float height) {
+    update_one(store.x[slot], store.y[slot], store.dx[slot], store.dy[slot], step, width, height);
+}
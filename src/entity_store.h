@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include "entity_id.h"
+
+/*
+ * Entities kept as a structure of arrays: one array per field, each aligned and padded to a whole number of SIMD lanes
+ * so the update kernel streams through x/y/dx/dy with full-width loads and no scalar tail.
+ * Padding slots stay EntityState::No and are never touched by the kernel.
+ *
+ * Free slots sit on a stack: allocating and freeing are O(1) whatever the occupancy. Freeing a slot bumps its generation
+ * so the old id stops resolving (see entity_id.h).
+ */
+
+enum class EntityState : uint8_t {No = 0, Ghost, ServerHandled};
+
+// Wide enough for AVX2, 8 floats
+const size_t ENTITY_ALIGNMENT = 32;
+const uint32_t ENTITY_LANES = 8;
+const uint32_t ENTITY_NO_SLOT = UINT32_MAX;
+
+/*
+ * Lockstep mode simulates in fixed point instead: positions and per-tick velocities in 1/ENTITY_FIXED_ONE pixels,
+ * integer adds and compares only so every peer computes the exact same world. x/y are still written, for drawing.
+ */
+const int ENTITY_FIXED_FRAC_BITS = 12;
+const int32_t ENTITY_FIXED_ONE = 1 << ENTITY_FIXED_FRAC_BITS;
+
+struct AlignedDelete {
+    void operator()(void* ptr) const { ::operator delete[](ptr, std::align_val_t{ENTITY_ALIGNMENT}); }
+};
+
+template <typename T>
+using AlignedArray = std::unique_ptr<T[], AlignedDelete>;
+
+struct EntityStore {
+    // Usable slots, the arrays hold `padded` entries
+    uint32_t capacity = 0;
+    uint32_t padded = 0;
+    // Current id of each slot, whether it's in use or not
+    AlignedArray<uint32_t> id;
+    AlignedArray<EntityState> state;
+    AlignedArray<float> x;
+    AlignedArray<float> y;
+    // Position before the last tick, for rendering
+    AlignedArray<float> prev_x;
+    AlignedArray<float> prev_y;
+    AlignedArray<float> dx;
+    AlignedArray<float> dy;
+    // Only allocated for lockstep, see ENTITY_FIXED_ONE
+    AlignedArray<int32_t> fixed_x;
+    AlignedArray<int32_t> fixed_y;
+    AlignedArray<int32_t> fixed_vx;
+    AlignedArray<int32_t> fixed_vy;
+    // Slots that may be free, lowest on top. Slots taken by entity_claim stay there and are skipped when popped.
+    std::unique_ptr<uint32_t[]> free_slots;
+    std::unique_ptr<bool[]> free_listed;
+    uint32_t num_free = 0;
+};
+
+/*
+ * Slot holding entity `id`, ENTITY_NO_SLOT if there's none: out of range (e.g. from a bad packet) or stale
+ */
+inline uint32_t entity_slot(const EntityStore& store, uint32_t id) {
+    uint32_t slot = entity_id_slot(id);
+    return slot < store.capacity && store.id[slot] == id ? slot : ENTITY_NO_SLOT;
+}
+
+/*
+ * Takes a free slot and returns its id, ENTITY_NO_ID if every slot is in use. The caller sets the state.
+ */
+uint32_t entity_alloc(EntityStore& store);
+
+/*
+ * Uses the slot of `id` with that generation, for ids handed out by someone else (the host's snapshots).
+ * Returns ENTITY_NO_SLOT if the slot is out of range.
+ */
+uint32_t entity_claim(EntityStore& store, uint32_t id);
+
+/*
+ * Despawns `id` and puts its slot back on the free list, false if the id is stale
+ */
+bool entity_free(EntityStore& store, uint32_t id);
+
+/*
+ * Which entities an update moves: the host moves every live entity, clients only their unacknowledged ghosts
+ */
+enum class EntityFilter {Active, Ghosts};
+
+enum class EntityKernel {Scalar, Sse2, Avx2};
+
+/*
+ * (Re)allocates `capacity` (up to ENTITY_MAX_SLOTS) zeroed slots, all free and at generation 0.
+ * `fixed_point` also allocates the fixed point arrays lockstep simulates with.
+ */
+void entity_store_init(EntityStore& store, uint32_t capacity, bool fixed_point = false);
+
+void entity_store_save_previous(EntityStore& store);
+
+/*
+ * One tick of integrate-and-bounce for the entities passing `filter`, with the best kernel the CPU supports.
+ * Every kernel gives bit-identical results so host and clients agree whatever they run on.
+ */
+void entity_store_update(EntityStore& store, EntityFilter filter, float step, float width, float height);
+void entity_store_update_with(EntityKernel kernel, EntityStore& store, EntityFilter filter, float step, float width, float height);
+
+/*
+ * Slots [begin, end[ only, both multiples of ENTITY_LANES: ranges can be updated in parallel, the result is the same
+ */
+void entity_store_update_range(EntityStore& store, uint32_t begin, uint32_t end, EntityFilter filter, float step, float width, float height);
+
+/*
+ * Same as the kernels for one slot, regardless of its state
+ */
+void entity_update_slot(EntityStore& store, uint32_t slot, float step, float width, float height);
+
+/*
+ * Fixed point tick of the live entities in slots [begin, end[ (multiples of ENTITY_LANES), width/height in fixed point too.
+ * Same integrate-and-bounce as the float kernels. Results are exact, so they're the same with or without SSE2.
+ */
+void entity_store_update_fixed_range(EntityStore& store, uint32_t begin, uint32_t end, int32_t width, int32_t height);
+
+/*
+ * FNV-1a of every live entity's id and fixed point state, in slot order. Peers that agree on it simulated the same world.
+ */
+uint32_t entity_store_checksum(const EntityStore& store);
+
+bool entity_kernel_supported(EntityKernel kernel);
+EntityKernel best_entity_kernel();
+const char* entity_kernel_name(EntityKernel kernel);
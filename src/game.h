@@ -2,8 +2,23 @@
 #include "net.h"
 #include <cstdint>
 
-const uint16_t ENTITY_COUNT = 100;
+// Entity slots unless --entities says otherwise
+const uint32_t DEFAULT_ENTITY_COUNT = 100;
+// Snapshots carry at most that many entities, it bounds the size of pooled snapshot buffers
+const uint32_t MAX_NETWORKED_ENTITIES = 65536;
+const uint16_t WIN_WIDTH = 700;
+const uint16_t WIN_HEIGHT = 400;
 
-void run_game(bool host_mode = false);
+// A bit over two snapshot intervals, the jitter buffer adds to it when snapshots arrive unevenly
+const float DEFAULT_INTERP_DELAY_MS = 70.f;
+
+void run_game(bool host_mode = false, float interp_delay_ms = DEFAULT_INTERP_DELAY_MS);
 void on_state_received(struct GameStatePayload&& s);
-void on_entity_spawned(const struct SpawnEntityPayload& p);
+// Host side, called by the net thread: the game thread catches up on them at its next tick, in order
+void on_client_connected(uint32_t client_id);
+void on_client_disconnected(uint32_t client_id);
+void on_entity_spawned(uint32_t client_id, const struct SpawnEntityPayload& p);
+void on_lockstep_checksum_received(uint32_t client_id, const struct LockstepChecksumPayload& p);
+// Client side, called by the net thread
+void on_spawn_acks_received(const struct SpawnAcksPayload& p);
+void on_lockstep_frame_received(const struct LockstepFramePayload& p);
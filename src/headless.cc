@@ -0,0 +1,129 @@
+#include "headless.h"
+#include "sim.h"
+#include "trace.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <print>
+#include <thread>
+
+using namespace std;
+
+using Clock = chrono::steady_clock;
+
+// Past that many missed ticks the schedule restarts from now instead of running them back to back
+const int64_t MAX_LATE_TICKS = 5;
+
+static atomic<bool> headless_running = false;
+
+static atomic<bool> flush_trace_requested = false;
+
+static void on_stop_signal(int) {
+    headless_running = false;
+}
+
+// kill -USR1 <pid> writes the trace at the next tick, there's no window to press F9 in
+static void on_flush_trace_signal(int) {
+    flush_trace_requested = true;
+}
+
+// Absolute deadline so time spent in the tick doesn't shift the schedule
+static void sleep_until(Clock::time_point deadline) {
+#ifdef __linux__
+    // steady_clock is CLOCK_MONOTONIC with libstdc++ and libc++
+    auto since_epoch = chrono::duration_cast<chrono::nanoseconds>(deadline.time_since_epoch()).count();
+    struct timespec ts = {
+        .tv_sec = (time_t)(since_epoch / 1000000000),
+        .tv_nsec = (long)(since_epoch % 1000000000),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR && headless_running) {}
+#else
+    this_thread::sleep_until(deadline);
+#endif
+}
+
+struct TickStats {
+    uint64_t num_ticks = 0;
+    int64_t total_work_us = 0;
+    int64_t max_work_us = 0;
+    int64_t total_late_us = 0;
+    int64_t max_late_us = 0;
+    uint64_t num_overruns = 0;
+    uint64_t num_skipped = 0;
+};
+
+int run_headless_host() {
+    headless_running = true;
+    signal(SIGINT, on_stop_signal);
+    signal(SIGTERM, on_stop_signal);
+    signal(SIGUSR1, on_flush_trace_signal);
+
+    sim_init(true, 0.f);
+
+    // One wake-up per simulation tick, so each one has exactly a tick's worth of time
+    const auto period = chrono::duration_cast<Clock::duration>(chrono::duration<double>(CF_UPDATE_RATE));
+    const int64_t budget_us = chrono::duration_cast<chrono::microseconds>(period).count();
+
+    println("Headless host ticking at {:.0f} Hz", 1.0 / CF_UPDATE_RATE);
+
+    TickStats stats;
+    uint64_t tick = 0;
+    Clock::time_point next_tick = Clock::now();
+    Clock::time_point next_report = next_tick + chrono::seconds(1);
+
+    while (headless_running) {
+        {
+            TRACE_SCOPE("sleep");
+            sleep_until(next_tick);
+        }
+        if (!headless_running) break;
+
+        if (flush_trace_requested.exchange(false)) {
+            trace_flush();
+        }
+
+        Clock::time_point start = Clock::now();
+        host_tick({});
+        Clock::time_point end = Clock::now();
+
+        int64_t late_us = chrono::duration_cast<chrono::microseconds>(start - next_tick).count();
+        int64_t work_us = chrono::duration_cast<chrono::microseconds>(end - start).count();
+
+        ++stats.num_ticks;
+        stats.total_work_us += work_us;
+        stats.total_late_us += late_us;
+        if (work_us > stats.max_work_us) stats.max_work_us = work_us;
+        if (late_us > stats.max_late_us) stats.max_late_us = late_us;
+
+        if (work_us > budget_us) {
+            ++stats.num_overruns;
+            println("Tick {} took {}us, over its {}us budget", tick, work_us, budget_us);
+        }
+
+        ++tick;
+        next_tick += period;
+        if (end - next_tick > period * MAX_LATE_TICKS) {
+            int64_t skipped = (end - next_tick) / period;
+            stats.num_skipped += skipped;
+            println("Fell {} ticks behind, skipping them", skipped);
+            next_tick = end;
+        }
+
+        if (end >= next_report) {
+            println("Ticks: {}, work avg/max: {}/{}us, wake late avg/max: {}/{}us, overruns: {}, skipped: {}",
+                    stats.num_ticks,
+                    stats.total_work_us / (int64_t)stats.num_ticks, stats.max_work_us,
+                    stats.total_late_us / (int64_t)stats.num_ticks, stats.max_late_us,
+                    stats.num_overruns, stats.num_skipped);
+            stats = {};
+            next_report += chrono::seconds(1);
+            if (next_report < end) next_report = end + chrono::seconds(1);
+        }
+    }
+
+    println("Headless host stopping");
+    return 0;
+}
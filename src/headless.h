@@ -0,0 +1,9 @@
+#pragma once
+
+/*
+ * Runs the host simulation without a window until SIGINT/SIGTERM, waking up once per simulation tick (CF_UPDATE_RATE).
+ * A tick that wakes up late runs right away, so ticks run back to back until the schedule is caught up.
+ * Ticks are scheduled on absolute deadlines of a monotonic clock and the thread sleeps in between,
+ * timing stats are logged every second and ticks that overrun their budget are logged on their own.
+ */
+int run_headless_host();
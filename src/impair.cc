@@ -0,0 +1,260 @@
+#include "impair.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+// Shape of the Pareto jitter, lower means a heavier tail
+const double PARETO_SHAPE = 3.0;
+
+static bool parse_probability(const string& value, double& out) {
+    char* end;
+    out = strtod(value.c_str(), &end);
+    return *end == '\0' && out >= 0.0 && out <= 1.0;
+}
+
+static bool parse_positive(const string& value, double& out) {
+    char* end;
+    out = strtod(value.c_str(), &end);
+    return *end == '\0' && out >= 0.0;
+}
+
+bool parse_impair_config(const char* spec, ImpairConfig& config) {
+    string remaining = spec;
+
+    while (!remaining.empty()) {
+        size_t comma = remaining.find(',');
+        string entry = remaining.substr(0, comma);
+        remaining = comma == string::npos ? "" : remaining.substr(comma + 1);
+
+        size_t equal = entry.find('=');
+        if (equal == string::npos) return false;
+        string key = entry.substr(0, equal);
+        string value = entry.substr(equal + 1);
+
+        bool ok = true;
+        double number;
+        if (key == "delay") {
+            ok = parse_positive(value, config.delay_ms);
+        } else if (key == "jitter") {
+            ok = parse_positive(value, config.jitter_ms);
+        } else if (key == "jitter-dist") {
+            if (value == "uniform") {
+                config.jitter_dist = JitterDist::Uniform;
+            } else if (value == "normal") {
+                config.jitter_dist = JitterDist::Normal;
+            } else if (value == "pareto") {
+                config.jitter_dist = JitterDist::Pareto;
+            } else {
+                ok = false;
+            }
+        } else if (key == "loss") {
+            ok = parse_probability(value, config.loss);
+        } else if (key == "burst") {
+            // ENTER:EXIT[:LOSS_BAD[:LOSS_GOOD]]
+            double* fields[] = {&config.burst_enter, &config.burst_exit, &config.burst_loss_bad, &config.burst_loss_good};
+            size_t num_fields = 0;
+            size_t start = 0;
+            while (ok && num_fields < 4) {
+                size_t colon = value.find(':', start);
+                ok = parse_probability(value.substr(start, colon == string::npos ? string::npos : colon - start), *fields[num_fields++]);
+                if (colon == string::npos) break;
+                start = colon + 1;
+            }
+            ok = ok && num_fields >= 2;
+        } else if (key == "rto") {
+            ok = parse_positive(value, config.retransmit_ms);
+        } else if (key == "reorder") {
+            ok = parse_probability(value, config.reorder);
+        } else if (key == "dup") {
+            ok = parse_probability(value, config.duplicate);
+        } else if (key == "rate") {
+            ok = parse_positive(value, config.rate_kbps);
+        } else if (key == "bucket") {
+            ok = parse_positive(value, number);
+            config.bucket_bytes = (uint32_t)number;
+        } else if (key == "queue") {
+            ok = parse_positive(value, config.max_queue_ms);
+        } else if (key == "seed") {
+            ok = parse_positive(value, number);
+            config.seed = (uint64_t)number;
+        } else {
+            ok = false;
+        }
+
+        if (!ok) return false;
+    }
+
+    return true;
+}
+
+int64_t impair_now_us() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void impair_init(ImpairLine& line, const ImpairConfig& config) {
+    line.config = config;
+    line.rng.seed(config.seed);
+    line.burst_bad = false;
+    line.tokens = config.bucket_bytes;
+    line.last_refill_us = 0;
+    line.last_due_us = 0;
+    line.next_order = 0;
+    line.in_flight.clear();
+    line.stats = {};
+}
+
+void impair_stats_add(ImpairStats& total, const ImpairStats& stats) {
+    total.received += stats.received;
+    total.delivered += stats.delivered;
+    total.lost += stats.lost;
+    total.retransmitted += stats.retransmitted;
+    total.rate_dropped += stats.rate_dropped;
+    total.overflow_dropped += stats.overflow_dropped;
+    total.duplicated += stats.duplicated;
+    total.reordered += stats.reordered;
+}
+
+static double uniform01(ImpairLine& line) {
+    return uniform_real_distribution<double>(0.0, 1.0)(line.rng);
+}
+
+static bool lose_packet(ImpairLine& line) {
+    const ImpairConfig& config = line.config;
+
+    if (config.burst_enter > 0.0) {
+        // Move between states first, then lose with the current state's probability
+        if (line.burst_bad) {
+            if (uniform01(line) < config.burst_exit) line.burst_bad = false;
+        } else {
+            if (uniform01(line) < config.burst_enter) line.burst_bad = true;
+        }
+        double loss = line.burst_bad ? config.burst_loss_bad : config.burst_loss_good;
+        if (uniform01(line) < loss) return true;
+    }
+
+    return config.loss > 0.0 && uniform01(line) < config.loss;
+}
+
+static int64_t sample_delay_us(ImpairLine& line) {
+    const ImpairConfig& config = line.config;
+    double delay_ms = config.delay_ms;
+
+    if (config.jitter_ms > 0.0) {
+        switch (config.jitter_dist) {
+        case JitterDist::Uniform:
+            delay_ms += uniform_real_distribution<double>(-config.jitter_ms, config.jitter_ms)(line.rng);
+            break;
+        case JitterDist::Normal:
+            delay_ms += normal_distribution<double>(0.0, config.jitter_ms)(line.rng);
+            break;
+        case JitterDist::Pareto: {
+            // Scale picked so the mean extra delay is jitter_ms
+            double scale = config.jitter_ms * (PARETO_SHAPE - 1.0) / PARETO_SHAPE;
+            delay_ms += scale / pow(1.0 - uniform01(line), 1.0 / PARETO_SHAPE);
+            break;
+        }
+        }
+    }
+
+    return delay_ms > 0.0 ? (int64_t)(delay_ms * 1000.0) : 0;
+}
+
+// Returns when the packet leaves the bucket or -1 if it would wait longer than the queue allows.
+// Streams wait as long as it takes, dropping a chunk would cut a message in half.
+static int64_t shape(ImpairLine& line, size_t len, bool stream, int64_t now_us) {
+    const ImpairConfig& config = line.config;
+    if (config.rate_kbps <= 0.0) return now_us;
+
+    double bytes_per_us = config.rate_kbps * 1000.0 / 8.0 / 1e6;
+    // Callers may use their own clock, the bucket starts full on the first packet
+    if (line.last_refill_us == 0) line.last_refill_us = now_us;
+    line.tokens = min<double>(config.bucket_bytes, line.tokens + (double)(now_us - line.last_refill_us) * bytes_per_us);
+    line.last_refill_us = now_us;
+
+    // Tokens go negative while packets queue up behind the bucket
+    double wait_us = line.tokens >= (double)len ? 0.0 : ((double)len - line.tokens) / bytes_per_us;
+    if (!stream && wait_us > config.max_queue_ms * 1000.0) return -1;
+
+    line.tokens -= (double)len;
+    return now_us + (int64_t)wait_us;
+}
+
+static bool due_later(const ImpairedPacket& a, const ImpairedPacket& b) {
+    return a.due_us != b.due_us ? a.due_us > b.due_us : a.order > b.order;
+}
+
+static void schedule(ImpairLine& line, const char* data, size_t len, const struct sockaddr_in* from, bool stream, int64_t due_us) {
+    if (!stream && line.in_flight.size() >= MAX_IMPAIRED_PACKETS) {
+        ++line.stats.overflow_dropped;
+        return;
+    }
+
+    line.in_flight.emplace_back();
+    ImpairedPacket& packet = line.in_flight.back();
+    packet.due_us = due_us;
+    packet.order = line.next_order++;
+    packet.from = from ? *from : sockaddr_in{};
+    packet.len = (uint16_t)min(len, MAX_IMPAIRED_PACKET_SIZE);
+    memcpy(packet.data, data, packet.len);
+    push_heap(line.in_flight.begin(), line.in_flight.end(), due_later);
+}
+
+void impair_push(ImpairLine& line, const char* data, size_t len, const struct sockaddr_in* from, bool stream, int64_t now_us) {
+    ++line.stats.received;
+
+    bool lost = lose_packet(line);
+    if (lost && !stream) {
+        ++line.stats.lost;
+        return;
+    }
+
+    int64_t sent_us = shape(line, len, stream, now_us);
+    if (sent_us < 0) {
+        ++line.stats.rate_dropped;
+        return;
+    }
+
+    int64_t due_us = sent_us + sample_delay_us(line);
+
+    if (stream) {
+        if (lost) {
+            due_us += (int64_t)(line.config.retransmit_ms * 1000.0);
+            ++line.stats.retransmitted;
+        }
+        due_us = max(due_us, line.last_due_us);
+        line.last_due_us = due_us;
+    } else if (line.config.reorder > 0.0 && uniform01(line) < line.config.reorder) {
+        due_us = sent_us;
+        ++line.stats.reordered;
+    }
+
+    schedule(line, data, len, from, stream, due_us);
+
+    if (!stream && line.config.duplicate > 0.0 && uniform01(line) < line.config.duplicate) {
+        ++line.stats.duplicated;
+        schedule(line, data, len, from, stream, sent_us + sample_delay_us(line));
+    }
+}
+
+const ImpairedPacket* impair_pop(ImpairLine& line, int64_t now_us) {
+    if (line.in_flight.empty() || line.in_flight.front().due_us > now_us) return nullptr;
+
+    // The popped packet ends up at the back, where it stays until the next push/pop
+    pop_heap(line.in_flight.begin(), line.in_flight.end(), due_later);
+    static thread_local ImpairedPacket popped;
+    popped = line.in_flight.back();
+    line.in_flight.pop_back();
+    ++line.stats.delivered;
+    return &popped;
+}
+
+int impair_timeout_ms(const ImpairLine& line, int64_t now_us) {
+    if (line.in_flight.empty()) return -1;
+    int64_t wait_us = line.in_flight.front().due_us - now_us;
+    return wait_us <= 0 ? 0 : (int)((wait_us + 999) / 1000);
+}
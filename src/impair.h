@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <random>
+#include <vector>
+
+/*
+ * In-process network impairment, emulates a bad link without tc/netem.
+ * It sits right after recv: what the socket returns goes into an ImpairLine and comes out once it's due, or never.
+ * Each process impairs what it receives, so a direction is configured on the receiving end
+ * (the host for client -> host traffic, a client for host -> client traffic).
+ *
+ * Datagrams go through everything. Streams (TCP) keep their order and never lose anything, a chunk that would have
+ * been lost is retransmitted instead: it arrives retransmit_ms late and holds back everything read after it, like a
+ * segment the kernel had to resend. Reordering and duplication don't apply to them, neither do the rate limiter's queue
+ * limit and MAX_IMPAIRED_PACKETS: a stream chunk waits behind the bucket however long it takes.
+ */
+
+enum class JitterDist {Uniform, Normal, Pareto};
+
+struct ImpairConfig {
+    // One-way delay added to everything
+    double delay_ms = 0.0;
+    // Uniform: +-jitter, Normal: standard deviation, Pareto: mean of a heavy-tailed extra delay
+    double jitter_ms = 0.0;
+    JitterDist jitter_dist = JitterDist::Uniform;
+
+    // Independent loss probability
+    double loss = 0.0;
+    // Streams only: extra delay of a lost chunk, Linux's minimum retransmission timeout by default
+    double retransmit_ms = 200.0;
+    // Gilbert-Elliott bursts: chance to enter/leave the bad state per packet and loss in each state, off while enter is 0
+    double burst_enter = 0.0;
+    double burst_exit = 0.0;
+    double burst_loss_bad = 1.0;
+    double burst_loss_good = 0.0;
+
+    // Chance for a packet to skip the delay and overtake the ones in flight
+    double reorder = 0.0;
+    double duplicate = 0.0;
+
+    // Token bucket, 0 is unlimited. Datagrams waiting for more than max_queue_ms are dropped
+    double rate_kbps = 0.0;
+    uint32_t bucket_bytes = 16 * 1024;
+    double max_queue_ms = 500.0;
+
+    uint64_t seed = 1;
+
+    bool enabled() const {
+        return delay_ms > 0.0 || jitter_ms > 0.0 || loss > 0.0 || burst_enter > 0.0 || reorder > 0.0
+            || duplicate > 0.0 || rate_kbps > 0.0;
+    }
+};
+
+/*
+ * Comma separated key=value list, e.g. "delay=50,jitter=10,jitter-dist=normal,loss=0.02,rate=256".
+ * Keys: delay, jitter (ms), jitter-dist (uniform|normal|pareto), loss, reorder, dup (probabilities),
+ * burst=ENTER:EXIT[:LOSS_BAD[:LOSS_GOOD]] (Gilbert-Elliott), rto (ms, streams' retransmit_ms), rate (kbit/s),
+ * bucket (bytes), queue (ms), seed.
+ */
+bool parse_impair_config(const char* spec, ImpairConfig& config);
+
+const size_t MAX_IMPAIRED_PACKET_SIZE = 2048;
+// Past that many datagrams in flight new ones are dropped, like a full router queue
+const size_t MAX_IMPAIRED_PACKETS = 4096;
+
+struct ImpairedPacket {
+    int64_t due_us = 0;
+    // Keeps packets due at the same time in arrival order
+    uint64_t order = 0;
+    struct sockaddr_in from = {};
+    uint16_t len = 0;
+    char data[MAX_IMPAIRED_PACKET_SIZE];
+};
+
+struct ImpairStats {
+    uint64_t received = 0;
+    uint64_t delivered = 0;
+    uint64_t lost = 0;
+    // Streams, lost and sent again
+    uint64_t retransmitted = 0;
+    // Datagrams only
+    uint64_t rate_dropped = 0;
+    uint64_t overflow_dropped = 0;
+    uint64_t duplicated = 0;
+    uint64_t reordered = 0;
+};
+
+struct ImpairLine {
+    ImpairConfig config;
+    std::mt19937_64 rng;
+    bool burst_bad = false;
+
+    double tokens = 0.0;
+    int64_t last_refill_us = 0;
+    // Streams never deliver out of order
+    int64_t last_due_us = 0;
+
+    uint64_t next_order = 0;
+    // Min-heap on (due_us, order)
+    std::vector<ImpairedPacket> in_flight;
+
+    ImpairStats stats;
+};
+
+void impair_init(ImpairLine& line, const ImpairConfig& config);
+
+void impair_stats_add(ImpairStats& total, const ImpairStats& stats);
+
+/*
+ * Takes what recv/recvfrom returned, `from` may be null for connected sockets.
+ * `stream` keeps the order, turns loss into retransmissions and skips reorder/duplication. Data longer than MAX_IMPAIRED_PACKET_SIZE is truncated.
+ */
+void impair_push(ImpairLine& line, const char* data, size_t len, const struct sockaddr_in* from, bool stream, int64_t now_us);
+
+/*
+ * Returns the oldest packet that is due, nullptr if none. It stays valid until the next push/pop.
+ */
+const ImpairedPacket* impair_pop(ImpairLine& line, int64_t now_us);
+
+/*
+ * Milliseconds until the next packet is due (rounded up), -1 when nothing is in flight
+ */
+int impair_timeout_ms(const ImpairLine& line, int64_t now_us);
+
+/*
+ * Steady clock for the now_us arguments, any monotonic microsecond clock works as long as a line sticks to one
+ */
+int64_t impair_now_us();
@@ -0,0 +1,155 @@
+#include "jitter_buffer.h"
+#include <cmath>
+#include <utility>
+#include "metrics.h"
+
+using namespace std;
+
+// Smoothing of the clock offset and of the jitter (same gain as RFC 3550's interarrival jitter)
+const double CLOCK_SMOOTHING = 0.05;
+const double JITTER_SMOOTHING = 1.0 / 16.0;
+// The delay covers that many mean deviations on top of the base delay
+const double JITTER_DELAY_FACTOR = 3.0;
+// Render time drifts at most that much faster/slower than real time to catch up with the target
+const double MAX_TIME_SCALE = 0.1;
+const double TIME_SCALE_GAIN = 0.05;
+// Past that distance from the target (in frames) the render time jumps instead of drifting
+const double RESYNC_THRESHOLD = 30.0;
+
+void jitter_buffer_init(JitterBuffer& jb, float tick_rate, float base_delay_ms) {
+    for (size_t i = 0; i < JITTER_BUFFER_CAPACITY; ++i) {
+        jb.states[i] = {};
+    }
+    jb.count = 0;
+    jb.tick_rate = tick_rate;
+    jb.base_delay = base_delay_ms * 0.001f * tick_rate;
+    jb.delay = jb.base_delay;
+    jb.has_clock = false;
+    jb.clock_offset = 0.0;
+    jb.jitter = 0.0;
+    jb.rendering = false;
+    jb.render_frame = 0.0;
+    jb.last_sample_time = 0.0;
+    jb.starved = false;
+    jb.stats = {};
+}
+
+static void update_clock(JitterBuffer& jb, uint64_t frame, double received_at) {
+    double offset = received_at * jb.tick_rate - (double)frame;
+    if (!jb.has_clock) {
+        jb.clock_offset = offset;
+        jb.has_clock = true;
+        return;
+    }
+
+    double deviation = offset - jb.clock_offset;
+    // Way off, the server restarted or we stalled for a long time
+    if (fabs(deviation) > RESYNC_THRESHOLD) {
+        jb.clock_offset = offset;
+        jb.jitter = 0.0;
+    } else {
+        jb.clock_offset += deviation * CLOCK_SMOOTHING;
+        jb.jitter += (fabs(deviation) - jb.jitter) * JITTER_SMOOTHING;
+    }
+
+    jb.delay = jb.base_delay + (float)(jb.jitter * JITTER_DELAY_FACTOR);
+}
+
+void jitter_buffer_insert(JitterBuffer& jb, GameStatePayload&& state, double received_at) {
+    update_clock(jb, state.server_command_frame, received_at);
+
+    // Nothing would ever interpolate toward it anymore
+    if (jb.rendering && jb.count > 0 && state.server_command_frame <= jb.states[0].server_command_frame
+        && (double)jb.states[0].server_command_frame <= jb.render_frame) {
+        ++jb.stats.late;
+        metrics_add(Counter::JitterLate);
+        return;
+    }
+
+    size_t pos = jb.count;
+    while (pos > 0 && jb.states[pos - 1].server_command_frame > state.server_command_frame) {
+        --pos;
+    }
+    if (pos > 0 && jb.states[pos - 1].server_command_frame == state.server_command_frame) return;
+
+    if (jb.count == JITTER_BUFFER_CAPACITY) {
+        ++jb.stats.overruns;
+        metrics_add(Counter::JitterOverruns);
+        if (pos == 0) return;
+
+        // Drop the oldest, its buffer is reused by the shifting below
+        for (size_t i = 1; i < jb.count; ++i) {
+            swap(jb.states[i - 1], jb.states[i]);
+        }
+        --jb.count;
+        --pos;
+    }
+
+    for (size_t i = jb.count; i > pos; --i) {
+        swap(jb.states[i], jb.states[i - 1]);
+    }
+    jb.states[pos] = std::move(state);
+    ++jb.count;
+}
+
+bool jitter_buffer_sample(JitterBuffer& jb, double now, const GameStatePayload*& from, const GameStatePayload*& to, float& t) {
+    if (jb.count == 0) return false;
+
+    double target = now * jb.tick_rate - jb.clock_offset - jb.delay;
+    if (!jb.rendering || fabs(target - jb.render_frame) > RESYNC_THRESHOLD) {
+        jb.render_frame = target;
+        jb.rendering = true;
+    } else {
+        // Drift toward the target instead of jumping so the playback speed stays steady
+        double scale = (target - jb.render_frame) * TIME_SCALE_GAIN;
+        if (scale > MAX_TIME_SCALE) scale = MAX_TIME_SCALE;
+        if (scale < -MAX_TIME_SCALE) scale = -MAX_TIME_SCALE;
+        jb.render_frame += (now - jb.last_sample_time) * jb.tick_rate * (1.0 + scale);
+    }
+    jb.last_sample_time = now;
+
+    // Release snapshots the render time is done with, keeping the one right before it
+    size_t num_old = 0;
+    while (num_old + 1 < jb.count && (double)jb.states[num_old + 1].server_command_frame <= jb.render_frame) {
+        ++num_old;
+    }
+    if (num_old > 0) {
+        for (size_t i = num_old; i < jb.count; ++i) {
+            swap(jb.states[i - num_old], jb.states[i]);
+        }
+        jb.count -= num_old;
+    }
+
+    const GameStatePayload& oldest = jb.states[0];
+    const GameStatePayload& newest = jb.states[jb.count - 1];
+
+    if (jb.render_frame <= (double)oldest.server_command_frame) {
+        from = to = &oldest;
+        t = 0.f;
+        jb.starved = false;
+        return true;
+    }
+
+    if (jb.count == 1) {
+        if (!jb.starved) {
+            ++jb.stats.underruns;
+            metrics_add(Counter::JitterUnderruns);
+            jb.starved = true;
+        }
+        from = to = &newest;
+        t = 0.f;
+        return true;
+    }
+
+    jb.starved = false;
+    from = &jb.states[0];
+    to = &jb.states[1];
+    t = (float)((jb.render_frame - (double)from->server_command_frame) / (double)(to->server_command_frame - from->server_command_frame));
+    return true;
+}
+
+uint64_t jitter_buffer_server_frame(const JitterBuffer& jb, double now) {
+    if (!jb.has_clock) return 0;
+    double frame = now * jb.tick_rate - jb.clock_offset;
+    return frame > 0.0 ? (uint64_t)frame : 0;
+}
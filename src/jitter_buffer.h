@@ -0,0 +1,64 @@
+#pragma once
+
+#include "protocol.h"
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Client side snapshot interpolation buffer.
+ * Snapshots are kept sorted by server_command_frame and rendered `delay` frames behind the estimated server clock,
+ * so there is normally a snapshot on each side of the render time to interpolate between.
+ * The server clock is estimated from arrival times, the delay grows with the measured arrival jitter on top of the configured base delay.
+ * Frames are server command frames, times are local seconds on a monotonic clock.
+ */
+const size_t JITTER_BUFFER_CAPACITY = 16;
+
+struct JitterBufferStats {
+    // Render time went past the newest snapshot, counted once per starvation
+    uint64_t underruns = 0;
+    // A snapshot arrived while the buffer was full, the oldest one was dropped
+    uint64_t overruns = 0;
+    // Snapshots that arrived after the render time already went past them
+    uint64_t late = 0;
+};
+
+struct JitterBuffer {
+    GameStatePayload states[JITTER_BUFFER_CAPACITY];
+    size_t count = 0;
+
+    float tick_rate = 0.f;
+    float base_delay = 0.f;
+    float delay = 0.f;
+
+    // Local clock in frames minus server frame, smoothed over arrivals
+    bool has_clock = false;
+    double clock_offset = 0.0;
+    // Mean deviation of arrivals from the estimated clock, in frames
+    double jitter = 0.0;
+
+    bool rendering = false;
+    double render_frame = 0.0;
+    double last_sample_time = 0.0;
+    bool starved = false;
+
+    JitterBufferStats stats;
+};
+
+void jitter_buffer_init(JitterBuffer& jb, float tick_rate, float base_delay_ms);
+
+/*
+ * Takes ownership of the snapshot, received_at is when the net thread got it
+ */
+void jitter_buffer_insert(JitterBuffer& jb, GameStatePayload&& state, double received_at);
+
+/*
+ * Advances the render time to `now` and returns the snapshots around it, `t` is the interpolation factor from `from` to `to`.
+ * Both point to the same snapshot when holding on the oldest or newest one, returns false while the buffer is empty.
+ * The pointers stay valid until the next insert/sample.
+ */
+bool jitter_buffer_sample(JitterBuffer& jb, double now, const GameStatePayload*& from, const GameStatePayload*& to, float& t);
+
+/*
+ * Estimated server command frame at `now`, 0 until a snapshot arrived
+ */
+uint64_t jitter_buffer_server_frame(const JitterBuffer& jb, double now);
@@ -0,0 +1,188 @@
+#include "jobs.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "trace.h"
+
+using namespace std;
+
+// Per worker, a group with more chunks than fit runs the excess inline
+const uint32_t JOB_QUEUE_CAPACITY = 256;
+const uint32_t MAX_JOB_WORKERS = 64;
+
+struct JobChunk {
+    JobGroup* group;
+    uint32_t begin;
+    uint32_t end;
+};
+
+// Chunks are coarse (thousands of items each), a lock per push/pop doesn't show up next to them
+struct JobQueue {
+    mutex mtx;
+    uint64_t head = 0;
+    uint64_t tail = 0;
+    JobChunk chunks[JOB_QUEUE_CAPACITY];
+};
+
+static vector<thread> workers;
+static unique_ptr<JobQueue[]> queues;
+static uint32_t num_workers = 0;
+
+// Workers sleep on it while every queue is empty
+static mutex sleep_mtx;
+static condition_variable wake_cv;
+static atomic<uint32_t> num_queued = 0;
+static atomic<bool> stopping = false;
+
+// Round-robin start for the next group, spreads concurrent callers over the queues
+static atomic<uint32_t> next_queue = 0;
+
+// Only used by the trace points, which may be compiled out
+[[maybe_unused]] static const char* WORKER_NAMES[MAX_JOB_WORKERS] = {
+    "job 0", "job 1", "job 2", "job 3", "job 4", "job 5", "job 6", "job 7",
+    "job 8", "job 9", "job 10", "job 11", "job 12", "job 13", "job 14", "job 15",
+    "job 16", "job 17", "job 18", "job 19", "job 20", "job 21", "job 22", "job 23",
+    "job 24", "job 25", "job 26", "job 27", "job 28", "job 29", "job 30", "job 31",
+    "job 32", "job 33", "job 34", "job 35", "job 36", "job 37", "job 38", "job 39",
+    "job 40", "job 41", "job 42", "job 43", "job 44", "job 45", "job 46", "job 47",
+    "job 48", "job 49", "job 50", "job 51", "job 52", "job 53", "job 54", "job 55",
+    "job 56", "job 57", "job 58", "job 59", "job 60", "job 61", "job 62", "job 63",
+};
+
+static void run_chunk(const JobChunk& chunk) {
+    chunk.group->run(chunk.group->ctx, chunk.begin, chunk.end);
+    // Last access to the group, the caller may return as soon as it reads 0
+    chunk.group->remaining.fetch_sub(1, memory_order_release);
+}
+
+static bool push_chunk(JobQueue& queue, const JobChunk& chunk) {
+    lock_guard<mutex> lock(queue.mtx);
+    if (queue.tail - queue.head == JOB_QUEUE_CAPACITY) return false;
+    queue.chunks[queue.tail++ % JOB_QUEUE_CAPACITY] = chunk;
+    num_queued.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+// The owner works from the back (most recently pushed, still warm), thieves from the front
+static bool pop_back(JobQueue& queue, JobChunk& chunk) {
+    lock_guard<mutex> lock(queue.mtx);
+    if (queue.head == queue.tail) return false;
+    chunk = queue.chunks[--queue.tail % JOB_QUEUE_CAPACITY];
+    num_queued.fetch_sub(1, memory_order_relaxed);
+    return true;
+}
+
+static bool pop_front(JobQueue& queue, JobChunk& chunk) {
+    lock_guard<mutex> lock(queue.mtx);
+    if (queue.head == queue.tail) return false;
+    chunk = queue.chunks[queue.head++ % JOB_QUEUE_CAPACITY];
+    num_queued.fetch_sub(1, memory_order_relaxed);
+    return true;
+}
+
+static bool steal(uint32_t first, JobChunk& chunk) {
+    for (uint32_t i = 0; i < num_workers; ++i) {
+        if (pop_front(queues[(first + i) % num_workers], chunk)) return true;
+    }
+    return false;
+}
+
+static void worker_main(uint32_t idx) {
+    TRACE_THREAD_NAME(WORKER_NAMES[idx]);
+    JobQueue& own = queues[idx];
+
+    while (true) {
+        JobChunk chunk;
+        if (pop_back(own, chunk) || steal(idx + 1, chunk)) {
+            TRACE_SCOPE("job_chunk");
+            run_chunk(chunk);
+            continue;
+        }
+
+        unique_lock<mutex> lock(sleep_mtx);
+        wake_cv.wait(lock, [] { return num_queued.load(memory_order_relaxed) > 0 || stopping.load(memory_order_relaxed); });
+        if (stopping.load(memory_order_relaxed)) return;
+    }
+}
+
+void jobs_init(uint32_t count) {
+    jobs_shutdown();
+
+    num_workers = min(count, MAX_JOB_WORKERS);
+    if (num_workers == 0) return;
+
+    stopping = false;
+    queues = make_unique<JobQueue[]>(num_workers);
+    for (uint32_t i = 0; i < num_workers; ++i) {
+        workers.emplace_back(worker_main, i);
+    }
+}
+
+void jobs_shutdown() {
+    {
+        lock_guard<mutex> lock(sleep_mtx);
+        stopping = true;
+    }
+    wake_cv.notify_all();
+
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    queues.reset();
+    num_workers = 0;
+}
+
+uint32_t jobs_num_workers() {
+    return num_workers;
+}
+
+void run_job_group(JobGroup& group, uint32_t begin, uint32_t end, uint32_t grain) {
+    if (begin >= end) return;
+    if (grain == 0) grain = 1;
+
+    uint32_t num_chunks = (end - begin - 1) / grain + 1;
+    if (num_workers == 0 || num_chunks == 1) {
+        group.run(group.ctx, begin, end);
+        return;
+    }
+
+    TRACE_SCOPE("parallel_for");
+    group.remaining.store(num_chunks, memory_order_relaxed);
+
+    // The first chunk is kept for the caller, the rest is dealt out
+    uint32_t first_queue = next_queue.fetch_add(1, memory_order_relaxed);
+    bool pushed_any = false;
+    for (uint32_t chunk_idx = 1; chunk_idx < num_chunks; ++chunk_idx) {
+        JobChunk chunk = {
+            .group = &group,
+            .begin = begin + chunk_idx * grain,
+            .end = chunk_idx == num_chunks - 1 ? end : begin + (chunk_idx + 1) * grain,
+        };
+        if (push_chunk(queues[(first_queue + chunk_idx) % num_workers], chunk)) {
+            pushed_any = true;
+        } else {
+            run_chunk(chunk);
+        }
+    }
+
+    if (pushed_any) {
+        // Taking the lock orders the pushes before any worker's predicate check, no wake-up gets lost
+        { lock_guard<mutex> lock(sleep_mtx); }
+        wake_cv.notify_all();
+    }
+
+    run_chunk({.group = &group, .begin = begin, .end = min(end, begin + grain)});
+
+    // Help with whatever is queued (this group's chunks or another caller's) until every chunk of ours is done
+    while (group.remaining.load(memory_order_acquire) > 0) {
+        JobChunk chunk;
+        if (steal(first_queue, chunk)) {
+            run_chunk(chunk);
+        } else {
+            this_thread::yield();
+        }
+    }
+}
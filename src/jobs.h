@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+/*
+ * Small work-stealing thread pool for data-parallel loops. parallel_for cuts a range into chunks of `grain` items,
+ * deals them round-robin onto the workers' queues and helps running them until they're all done. Idle workers take
+ * from the back of their own queue and steal from the front of the others'.
+ *
+ * Chunk boundaries only depend on the range and the grain, never on the thread count, so as long as each chunk writes
+ * its own items the results are the same with 1 or N threads. Any thread can call parallel_for, including from
+ * inside a chunk, and a range that fits one chunk (or a pool without workers) runs inline on the caller.
+ */
+
+struct JobGroup {
+    void (*run)(void* ctx, uint32_t begin, uint32_t end);
+    void* ctx;
+    std::atomic<uint32_t> remaining;
+};
+
+/*
+ * Starts `num_workers` threads, 0 runs everything on the calling threads. Not thread-safe, call before anything uses the pool.
+ */
+void jobs_init(uint32_t num_workers);
+void jobs_shutdown();
+uint32_t jobs_num_workers();
+
+void run_job_group(JobGroup& group, uint32_t begin, uint32_t end, uint32_t grain);
+
+/*
+ * Calls fn(chunk_begin, chunk_end) over [begin, end[ and returns once every chunk ran
+ */
+template <typename Fn>
+void parallel_for(uint32_t begin, uint32_t end, uint32_t grain, Fn&& fn) {
+    using Callable = std::remove_reference_t<Fn>;
+    JobGroup group = {
+        .run = [](void* ctx, uint32_t chunk_begin, uint32_t chunk_end) { (*static_cast<Callable*>(ctx))(chunk_begin, chunk_end); },
+        .ctx = const_cast<void*>(static_cast<const void*>(std::addressof(fn))),
+        .remaining = 0,
+    };
+    run_job_group(group, begin, end, grain);
+}
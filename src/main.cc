@@ -1,8 +1,14 @@
 #include "game.h"
+#include "headless.h"
+#include "jobs.h"
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <print>
 #include <thread>
 #include "net.h"
+#include "sim.h"
+#include "trace.h"
 
 using namespace std;
 
@@ -10,18 +16,124 @@ int main(int argc, char* argv[]) {
 
     thread net_thread;
 
-    bool host_mode = argc > 1 && (strcmp(argv[1], "--host") || strcmp(argv[1], "-h"));
+    bool host_mode = false;
+    bool headless = false;
+    Transport transport = Transport::Tcp;
+    float interp_delay_ms = DEFAULT_INTERP_DELAY_MS;
+    ImpairConfig impair_config;
+    // Host only by default, clients on the same machine would fight over the port
+    int metrics_port = -1;
+    const char* trace_path = nullptr;
+    const char* record_path = nullptr;
+    uint32_t num_entities = DEFAULT_ENTITY_COUNT;
+    float entity_lifetime_s = 0.f;
+    float max_rewind_ms = DEFAULT_MAX_REWIND_MS;
+    bool lockstep = false;
+    // Threads running parallel loops, the calling thread included
+    uint32_t num_jobs = max(1u, thread::hardware_concurrency());
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--host") == 0 || strcmp(argv[i], "-h") == 0) {
+            host_mode = true;
+        } else if (strcmp(argv[i], "--udp") == 0) {
+            transport = Transport::Udp;
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            // Only a host can run without a window
+            host_mode = true;
+            headless = true;
+        } else if (strcmp(argv[i], "--interp-delay") == 0 && i + 1 < argc) {
+            interp_delay_ms = strtof(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--entities") == 0 && i + 1 < argc) {
+            // Host and clients must pass the same count
+            num_entities = (uint32_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--entity-lifetime") == 0 && i + 1 < argc) {
+            // Host only (every peer in lockstep), seconds before spawned entities despawn and free their slot
+            entity_lifetime_s = strtof(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--max-rewind") == 0 && i + 1 < argc) {
+            // Host only, how far back in ms client events are lag compensated
+            max_rewind_ms = strtof(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--lockstep") == 0) {
+            // Host and clients must all pass it
+            lockstep = true;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            num_jobs = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            // Host only, see recording.h
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            metrics_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--impair") == 0 && i + 1 < argc) {
+            // Applies to what this process receives, e.g. --impair delay=50,jitter=10,loss=0.02
+            if (!parse_impair_config(argv[++i], impair_config)) {
+                println("Invalid impairment spec {}, see impair.h", argv[i]);
+                return 1;
+            }
+        }
+    }
+
+    if (impair_config.enabled()) {
+        println("Impairing received traffic: {}ms delay, {}ms jitter, {} loss, {} kbit/s",
+                impair_config.delay_ms, impair_config.jitter_ms, impair_config.loss, impair_config.rate_kbps);
+        set_network_impairment(impair_config);
+    }
+
+    println("Using {} transport", transport == Transport::Udp ? "UDP" : "TCP");
+
+    set_lockstep(lockstep);
+    if (!set_entity_capacity(num_entities)) {
+        println("Invalid entity count {}", num_entities);
+        return 1;
+    }
+    println("{} entity slots, {} update kernel", num_entities, entity_kernel_name(best_entity_kernel()));
+    set_entity_lifetime(entity_lifetime_s);
+    if (lockstep) {
+        println("Lockstep mode");
+    } else if (host_mode) {
+        set_snapshot_size_limit(max_game_state_size(transport == Transport::Tcp));
+        set_max_rewind(max_rewind_ms);
+        println("Lag compensation up to {}ms back", max_rewind_ms);
+    }
+
+    // Before any thread that may run a parallel loop
+    jobs_init(num_jobs - 1);
+    println("{} job threads", num_jobs);
+
+    if (metrics_port < 0) {
+        metrics_port = host_mode ? DEFAULT_METRICS_PORT : 0;
+    }
+    set_metrics_port((uint16_t)metrics_port);
+
+    if (host_mode && record_path) {
+        if (!set_recording(record_path, num_entities)) return 1;
+        println("Recording to {}", record_path);
+    }
+
+    TRACE_THREAD_NAME("game");
+    if (trace_path) {
+        trace_set_output(trace_path);
+    }
 
     if (host_mode) {
         println("Host mode");       
-        net_thread = thread(run_host); 
+        net_thread = thread(run_host, transport); 
     } else {
         println("Client mode");
-        net_thread = thread(run_client); 
+        net_thread = thread(run_client, transport); 
     }
 
-    run_game(host_mode);
+    if (headless) {
+        run_headless_host();
+    } else {
+        run_game(host_mode, interp_delay_ms);
+    }
 
     stop_net();
     net_thread.join();
+    jobs_shutdown();
+
+    if (trace_path) {
+        trace_flush();
+    }
 }
@@ -0,0 +1,103 @@
+#include "metrics.h"
+#include <format>
+#include <mutex>
+
+using namespace std;
+
+struct MetricInfo {
+    const char* name;
+    const char* help;
+};
+
+static const MetricInfo COUNTER_INFO[] = {
+    {"netgame_ticks_total", "Simulation ticks run"},
+    {"netgame_spawns_total", "Entities spawned, by this client or received by the host"},
+    {"netgame_spawns_rejected_total", "Spawns the host dropped because every slot was taken"},
+    {"netgame_spawns_remapped_total", "Spawns without a valid lease the host had to find a slot for"},
+    {"netgame_prediction_corrections_total", "Own entities rewound and replayed because a snapshot disagreed with the prediction"},
+    {"netgame_despawns_total", "Entities the host despawned at the end of their lifetime"},
+    {"netgame_lockstep_desyncs_total", "Lockstep checksums that didn't match the host's"},
+    {"netgame_snapshots_sent_total", "Snapshots sent, one per client"},
+    {"netgame_snapshots_capped_total", "Snapshots the host left entities out of because they didn't all fit"},
+    {"netgame_snapshots_received_total", "Snapshots decoded"},
+    {"netgame_snapshots_dropped_total", "Received snapshots dropped because the game thread fell behind"},
+    {"netgame_jitter_underruns_total", "Times the jitter buffer ran dry and rendering held the last snapshot"},
+    {"netgame_jitter_overruns_total", "Snapshots the full jitter buffer had to drop"},
+    {"netgame_jitter_late_total", "Snapshots that arrived after rendering had moved past them"},
+    {"netgame_bytes_sent_total", "Bytes sent over the game sockets"},
+    {"netgame_bytes_received_total", "Bytes received over the game sockets"},
+};
+static_assert(size(COUNTER_INFO) == (size_t)Counter::Count);
+
+static const MetricInfo GAUGE_INFO[] = {
+    {"netgame_connected_clients", "Clients connected to the host"},
+};
+static_assert(size(GAUGE_INFO) == (size_t)Gauge::Count);
+
+static const MetricInfo HISTOGRAM_INFO[] = {
+    {"netgame_tick_duration_seconds", "Time spent simulating a tick"},
+    {"netgame_serialize_duration_seconds", "Time spent encoding a snapshot"},
+    {"netgame_deserialize_duration_seconds", "Time spent decoding a snapshot"},
+};
+static_assert(size(HISTOGRAM_INFO) == (size_t)Histogram::Count);
+
+thread_local MetricsShard* local_metrics_shard = nullptr;
+atomic<int64_t> gauges[(size_t)Gauge::Count];
+
+// Shards are only ever prepended, the lock is taken once per thread and on scrapes
+static mutex shards_mtx;
+static MetricsShard* shards = nullptr;
+
+MetricsShard* register_metrics_shard() {
+    MetricsShard* shard = new MetricsShard();
+
+    lock_guard<mutex> lock(shards_mtx);
+    shard->next = shards;
+    shards = shard;
+    local_metrics_shard = shard;
+    return shard;
+}
+
+void render_metrics(string& out) {
+    lock_guard<mutex> lock(shards_mtx);
+
+    for (size_t i = 0; i < (size_t)Counter::Count; ++i) {
+        uint64_t total = 0;
+        for (const MetricsShard* shard = shards; shard; shard = shard->next) {
+            total += shard->counters[i].load(memory_order_relaxed);
+        }
+        out += format("# HELP {} {}\n# TYPE {} counter\n{} {}\n", COUNTER_INFO[i].name, COUNTER_INFO[i].help,
+                      COUNTER_INFO[i].name, COUNTER_INFO[i].name, total);
+    }
+
+    for (size_t i = 0; i < (size_t)Gauge::Count; ++i) {
+        out += format("# HELP {} {}\n# TYPE {} gauge\n{} {}\n", GAUGE_INFO[i].name, GAUGE_INFO[i].help,
+                      GAUGE_INFO[i].name, GAUGE_INFO[i].name, gauges[i].load(memory_order_relaxed));
+    }
+
+    for (size_t i = 0; i < (size_t)Histogram::Count; ++i) {
+        const char* name = HISTOGRAM_INFO[i].name;
+        out += format("# HELP {} {}\n# TYPE {} histogram\n", name, HISTOGRAM_INFO[i].help, name);
+
+        // Prometheus buckets are cumulative
+        uint64_t count = 0;
+        uint64_t sum_ns = 0;
+        for (int bucket = 0; bucket <= HISTOGRAM_BUCKETS; ++bucket) {
+            for (const MetricsShard* shard = shards; shard; shard = shard->next) {
+                count += shard->histograms[i].buckets[bucket].load(memory_order_relaxed);
+            }
+
+            if (bucket < HISTOGRAM_BUCKETS) {
+                double upper_bound = (double)(1ull << (HISTOGRAM_BASE_SHIFT + bucket)) * 1e-9;
+                out += format("{}_bucket{{le=\"{}\"}} {}\n", name, upper_bound, count);
+            } else {
+                out += format("{}_bucket{{le=\"+Inf\"}} {}\n", name, count);
+            }
+        }
+
+        for (const MetricsShard* shard = shards; shard; shard = shard->next) {
+            sum_ns += shard->histograms[i].sum_ns.load(memory_order_relaxed);
+        }
+        out += format("{}_sum {}\n{}_count {}\n", name, (double)sum_ns * 1e-9, name, count);
+    }
+}
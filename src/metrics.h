@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Process-wide counters, gauges and histograms, rendered in the Prometheus text format on the net thread (see net.cc).
+ * Each thread records into its own shard with relaxed load/store pairs: no lock and no read-modify-write on the hot path,
+ * a scrape sums the shards and may miss the samples being written at that moment.
+ */
+
+enum class Counter {
+    Ticks,
+    Spawns,
+    // Host side: spawns dropped because every slot was taken, and spawns that came without a valid lease
+    SpawnsRejected,
+    SpawnsRemapped,
+    // Client side: own entities rewound and replayed because a snapshot disagreed with the prediction
+    PredictionCorrections,
+    Despawns,
+    // Lockstep: checksums that didn't match the host's, counted by the client that desynced and by the host
+    LockstepDesyncs,
+    SnapshotsSent,
+    // Host side: snapshots that couldn't hold every entity, the last ones were left out
+    SnapshotsCapped,
+    SnapshotsReceived,
+    // Pushed by the net thread while the game thread's ring was full
+    SnapshotsDropped,
+    // Client side, see JitterBufferStats
+    JitterUnderruns,
+    JitterOverruns,
+    JitterLate,
+    BytesSent,
+    BytesReceived,
+    Count
+};
+
+enum class Gauge {
+    ConnectedClients,
+    Count
+};
+
+enum class Histogram {
+    TickDuration,
+    SerializeDuration,
+    DeserializeDuration,
+    Count
+};
+
+/*
+ * Bucket i holds samples up to 256ns << i (256ns to ~134ms), the last one is +Inf
+ */
+const int HISTOGRAM_BUCKETS = 20;
+const int HISTOGRAM_BASE_SHIFT = 8;
+
+struct HistogramShard {
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS + 1];
+    std::atomic<uint64_t> sum_ns;
+};
+
+struct MetricsShard {
+    std::atomic<uint64_t> counters[(size_t)Counter::Count];
+    HistogramShard histograms[(size_t)Histogram::Count];
+    MetricsShard* next = nullptr;
+};
+
+extern thread_local MetricsShard* local_metrics_shard;
+extern std::atomic<int64_t> gauges[(size_t)Gauge::Count];
+
+/*
+ * First call on a thread allocates its shard, it's never freed so what a thread recorded outlives it
+ */
+MetricsShard* register_metrics_shard();
+
+inline MetricsShard& metrics_shard() {
+    MetricsShard* shard = local_metrics_shard;
+    return shard ? *shard : *register_metrics_shard();
+}
+
+// Only the owning thread writes, a plain load+store is enough
+inline void metrics_bump(std::atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+inline void metrics_add(Counter counter, uint64_t amount = 1) {
+    metrics_bump(metrics_shard().counters[(size_t)counter], amount);
+}
+
+inline void metrics_set(Gauge gauge, int64_t value) {
+    gauges[(size_t)gauge].store(value, std::memory_order_relaxed);
+}
+
+inline int histogram_bucket(uint64_t ns) {
+    uint64_t scaled = ns == 0 ? 0 : (ns - 1) >> HISTOGRAM_BASE_SHIFT;
+    int bucket = scaled == 0 ? 0 : 64 - __builtin_clzll(scaled);
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS;
+}
+
+inline void metrics_observe(Histogram histogram, uint64_t ns) {
+    HistogramShard& shard = metrics_shard().histograms[(size_t)histogram];
+    metrics_bump(shard.buckets[histogram_bucket(ns)], 1);
+    metrics_bump(shard.sum_ns, ns);
+}
+
+inline uint64_t metrics_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Appends every metric in the Prometheus text exposition format
+ */
+void render_metrics(std::string& out);
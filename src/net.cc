@@ -1,146 +1,951 @@
-#include <cassert>
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <format>
 #include <print>
+#include <string>
+#include <unordered_map>
 #include <utility>
 #include <memory>
-#include <sys/_types/_socklen_t.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <poll.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 #include "game.h"
+#include "impair.h"
+#include "jobs.h"
+#include "metrics.h"
 #include "net.h"
+#include "poller.h"
+#include "recording.h"
+#include "reliability.h"
+#include "trace.h"
 
-const uint16_t PORT = 12345;
-const uint16_t MAX_CLIENTS = 255;
+const uint16_t MAX_CLIENTS = 4096;
+// Clients only send spawns and acks, they don't need the big ring snapshots are read into
+const size_t CLIENT_RECV_RING_CAPACITY = 4 * 1024;
+const int MAX_POLL_EVENTS = 64;
+const size_t MAX_DATAGRAM_SIZE = 2048;
+const int UDP_CONNECT_RETRY_MS = 250;
+const int UDP_PEER_TIMEOUT_MS = 3000;
+// One encoding per baseline the history can hold, plus the full snapshot
+const size_t ENCODED_SNAPSHOT_CACHE_SIZE = SNAPSHOT_HISTORY_SIZE + 1;
+// Clients per job when sending snapshots, fewer are served inline on the net thread
+const uint32_t CLIENT_JOB_GRAIN = 64;
+// Lockstep frames kept for late joiners, a few MiB. Frames only carry spawns every so often, that's a long session.
+const size_t MAX_LOCKSTEP_LOG_FRAMES = 64 * 1024;
+const size_t NO_QUEUED_SNAPSHOT = SIZE_MAX;
+// Spawns and their acks go over the UDP reliable channel as whole frames
+static_assert(MSG_HEADER_SIZE + sizeof(SpawnEntityPayload) <= MAX_RELIABLE_MSG_SIZE);
+static_assert(MSG_HEADER_SIZE + sizeof(SpawnAcksPayload) <= MAX_RELIABLE_MSG_SIZE);
+static_assert(MSG_HEADER_SIZE + sizeof(LockstepFramePayload) <= MAX_RELIABLE_MSG_SIZE);
+static_assert(MSG_HEADER_SIZE + sizeof(LockstepChecksumPayload) <= MAX_RELIABLE_MSG_SIZE);
+// Concurrent scrapes, more just wait in the listen backlog
+const int MAX_METRICS_CONNS = 4;
+const size_t MAX_METRICS_REQUEST_SIZE = 2048;
+
+#ifndef MSG_NOSIGNAL
+// macOS doesn't have it, SIGPIPE is disabled per socket with SO_NOSIGPIPE instead
+#define MSG_NOSIGNAL 0
+#endif
+
+struct EncodedSnapshot {
+    // What the client acked, nullptr for a full snapshot
+    const GameStatePayload* baseline = nullptr;
+    bool is_delta = false;
+    uint64_t baseline_frame = 0;
+    size_t len = 0;
+    // snapshot_frame_size bytes
+    std::unique_ptr<char[]> buff = nullptr;
+};
+
+struct MetricsConn {
+    int fd = -1;
+    size_t request_len = 0;
+    char request[MAX_METRICS_REQUEST_SIZE];
+    std::string response;
+    size_t sent = 0;
+};
+
+struct UdpPeer {
+    struct sockaddr_in addr = {};
+    UdpConnection conn;
+    std::chrono::steady_clock::time_point last_received;
+};
 
 using namespace std;
 
-static bool net_task_running = true;
+static atomic<bool> net_task_running = true;
 
 static uint16_t num_clients = 0;
 static Client clients[MAX_CLIENTS];
 static Host host = {};
+static Poller poller = {};
+static Transport transport = Transport::Tcp;
+// Biggest snapshot frame on this transport, header included, see max_game_state_size
+static size_t snapshot_frame_size = 0;
+// Host side, room for a snapshot being sent plus the next one waiting behind it
+static size_t send_queue_capacity = 0;
+
+// Client side: guards the connection to the host, spawns are sent from the game thread while the net thread sends acks.
+// Host side, clients[] and everything sent to them belong to the net thread alone.
+static mutex net_mtx;
+// Host side, parallel to clients[]
+static UdpPeer udp_peers[MAX_CLIENTS];
+// Host side, index in clients[] by TCP fd (-1 for other fds) and by UDP address, kept up to date by the swap-removes
+static vector<int> client_by_fd;
+static unordered_map<uint64_t, uint16_t> udp_peer_by_addr;
+// Client side
+static UdpConnection udp_server_conn;
+
+// Snapshots sent by the host or received by the client, used as delta baselines
+static SnapshotHistory host_history;
+static SnapshotHistory client_history;
+// Clients acking the same snapshot share one encoding, only a few distinct baselines are in flight at once
+static EncodedSnapshot encoded_snapshots[ENCODED_SNAPSHOT_CACHE_SIZE];
+// Host side, parallel to clients[]: index of the encoding each client gets and whether sending it failed
+static uint8_t client_encodings[MAX_CLIENTS];
+static bool client_send_failed[MAX_CLIENTS];
+
+// Latest snapshot handed over by the game thread, replaced if the net thread didn't pick the previous one up yet.
+// Spawn acks and lockstep frames can't be replaced, they pile up until the net thread takes them.
+static mutex pending_snapshot_mtx;
+static GameStatePayload pending_snapshot;
+static bool has_pending_snapshot = false;
+static vector<ClientSpawnAcks> pending_spawn_acks;
+static vector<LockstepFramePayload> pending_lockstep_frames;
+// Net thread's side of the pending vectors, swapped with them so neither reallocates once warmed up
+static vector<ClientSpawnAcks> spawn_acks_to_send;
+static vector<LockstepFramePayload> lockstep_frames_to_send;
+
+// Net thread, lockstep: every frame that carried spawns or a checksum, late joiners start from the first one.
+// Once it's full joins are refused and it only keeps what some client hasn't got yet, starting at lockstep_log_start.
+static vector<LockstepFramePayload> lockstep_log;
+static size_t lockstep_log_start = 0;
+static bool lockstep_log_full = false;
+static LockstepFramePayload latest_lockstep_frame;
+static bool has_lockstep_frame = false;
+
+static ImpairConfig impair_config;
+static bool impair_enabled = false;
+// Datagrams all come in on one socket so they share a line, TCP clients have their own
+static ImpairLine udp_impair;
+// Lines of the clients that are gone, reported at exit
+static ImpairStats impair_totals;
+
+static uint32_t next_client_id = 0;
+// Host side, only open when asked for with set_recording. Written by the net thread alone.
+static Recorder recorder;
+static uint16_t metrics_port = 0;
+static int metrics_fd = -1;
+static MetricsConn metrics_conns[MAX_METRICS_CONNS];
 
 void stop_net() {
     net_task_running = false;
+    poller_wake(poller);
 }
 
-size_t serialize_game_state(char* buff, size_t buff_len, const GameStatePayload& payload) {
-    assert(buff_len > sizeof payload && format("Provided buffer length is guaranteed to not fit a minimal game state payload. {} {}", __FILE__, __LINE__).c_str());
+void set_network_impairment(const ImpairConfig& config) {
+    impair_config = config;
+    impair_enabled = config.enabled();
+}
 
-    size_t offset = 0;
-    memcpy(buff + offset, &payload.server_command_frame, sizeof payload.server_command_frame);
-    offset = sizeof payload.server_command_frame;
+// Shortens timeout_ms so the poller wakes up when the next held back packet is due
+static int impair_wait_ms(const ImpairLine& line, int timeout_ms) {
+    int due_ms = impair_timeout_ms(line, impair_now_us());
+    if (due_ms < 0) return timeout_ms;
+    return timeout_ms < 0 ? due_ms : min(timeout_ms, due_ms);
+}
 
-    memcpy(buff + offset, &payload.player_pos, sizeof payload.player_pos);
-    offset += sizeof payload.player_pos;
+// Same as ring_recv but the bytes go to the line, release them into the ring once they're due
+static ssize_t impaired_recv(ImpairLine& line, int fd, int flags) {
+    char buff[MAX_IMPAIRED_PACKET_SIZE];
+    ssize_t len = recv(fd, buff, sizeof buff, flags);
+    if (len > 0) {
+        impair_push(line, buff, len, nullptr, true, impair_now_us());
+    }
+    return len;
+}
 
-    memcpy(buff + offset, &payload.player_angle, sizeof payload.player_angle);
-    offset += sizeof payload.player_angle;
+bool set_recording(const char* path, uint32_t num_entities) {
+    return recorder_open(recorder, path, num_entities);
+}
 
-    memcpy(buff + offset, &payload.num_entities, sizeof payload.num_entities);
-    offset += sizeof payload.num_entities;
+static void record_spawn(uint32_t client_id, const SpawnEntityPayload& payload) {
+    if (!recorder_is_open(recorder)) return;
+    char frame[MSG_HEADER_SIZE + sizeof(SpawnEntityPayload)];
+    size_t len = write_spawn_entity_frame(frame, sizeof frame, payload);
+    recorder_append(recorder, client_id, frame, len);
+}
 
-    assert(buff_len - offset >= sizeof(EntityPayload) * payload.num_entities && format("Provided buffer is too small to fit all entities. {} {}", __FILE__, __LINE__).c_str());
+// The full encoding, shared with the clients that got one. Otherwise encoded just for the recording.
+static void record_snapshot(const GameStatePayload& game_state, size_t num_encoded) {
+    if (!recorder_is_open(recorder)) return;
+    for (size_t i = 0; i < num_encoded; ++i) {
+        if (encoded_snapshots[i].is_delta) continue;
+        recorder_append(recorder, RECORDING_HOST, encoded_snapshots[i].buff.get(), encoded_snapshots[i].len);
+        return;
+    }
 
-    for (size_t i = 0; i < payload.num_entities; ++i) {
-        memcpy(buff + offset, payload.entities.get() + i, sizeof(EntityPayload));
-        offset += sizeof(EntityPayload);
+    // Every encoding was a delta, the spare slot past them holds the full one
+    EncodedSnapshot& full = encoded_snapshots[num_encoded];
+    full.len = write_game_state_frame(full.buff.get(), snapshot_frame_size, game_state);
+    if (full.len > 0) {
+        recorder_append(recorder, RECORDING_HOST, full.buff.get(), full.len);
     }
+}
 
-    return offset;
+static void close_recording() {
+    if (!recorder_is_open(recorder)) return;
+    println("Recorded {} messages, {} KB", recorder.num_records, recorder.pos / 1024);
+    recorder_close(recorder);
 }
 
-void deserialize_game_state(char* msg, size_t msg_len, GameStatePayload& game_state) {
-    size_t offset = 0;
-    memcpy(&game_state.server_command_frame, msg + offset, sizeof game_state.server_command_frame);
-    offset += sizeof game_state.server_command_frame;
+void set_metrics_port(uint16_t port) {
+    metrics_port = port;
+}
 
-    memcpy(&game_state.player_pos, msg + offset, sizeof game_state.player_pos);
-    offset += sizeof game_state.player_pos;
+static void open_metrics_endpoint() {
+    if (metrics_port == 0) return;
 
-    memcpy(&game_state.player_angle, msg + offset, sizeof game_state.player_angle);
-    offset += sizeof game_state.player_angle;
+    metrics_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (metrics_fd < 0) {
+        println("Failed to create metrics socket");
+        return;
+    }
 
-    memcpy(&game_state.num_entities, msg + offset, sizeof game_state.num_entities);
-    offset += sizeof game_state.num_entities;
+    int opt_val = 1;
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof(opt_val));
 
-    assert(msg_len - offset >= sizeof(EntityPayload) * game_state.num_entities && "Provided message is too small to fit all entities."); 
+    // Local only, there's nothing to authenticate scrapers with
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(metrics_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-    game_state.entities = unique_ptr<EntityPayload[]>(new EntityPayload[game_state.num_entities]);
-    for (size_t i = 0; i < game_state.num_entities; ++i) {
-        //WARN: fine for now, will break if we introduce dynamic array data in EntityPayload
-        memcpy(game_state.entities.get() + i, msg + offset, sizeof(EntityPayload));
-        offset += sizeof(EntityPayload);
+    if (bind(metrics_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(metrics_fd, MAX_METRICS_CONNS) < 0
+        || set_non_blocking(metrics_fd) < 0 || poller_add(poller, metrics_fd) < 0) {
+        println("Failed to serve metrics on port {}", metrics_port);
+        close(metrics_fd);
+        metrics_fd = -1;
+        return;
     }
+
+    println("Serving metrics on http://127.0.0.1:{}/metrics", metrics_port);
 }
 
-void deserialize_spawn_entity(char* msg, size_t msg_len, SpawnEntityPayload& payload) {
-    memcpy(&payload, msg, msg_len);
+static void close_metrics_conn(MetricsConn& conn) {
+    poller_remove(poller, conn.fd);
+    close(conn.fd);
+    conn.fd = -1;
+    conn.response.clear();
 }
 
-void poll_new_connections(struct pollfd* incoming_poll, struct pollfd client_evt_listeners[MAX_CLIENTS]) {
+static void close_metrics_endpoint() {
+    for (MetricsConn& conn : metrics_conns) {
+        if (conn.fd >= 0) close_metrics_conn(conn);
+    }
+    if (metrics_fd >= 0) {
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
+}
+
+static void render_client_metrics(string& out) {
+    out += "# HELP netgame_client_bytes_sent_total Bytes sent to each connected client\n# TYPE netgame_client_bytes_sent_total counter\n";
+    for (uint16_t i = 0; i < num_clients; ++i) {
+        out += format("netgame_client_bytes_sent_total{{client=\"{}\"}} {}\n", clients[i].id, clients[i].bytes_sent);
+    }
+    out += "# HELP netgame_client_bytes_received_total Bytes received from each connected client\n# TYPE netgame_client_bytes_received_total counter\n";
+    for (uint16_t i = 0; i < num_clients; ++i) {
+        out += format("netgame_client_bytes_received_total{{client=\"{}\"}} {}\n", clients[i].id, clients[i].bytes_received);
+    }
+}
+
+static void build_metrics_response(MetricsConn& conn) {
+    TRACE_SCOPE("build_metrics_response");
+    string_view request(conn.request, conn.request_len);
+    string body;
+    const char* status = "200 OK";
+
+    if (request.starts_with("GET /metrics ") || request.starts_with("GET /metrics?")) {
+        render_metrics(body);
+        render_client_metrics(body);
+    } else {
+        status = "404 Not Found";
+        body = "Only /metrics is served here\n";
+    }
+
+    conn.response = format("HTTP/1.1 {}\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\nConnection: close\r\n\r\n",
+                           status, body.size());
+    conn.response += body;
+    conn.sent = 0;
+}
+
+// Returns false once the response is out or the scraper went away
+static bool flush_metrics_conn(MetricsConn& conn) {
+    while (conn.sent < conn.response.size()) {
+        ssize_t sent = send(conn.fd, conn.response.data() + conn.sent, conn.response.size() - conn.sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn.sent += sent;
+    }
+    return false;
+}
+
+static void accept_metrics_conns() {
+    while (true) {
+        int fd = accept(metrics_fd, nullptr, nullptr);
+        if (fd < 0) return;
+
+        MetricsConn* conn = nullptr;
+        for (MetricsConn& candidate : metrics_conns) {
+            if (candidate.fd < 0) {
+                conn = &candidate;
+                break;
+            }
+        }
+
+        if (conn == nullptr || set_non_blocking(fd) < 0 || poller_add(poller, fd) < 0) {
+            close(fd);
+            continue;
+        }
+
+#ifdef SO_NOSIGPIPE
+        int no_sigpipe = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
+
+        conn->fd = fd;
+        conn->request_len = 0;
+        conn->response.clear();
+    }
+}
+
+static void read_metrics_request(MetricsConn& conn) {
+    while (conn.request_len < sizeof conn.request) {
+        ssize_t len = recv(conn.fd, conn.request + conn.request_len, sizeof conn.request - conn.request_len, 0);
+        if (len < 0 && errno == EINTR) continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (len <= 0) {
+            close_metrics_conn(conn);
+            return;
+        }
+        conn.request_len += len;
+    }
+
+    // Headers aren't looked at, only the request line matters
+    if (string_view(conn.request, conn.request_len).find("\r\n\r\n") == string_view::npos) {
+        if (conn.request_len == sizeof conn.request) close_metrics_conn(conn);
+        return;
+    }
+
+    build_metrics_response(conn);
+    if (!flush_metrics_conn(conn)) close_metrics_conn(conn);
+}
+
+// Returns true if the event belonged to the metrics endpoint
+static bool handle_metrics_event(const PollerEvent& evt) {
+    if (metrics_fd < 0) return false;
+
+    if (evt.fd == metrics_fd) {
+        accept_metrics_conns();
+        return true;
+    }
+
+    for (MetricsConn& conn : metrics_conns) {
+        if (conn.fd != evt.fd) continue;
+
+        if (!conn.response.empty()) {
+            if (evt.writable && !flush_metrics_conn(conn)) close_metrics_conn(conn);
+        } else if (evt.readable) {
+            read_metrics_request(conn);
+        } else if (evt.hangup) {
+            close_metrics_conn(conn);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+static void print_impair_stats(const ImpairStats& stats) {
+    println("Impairment: {} received, {} delivered, {} lost, {} retransmitted, {} over the rate limit, {} over the queue limit, {} duplicated, {} reordered",
+            stats.received, stats.delivered, stats.lost, stats.retransmitted, stats.rate_dropped, stats.overflow_dropped,
+            stats.duplicated, stats.reordered);
+}
+
+// Idle time shows up on the net thread's timeline
+static int wait_for_events(PollerEvent* events, int timeout_ms) {
+    TRACE_SCOPE("poller_wait");
+    return poller_wait(poller, events, MAX_POLL_EVENTS, timeout_ms);
+}
+
+static void on_snapshot_acked(Client& client, const SnapshotAckPayload& ack) {
+    // Acks may come out of order over UDP, only move forward
+    if (!client.has_acked || ack.server_command_frame > client.acked_frame) {
+        client.has_acked = true;
+        client.acked_frame = ack.server_command_frame;
+    }
+}
+
+// Decodes a full or delta snapshot and keeps it around as a baseline for the next deltas
+static bool decode_snapshot(const FrameView& frame, GameStatePayload& state) {
+    TRACE_SCOPE("decode_snapshot");
+    uint64_t start = metrics_now_ns();
+    bool decoded = false;
+    if (frame.type == MsgType::GameState) {
+        decoded = deserialize_game_state(frame.data, frame.len, state);
+    } else if (frame.type == MsgType::GameStateDelta) {
+        decoded = deserialize_game_state_delta(frame.data, frame.len, client_history, state);
+    }
+
+    if (decoded) {
+        history_store(client_history, state);
+        metrics_observe(Histogram::DeserializeDuration, metrics_now_ns() - start);
+        metrics_add(Counter::SnapshotsReceived);
+    }
+    return decoded;
+}
+
+// Picks an encoding for every client, a delta against its last acked snapshot when the host still remembers it.
+// Returns how many distinct encodings are needed.
+static size_t plan_snapshot_encodings() {
+    // By history slot, the last entry is the full snapshot
+    int16_t encoding_of[ENCODED_SNAPSHOT_CACHE_SIZE];
+    fill(begin(encoding_of), end(encoding_of), -1);
+
+    size_t num_encoded = 0;
+    for (uint16_t i = 0; i < num_clients; ++i) {
+        const Client& client = clients[i];
+        const GameStatePayload* baseline = client.has_acked ? history_find(host_history, client.acked_frame) : nullptr;
+        size_t key = baseline ? (size_t)(baseline - host_history.states) : SNAPSHOT_HISTORY_SIZE;
+
+        if (encoding_of[key] < 0) {
+            encoding_of[key] = (int16_t)num_encoded;
+            encoded_snapshots[num_encoded++].baseline = baseline;
+        }
+        client_encodings[i] = (uint8_t)encoding_of[key];
+    }
+    return num_encoded;
+}
+
+static void encode_snapshot(EncodedSnapshot& encoded, const GameStatePayload& state) {
+    TRACE_SCOPE("encode_snapshot");
+    uint64_t start = metrics_now_ns();
+    const GameStatePayload* baseline = encoded.baseline;
+
+    encoded.len = baseline ? write_game_state_delta_frame(encoded.buff.get(), snapshot_frame_size, *baseline, state) : 0;
+    encoded.is_delta = encoded.len > 0;
+    encoded.baseline_frame = baseline ? baseline->server_command_frame : 0;
+    if (!encoded.is_delta) {
+        encoded.len = write_game_state_frame(encoded.buff.get(), snapshot_frame_size, state);
+    }
+
+    metrics_observe(Histogram::SerializeDuration, metrics_now_ns() - start);
+}
+
+void accept_new_connections(int listen_fd) {
+    TRACE_SCOPE("accept_new_connections");
     struct sockaddr_in client;
     socklen_t client_len = sizeof(client);
 
-    int num_evt = poll(incoming_poll, 1, 0);
-    if (num_evt == 0) return;
-
-    for (int i = 0; i < num_evt; ++i) {
-        int client_fd = accept(incoming_poll->fd, (struct sockaddr*)&client, &client_len);
+    // Edge-triggered: keep accepting until the backlog is empty
+    while (true) {
+        int client_fd = accept(listen_fd, (struct sockaddr*)&client, &client_len);
 
         if (client_fd < 0) {
-            println("Failed to accept incoming connection");
-            continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                println("Failed to accept incoming connection");
+            }
+            return;
         }
         
         if (num_clients >= MAX_CLIENTS) {
             // send a message to the client to inform him we are full
-        } else {
-            clients[num_clients] = {
-                .fd = client_fd,
-            };
+            close(client_fd);
+            continue;
+        } 
+
+        if (lockstep_log_full) {
+            println("Refusing a client, the lockstep session is too long to join anymore");
+            close(client_fd);
+            continue;
+        }
+
+        if (poller_add(poller, client_fd) < 0) {
+            println("Failed to watch client socket");
+            close(client_fd);
+            continue;
+        }
+
+        if (set_non_blocking(client_fd) < 0) {
+            println("Failed to make client socket non-blocking");
+            close(client_fd);
+            continue;
+        }
+
+#ifdef SO_NOSIGPIPE
+        int no_sigpipe = 1;
+        setsockopt(client_fd, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
+
+        if ((size_t)client_fd >= client_by_fd.size()) {
+            client_by_fd.resize(client_fd + 1, -1);
+        }
+        client_by_fd[client_fd] = num_clients;
+        Client& new_client = clients[num_clients++];
+        new_client = {};
+        new_client.fd = client_fd;
+        new_client.id = next_client_id++;
+        on_client_connected(new_client.id);
+        ring_init(new_client.ring, CLIENT_RECV_RING_CAPACITY);
+        new_client.send_queue.buff = unique_ptr<char[]>(new char[send_queue_capacity]);
+
+        if (impair_enabled) {
+            // Every client gets its own loss/jitter sequence
+            ImpairConfig config = impair_config;
+            config.seed += client_fd;
+            new_client.impair = make_unique<ImpairLine>();
+            impair_init(*new_client.impair, config);
+        }
+    }
+}
+
+void disconnect_client(uint16_t client_idx) {
+    on_client_disconnected(clients[client_idx].id);
+    poller_remove(poller, clients[client_idx].fd);
+    close(clients[client_idx].fd);
+    if (clients[client_idx].impair) {
+        impair_stats_add(impair_totals, clients[client_idx].impair->stats);
+    }
 
-            client_evt_listeners[num_clients++] = {
-                .fd = client_fd,
-                .events = POLLIN,
-                .revents = 0,
-            };
+    // replace this client with the last one
+    client_by_fd[clients[client_idx].fd] = -1;
+    clients[client_idx] = std::move(clients[--num_clients]);
+    if (client_idx < num_clients) {
+        client_by_fd[clients[client_idx].fd] = client_idx;
+    }
+}
+
+static void handle_client_frames(Client& client) {
+    // A single read may hold several frames, or only part of one
+    FrameView frame;
+    while (ring_next_frame(client.ring, frame)) {
+        if (frame.type == MsgType::SpawnEntity) {
+            SpawnEntityPayload payload;
+            if (deserialize_spawn_entity(frame.data, frame.len, payload)) {
+                record_spawn(client.id, payload);
+                on_entity_spawned(client.id, payload);
+            }
+        } else if (frame.type == MsgType::SnapshotAck) {
+            SnapshotAckPayload ack;
+            if (deserialize_snapshot_ack(frame.data, frame.len, ack)) {
+                on_snapshot_acked(client, ack);
+            }
+        } else if (frame.type == MsgType::LockstepChecksum) {
+            LockstepChecksumPayload checksum;
+            if (deserialize_lockstep_checksum(frame.data, frame.len, checksum)) {
+                on_lockstep_checksum_received(client.id, checksum);
+            }
         }
     }
 }
 
-void poll_client_messages(struct pollfd client_evt_listeners[MAX_CLIENTS]) {
-    int n_evts = poll(client_evt_listeners, num_clients, 0);
-    if (n_evts == 0) return;
+void read_client_messages(uint16_t client_idx) {
+    TRACE_SCOPE("read_client_messages");
+    Client& client = clients[client_idx];
+
+    // Edge-triggered: drain the socket until it would block
+    while (true) {
+        ssize_t msg_len = client.impair ? impaired_recv(*client.impair, client.fd, 0) : ring_recv(client.ring, client.fd, 0);
+
+        if (msg_len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR) continue;
+            println("Failed to read from client {}", client_idx);
+            disconnect_client(client_idx);
+            return;
+        }
+
+        if (msg_len == 0) {
+            disconnect_client(client_idx);
+            return;
+        }
+
+        client.bytes_received += msg_len;
+        metrics_add(Counter::BytesReceived, msg_len);
+        if (!client.impair) handle_client_frames(client);
+    }
+}
+
+// Hands over what the impairment held back and is now due, returns how long until the next bytes are
+static int release_client_messages() {
+    TRACE_SCOPE("release_client_messages");
+    int64_t now = impair_now_us();
+    int timeout_ms = -1;
+
+    for (uint16_t i = 0; i < num_clients;) {
+        Client& client = clients[i];
+        bool overflow = false;
 
-    char buff[2048];
+        while (const ImpairedPacket* packet = impair_pop(*client.impair, now)) {
+            if (!ring_write(client.ring, packet->data, packet->len)) {
+                overflow = true;
+                break;
+            }
+            handle_client_frames(client);
+        }
+
+        if (overflow) {
+            println("Client {} sent a frame too big for its ring", i);
+            disconnect_client(i);
+            continue;
+        }
+
+        timeout_ms = impair_wait_ms(*client.impair, timeout_ms);
+        ++i;
+    }
+
+    return timeout_ms;
+}
+
+// Returns false if the connection failed, only touches `client` so clients can be flushed in parallel
+static bool send_queued(Client& client) {
+    SendQueue& queue = client.send_queue;
+
+    while (queue.sent < queue.len) {
+        ssize_t sent = send(client.fd, queue.buff.get() + queue.sent, queue.len - queue.sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            // Kernel buffer is full, the rest goes out on the next writable event
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        queue.sent += sent;
+        client.bytes_sent += sent;
+        metrics_add(Counter::BytesSent, sent);
+    }
+
+    if (queue.sent > queue.queued_snapshot) {
+        queue.queued_snapshot = NO_QUEUED_SNAPSHOT;
+    }
+    if (queue.sent == queue.len) {
+        queue.sent = 0;
+        queue.len = 0;
+    }
+    return true;
+}
+
+// Returns false if the client had to be disconnected
+static bool flush_send_queue(uint16_t client_idx) {
+    if (send_queued(clients[client_idx])) return true;
+
+    println("Failed to send game state to client {}", client_idx);
+    disconnect_client(client_idx);
+    return false;
+}
+
+// Snapshots are latest-wins: one that hasn't started going out yet is replaced by the newer one
+static void queue_snapshot(Client& client, const EncodedSnapshot& encoded) {
+    SendQueue& queue = client.send_queue;
+
+    if (queue.queued_snapshot != NO_QUEUED_SNAPSHOT) {
+        queue.len = queue.queued_snapshot;
+        queue.queued_snapshot = NO_QUEUED_SNAPSHOT;
+        ++queue.replaced_snapshots;
+    }
+
+    // Only the tail of a partially sent frame is left in front, move it back to the start
+    if (queue.sent > 0) {
+        memmove(queue.buff.get(), queue.buff.get() + queue.sent, queue.len - queue.sent);
+        queue.len -= queue.sent;
+        queue.sent = 0;
+    }
+
+    if (send_queue_capacity - queue.len < encoded.len) {
+        ++queue.replaced_snapshots;
+        return;
+    }
+
+    queue.queued_snapshot = queue.len;
+    memcpy(queue.buff.get() + queue.len, encoded.buff.get(), encoded.len);
+    queue.len += encoded.len;
+}
+
+// Frames other than snapshots can't be dropped: they go in front of the snapshot that didn't start going out,
+// which makes room for them if needed. Returns false if there's still no room, the client is too far behind.
+static bool queue_frame(Client& client, const char* frame, size_t len) {
+    SendQueue& queue = client.send_queue;
+
+    if (queue.sent > 0) {
+        memmove(queue.buff.get(), queue.buff.get() + queue.sent, queue.len - queue.sent);
+        queue.len -= queue.sent;
+        if (queue.queued_snapshot != NO_QUEUED_SNAPSHOT) queue.queued_snapshot -= queue.sent;
+        queue.sent = 0;
+    }
+
+    if (send_queue_capacity - queue.len < len && queue.queued_snapshot != NO_QUEUED_SNAPSHOT) {
+        queue.len = queue.queued_snapshot;
+        queue.queued_snapshot = NO_QUEUED_SNAPSHOT;
+        ++queue.replaced_snapshots;
+    }
+    if (send_queue_capacity - queue.len < len) return false;
+
+    size_t at = queue.queued_snapshot != NO_QUEUED_SNAPSHOT ? queue.queued_snapshot : queue.len;
+    memmove(queue.buff.get() + at + len, queue.buff.get() + at, queue.len - at);
+    memcpy(queue.buff.get() + at, frame, len);
+    queue.len += len;
+    if (queue.queued_snapshot != NO_QUEUED_SNAPSHOT) queue.queued_snapshot += len;
+    return true;
+}
+
+static bool take_pending_snapshot(GameStatePayload& snapshot) {
+    unique_lock<mutex> lock(pending_snapshot_mtx, defer_lock);
+    trace_lock(lock, "lock pending_snapshot_mtx");
+    if (!has_pending_snapshot) return false;
+
+    swap(snapshot, pending_snapshot);
+    has_pending_snapshot = false;
+    return true;
+}
+
+static void take_pending_spawn_acks() {
+    spawn_acks_to_send.clear();
+    unique_lock<mutex> lock(pending_snapshot_mtx, defer_lock);
+    trace_lock(lock, "lock pending_snapshot_mtx");
+    swap(spawn_acks_to_send, pending_spawn_acks);
+}
+
+// UDP: a packet with only the reliable messages the peer didn't ack yet
+static void send_reliable_packet(uint16_t client_idx) {
+    char packet[MAX_DATAGRAM_SIZE];
+    packet[0] = (char)UdpPacketType::Data;
+    size_t packet_len = 1 + write_packet_prefix(udp_peers[client_idx].conn, packet + 1, sizeof packet - 1);
+    ssize_t sent = sendto(clients[client_idx].fd, packet, packet_len, 0, (struct sockaddr*)&udp_peers[client_idx].addr, sizeof udp_peers[client_idx].addr);
+    if (sent > 0) {
+        clients[client_idx].bytes_sent += sent;
+        metrics_add(Counter::BytesSent, sent);
+    }
+}
+
+// Sends what the game thread acked since last time, a client's batches keep their order
+static void send_spawn_acks_to_clients() {
+    take_pending_spawn_acks();
+    if (spawn_acks_to_send.empty()) return;
+    TRACE_SCOPE("send_spawn_acks_to_clients");
+
+    stable_sort(spawn_acks_to_send.begin(), spawn_acks_to_send.end(), [](const ClientSpawnAcks& a, const ClientSpawnAcks& b) {
+        return a.client_id < b.client_id;
+    });
+
+    // Going backwards, a disconnected client gets replaced by one that was already handled
+    for (uint16_t i = num_clients; i-- > 0;) {
+        auto first = lower_bound(spawn_acks_to_send.begin(), spawn_acks_to_send.end(), clients[i].id, [](const ClientSpawnAcks& acks, uint32_t id) {
+            return acks.client_id < id;
+        });
+
+        bool failed = false;
+        bool queued = false;
+        for (auto it = first; it != spawn_acks_to_send.end() && it->client_id == clients[i].id && !failed; ++it) {
+            char frame[MSG_HEADER_SIZE + sizeof(SpawnAcksPayload)];
+            size_t frame_len = write_spawn_acks_frame(frame, sizeof frame, it->payload);
+            if (transport == Transport::Udp) {
+                failed = !queue_reliable(udp_peers[i].conn, frame, (uint16_t)frame_len);
+            } else {
+                failed = !queue_frame(clients[i], frame, frame_len);
+            }
+            queued = true;
+        }
+        if (!queued) continue;
+
+        if (transport == Transport::Udp) {
+            // Without a packet of their own the acks would wait for the next snapshot
+            send_reliable_packet(i);
+            // The reliable window is full, the client stopped acking a while ago and is about to time out
+            if (failed) println("Too many spawn acks waiting for client {}, dropping some", i);
+            continue;
+        }
+
+        if (failed || !send_queued(clients[i])) {
+            println("Failed to send spawn acks to client {}", i);
+            disconnect_client(i);
+        }
+    }
+}
+
+static void take_pending_lockstep_frames() {
+    lockstep_frames_to_send.clear();
+    unique_lock<mutex> lock(pending_snapshot_mtx, defer_lock);
+    trace_lock(lock, "lock pending_snapshot_mtx");
+    swap(lockstep_frames_to_send, pending_lockstep_frames);
+}
+
+// False if the client's transport has no room left for now
+static bool queue_lockstep_frame(uint16_t client_idx, const LockstepFramePayload& payload) {
+    char frame[MSG_HEADER_SIZE + sizeof(LockstepFramePayload)];
+    size_t frame_len = write_lockstep_frame_frame(frame, sizeof frame, payload);
+    if (transport == Transport::Udp) {
+        return queue_reliable(udp_peers[client_idx].conn, frame, (uint16_t)frame_len);
+    }
+    return queue_frame(clients[client_idx], frame, frame_len);
+}
+
+// Once the log is full, drops what every client already got. Clients only lag a few seconds behind before their
+// connection fails or times out, that keeps the log from growing again.
+static void trim_lockstep_log() {
+    if (!lockstep_log_full) {
+        if (lockstep_log.size() < MAX_LOCKSTEP_LOG_FRAMES) return;
+        lockstep_log_full = true;
+        println("Lockstep log is full, late joins are refused from now on");
+    }
+
+    size_t slowest = lockstep_log_start + lockstep_log.size();
     for (uint16_t i = 0; i < num_clients; ++i) {
-    repeat:
-        struct pollfd& client_poll = client_evt_listeners[i];
+        slowest = min(slowest, clients[i].lockstep_log_pos);
+    }
+    lockstep_log.erase(lockstep_log.begin(), lockstep_log.begin() + (ptrdiff_t)(slowest - lockstep_log_start));
+    lockstep_log_start = slowest;
+}
 
-        if (!client_poll.revents) continue;
+// Catches every client up on the log, then on the latest frame. What doesn't fit waits for the next call,
+// the host doesn't wait for slow clients.
+static void send_lockstep_frames_to_clients() {
+    take_pending_lockstep_frames();
+    for (const LockstepFramePayload& frame : lockstep_frames_to_send) {
+        if (frame.num_spawns > 0 || frame.has_checksum) lockstep_log.push_back(frame);
+        latest_lockstep_frame = frame;
+        has_lockstep_frame = true;
+    }
+    if (!has_lockstep_frame) return;
+    TRACE_SCOPE("send_lockstep_frames_to_clients");
 
-        if (client_poll.revents == POLLIN) {
-            int msg_len = recv(client_poll.fd,  buff, sizeof buff, 0);
-            
-            SpawnEntityPayload payload;
-            deserialize_spawn_entity(buff, msg_len, payload);
-            on_entity_spawned(payload);
-        } else if (client_poll.revents == POLLOUT) {
-            --num_clients;
-            // replace last client with this one 
-            client_evt_listeners[i] = client_evt_listeners[num_clients+1];
-            // repeat this iteration otherwise that moved client won't get processed due to num_clients being decremented
-            goto repeat;
+    // Going backwards, a disconnected client gets replaced by one that was already handled
+    for (uint16_t i = num_clients; i-- > 0;) {
+        Client& client = clients[i];
+        bool queued = false;
+        bool full = false;
+
+        while (client.lockstep_log_pos < lockstep_log_start + lockstep_log.size()) {
+            const LockstepFramePayload& frame = lockstep_log[client.lockstep_log_pos - lockstep_log_start];
+            if (!queue_lockstep_frame(i, frame)) {
+                full = true;
+                break;
+            }
+            ++client.lockstep_log_pos;
+            client.lockstep_sent_frame = frame.frame;
+            queued = true;
+        }
+        if (!full && client.lockstep_sent_frame < latest_lockstep_frame.frame) {
+            full = !queue_lockstep_frame(i, latest_lockstep_frame);
+            if (!full) {
+                client.lockstep_sent_frame = latest_lockstep_frame.frame;
+                queued = true;
+            }
+        }
+
+        if (transport == Transport::Udp) {
+            // A full window means packets got lost, resending is what gets acks flowing again
+            if (queued || full) send_reliable_packet(i);
+            continue;
+        }
+        if (queued && !send_queued(client)) {
+            println("Failed to send lockstep frames to client {}", i);
+            disconnect_client(i);
+        }
+    }
+    trim_lockstep_log();
+}
+
+static void send_snapshot_to_clients(const GameStatePayload& game_state) {
+    TRACE_SCOPE("send_snapshot_to_clients");
+    if (!host_history.initialized) {
+        history_init(host_history);
+    }
+
+    // Distinct encodings first, then the per-client sends, both spread over the job system
+    size_t num_encoded = plan_snapshot_encodings();
+    parallel_for(0, (uint32_t)num_encoded, 1, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; ++i) {
+            encode_snapshot(encoded_snapshots[i], game_state);
+        }
+    });
+    // Can't happen with snapshots capped to max_game_state_size, see try_send_network_packets
+    for (size_t i = 0; i < num_encoded; ++i) {
+        if (encoded_snapshots[i].len > 0) continue;
+        println("Game state doesn't fit in a frame, dropping it");
+        return;
+    }
+    record_snapshot(game_state, num_encoded);
+
+    if (transport == Transport::Udp) {
+        // Concurrent sendto on the one socket is fine, every peer has its own sequence numbers
+        parallel_for(0, num_clients, CLIENT_JOB_GRAIN, [](uint32_t begin, uint32_t end) {
+            char packet[MAX_DATAGRAM_SIZE];
+            packet[0] = (char)UdpPacketType::Data;
+            for (uint32_t i = begin; i < end; ++i) {
+                const EncodedSnapshot& encoded = encoded_snapshots[client_encodings[i]];
+                UdpPeer& peer = udp_peers[i];
+
+                size_t prefix_len = 1 + write_packet_prefix(peer.conn, packet + 1, sizeof packet - 1);
+                if (sizeof packet - prefix_len < encoded.len) {
+                    println("Game state doesn't fit in a datagram");
+                    continue;
+                }
+                memcpy(packet + prefix_len, encoded.buff.get(), encoded.len);
+
+                // Snapshots are unreliable, a full socket buffer just means this one is lost
+                ssize_t sent = sendto(clients[i].fd, packet, prefix_len + encoded.len, 0, (struct sockaddr*)&peer.addr, sizeof peer.addr);
+                if (sent < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        println("Failed to send game state to client {}", i);
+                    }
+                    continue;
+                }
+                clients[i].bytes_sent += sent;
+                metrics_add(Counter::BytesSent, sent);
+                metrics_add(Counter::SnapshotsSent);
+            }
+        });
+    } else {
+        parallel_for(0, num_clients, CLIENT_JOB_GRAIN, [](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                queue_snapshot(clients[i], encoded_snapshots[client_encodings[i]]);
+                metrics_add(Counter::SnapshotsSent);
+                client_send_failed[i] = !send_queued(clients[i]);
+            }
+        });
+
+        // A disconnected client gets replaced by the last one, going backwards that one was already handled
+        for (uint16_t i = num_clients; i-- > 0;) {
+            if (!client_send_failed[i]) continue;
+            println("Failed to send game state to client {}", i);
+            disconnect_client(i);
         }
     }
+
+    history_store(host_history, game_state);
 }
 
-int run_host() {
+int find_client(int fd) {
+    return fd >= 0 && (size_t)fd < client_by_fd.size() ? client_by_fd[fd] : -1;
+}
+
+static int run_host_tcp() {
+    // One fd per client, the default soft limit is often 1024
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max) {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
  
     int host_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (host_fd < 0) {
@@ -165,32 +970,387 @@ int run_host() {
         return -1;
     }
 
-    if (listen(host_fd, 128) < 0) {
+    if (listen(host_fd, SOMAXCONN) < 0) {
         println("Failed to listen to socket");
         return -1;
     }
 
+    if (set_non_blocking(host_fd) < 0) {
+        println("Failed to make listening socket non-blocking");
+        return -1;
+    }
+
+    if (poller_create(poller) < 0 || poller_add(poller, host_fd) < 0) {
+        println("Failed to setup the event poller");
+        return -1;
+    }
+
     println("Listening on port {}", PORT);
+    open_metrics_endpoint();
 
-        
-    struct pollfd incoming_poll = {
+    PollerEvent events[MAX_POLL_EVENTS];
+    int timeout_ms = -1;
+
+    // Blocks until a connection, a client message or a stop_net() wakeup comes in, or impaired bytes are due
+    while(net_task_running) {
+        int num_events = wait_for_events(events, timeout_ms);
+        if (num_events < 0) {
+            println("Failed to wait for network events");
+            break;
+        }
+
+        for (int i = 0; i < num_events; ++i) {
+            const PollerEvent& evt = events[i];
+
+            if (evt.fd == host_fd) {
+                accept_new_connections(host_fd);
+                continue;
+            }
+            if (handle_metrics_event(evt)) continue;
+
+            int client_idx = find_client(evt.fd);
+            if (client_idx < 0) continue;
+
+            if (evt.writable && !flush_send_queue(client_idx)) continue;
+
+            if (evt.readable) {
+                // Reads first so a message sent right before hanging up still gets processed
+                read_client_messages(client_idx);
+            } else if (evt.hangup) {
+                disconnect_client(client_idx);
+            }
+        }
+
+        if (impair_enabled) {
+            timeout_ms = release_client_messages();
+        }
+        metrics_set(Gauge::ConnectedClients, num_clients);
+
+        send_spawn_acks_to_clients();
+        send_lockstep_frames_to_clients();
+        GameStatePayload snapshot;
+        if (take_pending_snapshot(snapshot)) {
+            send_snapshot_to_clients(snapshot);
+        }
+    }
+
+    for (uint16_t i = 0; i < num_clients; ++i) {
+        close(clients[i].fd);
+        if (clients[i].impair) {
+            impair_stats_add(impair_totals, clients[i].impair->stats);
+        }
+    }
+    if (impair_enabled) {
+        print_impair_stats(impair_totals);
+    }
+    num_clients = 0;
+    client_by_fd.clear();
+    close(host_fd);
+    close_metrics_endpoint();
+    poller_destroy(poller);
+    
+    return 0;
+}
+
+static uint64_t udp_addr_key(const struct sockaddr_in& addr) {
+    return (uint64_t)addr.sin_addr.s_addr << 16 | addr.sin_port;
+}
+
+static int find_udp_peer(const struct sockaddr_in& addr) {
+    auto it = udp_peer_by_addr.find(udp_addr_key(addr));
+    return it != udp_peer_by_addr.end() ? it->second : -1;
+}
+
+static void remove_udp_peer(uint16_t peer_idx) {
+    on_client_disconnected(clients[peer_idx].id);
+    udp_peer_by_addr.erase(udp_addr_key(udp_peers[peer_idx].addr));
+    --num_clients;
+    clients[peer_idx] = std::move(clients[num_clients]);
+    udp_peers[peer_idx] = udp_peers[num_clients];
+    if (peer_idx < num_clients) {
+        udp_peer_by_addr[udp_addr_key(udp_peers[peer_idx].addr)] = peer_idx;
+    }
+}
+
+static void handle_udp_datagram(int host_fd, const char* buff, size_t msg_len, const struct sockaddr_in& from) {
+    metrics_add(Counter::BytesReceived, msg_len);
+    int peer_idx = find_udp_peer(from);
+    UdpPacketType type = (UdpPacketType)buff[0];
+
+    if (type == UdpPacketType::Connect) {
+        // A late joiner can't be caught up once the lockstep log is full, same as a full host it gets no answer
+        if (peer_idx >= 0 || num_clients >= MAX_CLIENTS || lockstep_log_full) return;
+
+        clients[num_clients] = {};
+        clients[num_clients].fd = host_fd;
+        clients[num_clients].id = next_client_id++;
+        clients[num_clients].bytes_received = msg_len;
+        on_client_connected(clients[num_clients].id);
+        udp_peers[num_clients] = {
+            .addr = from,
+            .conn = {},
+            .last_received = chrono::steady_clock::now(),
+        };
+        udp_peer_by_addr[udp_addr_key(from)] = num_clients;
+        ++num_clients;
+        return;
+    }
+
+    if (peer_idx < 0) return;
+    clients[peer_idx].bytes_received += msg_len;
+
+    if (type == UdpPacketType::Disconnect) {
+        remove_udp_peer(peer_idx);
+        return;
+    }
+
+    UdpPeer& peer = udp_peers[peer_idx];
+    uint16_t seq;
+    size_t offset = read_packet_prefix(peer.conn, buff + 1, msg_len - 1, seq);
+    if (offset == 0) return;
+    peer.last_received = chrono::steady_clock::now();
+
+    while (const ReliableMessage* msg = pop_reliable(peer.conn)) {
+        FrameView frame;
+        if (read_frame(msg->data, msg->len, frame) == 0) continue;
+
+        SpawnEntityPayload payload;
+        LockstepChecksumPayload checksum;
+        if (frame.type == MsgType::SpawnEntity && deserialize_spawn_entity(frame.data, frame.len, payload)) {
+            record_spawn(clients[peer_idx].id, payload);
+            on_entity_spawned(clients[peer_idx].id, payload);
+        } else if (frame.type == MsgType::LockstepChecksum && deserialize_lockstep_checksum(frame.data, frame.len, checksum)) {
+            on_lockstep_checksum_received(clients[peer_idx].id, checksum);
+        }
+    }
+
+    FrameView frame;
+    SnapshotAckPayload ack;
+    offset += 1;
+    if (read_frame(buff + offset, msg_len - offset, frame) > 0 && frame.type == MsgType::SnapshotAck
+        && deserialize_snapshot_ack(frame.data, frame.len, ack)) {
+        on_snapshot_acked(clients[peer_idx], ack);
+    }
+}
+
+static void read_udp_datagrams(int host_fd) {
+    TRACE_SCOPE("read_udp_datagrams");
+    char buff[MAX_DATAGRAM_SIZE];
+
+    while (true) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t msg_len = recvfrom(host_fd, buff, sizeof buff, 0, (struct sockaddr*)&from, &from_len);
+
+        if (msg_len < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                println("Failed to read datagram");
+            }
+            return;
+        }
+        if (msg_len < 1) continue;
+
+        if (impair_enabled) {
+            impair_push(udp_impair, buff, msg_len, &from, false, impair_now_us());
+            continue;
+        }
+
+        handle_udp_datagram(host_fd, buff, msg_len, from);
+    }
+}
+
+static void release_udp_datagrams(int host_fd) {
+    int64_t now = impair_now_us();
+    while (const ImpairedPacket* packet = impair_pop(udp_impair, now)) {
+        handle_udp_datagram(host_fd, packet->data, packet->len, packet->from);
+    }
+}
+
+static void drop_timed_out_peers() {
+    auto now = chrono::steady_clock::now();
+    for (uint16_t i = 0; i < num_clients;) {
+        if (now - udp_peers[i].last_received > chrono::milliseconds(UDP_PEER_TIMEOUT_MS)) {
+            println("Client {} timed out", i);
+            remove_udp_peer(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+static int run_host_udp() {
+    int host_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (host_fd < 0) {
+        println("Failed to create socket");
+        return -1;
+    }
+
+    host = {
         .fd = host_fd,
-        .events = POLLIN,
-        .revents = 0,
     };
 
-    struct pollfd client_evt_listeners[MAX_CLIENTS];
+    int opt_val = 1;
+    setsockopt(host_fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof(opt_val));
+
+    struct sockaddr_in host_addr;
+    host_addr.sin_family = AF_INET;
+    host_addr.sin_port = htons(PORT);
+    host_addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    while(net_task_running) {
-        poll_new_connections(&incoming_poll, client_evt_listeners);    
-        poll_client_messages(client_evt_listeners);
+    if (bind(host_fd, (struct sockaddr*)&host_addr, sizeof(host_addr)) < 0) {
+        println("Failed to bind");
+        return -1;
     }
-    
+
+    if (set_non_blocking(host_fd) < 0) {
+        println("Failed to make socket non-blocking");
+        return -1;
+    }
+
+    if (poller_create(poller) < 0 || poller_add(poller, host_fd) < 0) {
+        println("Failed to setup the event poller");
+        return -1;
+    }
+
+    println("Listening for UDP datagrams on port {}", PORT);
+    open_metrics_endpoint();
+
+    if (impair_enabled) {
+        impair_init(udp_impair, impair_config);
+    }
+
+    PollerEvent events[MAX_POLL_EVENTS];
+
+    while (net_task_running) {
+        // Wakes up regularly even without traffic so silent peers get dropped
+        int timeout_ms = impair_enabled ? impair_wait_ms(udp_impair, UDP_PEER_TIMEOUT_MS / 2) : UDP_PEER_TIMEOUT_MS / 2;
+        int num_events = wait_for_events(events, timeout_ms);
+        if (num_events < 0) {
+            println("Failed to wait for network events");
+            break;
+        }
+
+        for (int i = 0; i < num_events; ++i) {
+            if (handle_metrics_event(events[i])) continue;
+            if (events[i].readable) {
+                read_udp_datagrams(host_fd);
+            }
+        }
+
+        if (impair_enabled) {
+            release_udp_datagrams(host_fd);
+        }
+
+        send_spawn_acks_to_clients();
+        send_lockstep_frames_to_clients();
+        GameStatePayload snapshot;
+        if (take_pending_snapshot(snapshot)) {
+            send_snapshot_to_clients(snapshot);
+        }
+
+        drop_timed_out_peers();
+        metrics_set(Gauge::ConnectedClients, num_clients);
+    }
+
+    if (impair_enabled) {
+        print_impair_stats(udp_impair.stats);
+    }
+
+    num_clients = 0;
+    udp_peer_by_addr.clear();
+    close(host_fd);
+    close_metrics_endpoint();
+    poller_destroy(poller);
+
     return 0;
 }
 
-int run_client() {
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+int run_host(Transport selected_transport) {
+    TRACE_THREAD_NAME("net");
+    transport = selected_transport;
+    snapshot_frame_size = MSG_HEADER_SIZE + max_game_state_size(transport == Transport::Tcp);
+    send_queue_capacity = 2 * snapshot_frame_size;
+    // The cache has a spare past the most distinct encodings, record_snapshot encodes a full one there
+    for (EncodedSnapshot& encoded : encoded_snapshots) {
+        encoded.buff = unique_ptr<char[]>(new char[snapshot_frame_size]);
+    }
+    int result = transport == Transport::Udp ? run_host_udp() : run_host_tcp();
+    close_recording();
+    return result;
+}
+
+static void send_udp_control(int server_fd, UdpPacketType type) {
+    char packet = (char)type;
+    send(server_fd, &packet, sizeof packet, 0);
+}
+
+struct UdpClientState {
+    bool connected = false;
+    bool has_snapshot = false;
+    uint16_t last_snapshot_seq = 0;
+};
+
+static void handle_server_datagram(int server_fd, UdpClientState& state, const char* buff, size_t msg_len) {
+    metrics_add(Counter::BytesReceived, msg_len);
+    if (msg_len < 1 || (UdpPacketType)buff[0] != UdpPacketType::Data) return;
+
+    size_t snapshot_offset;
+    uint16_t seq;
+    {
+        lock_guard<mutex> lock(net_mtx);
+        snapshot_offset = read_packet_prefix(udp_server_conn, buff + 1, msg_len - 1, seq);
+
+        while (const ReliableMessage* msg = pop_reliable(udp_server_conn)) {
+            FrameView frame;
+            if (read_frame(msg->data, msg->len, frame) == 0) continue;
+
+            SpawnAcksPayload acks;
+            LockstepFramePayload lockstep_frame;
+            if (frame.type == MsgType::SpawnAcks && deserialize_spawn_acks(frame.data, frame.len, acks)) {
+                on_spawn_acks_received(acks);
+            } else if (frame.type == MsgType::LockstepFrame && deserialize_lockstep_frame(frame.data, frame.len, lockstep_frame)) {
+                on_lockstep_frame_received(lockstep_frame);
+            }
+        }
+    }
+    if (snapshot_offset == 0) return;
+    state.connected = true;
+
+    // Snapshots are latest-wins, anything older than what we already have is useless
+    GameStatePayload received_state;
+    bool decoded = false;
+    if (!state.has_snapshot || seq_greater(seq, state.last_snapshot_seq)) {
+        snapshot_offset += 1;
+        FrameView frame;
+        decoded = read_frame(buff + snapshot_offset, msg_len - snapshot_offset, frame) > 0 && decode_snapshot(frame, received_state);
+    }
+
+    // Every packet gets acked right away, the reply also carries unacked spawns again
+    {
+        lock_guard<mutex> lock(net_mtx);
+        char reply[MAX_DATAGRAM_SIZE];
+        reply[0] = (char)UdpPacketType::Data;
+        size_t reply_len = 1 + write_packet_prefix(udp_server_conn, reply + 1, sizeof reply - 1);
+        if (decoded) {
+            reply_len += write_snapshot_ack_frame(reply + reply_len, sizeof reply - reply_len, {
+                .server_command_frame = received_state.server_command_frame,
+            });
+        }
+        if (send(server_fd, reply, reply_len, 0) > 0) {
+            metrics_add(Counter::BytesSent, reply_len);
+        }
+    }
+
+    if (decoded) {
+        state.has_snapshot = true;
+        state.last_snapshot_seq = seq;
+        on_state_received(std::move(received_state));
+    }
+}
+
+static int run_client_udp() {
+    int server_fd = socket(AF_INET, SOCK_DGRAM, 0);
     if (server_fd < 0) {
         println("Failed to create socket");
         return -1;
@@ -201,46 +1361,308 @@ int run_client() {
     server.sin_port = htons(PORT);
     server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
+    // Not an actual connection, only fixes the peer address so send/recv can be used
     if (connect(server_fd, (struct sockaddr*)&server, sizeof(server)) < 0) {
         println("Failed to connect to server");
         return -1;
     }
-    
+
+    if (set_non_blocking(server_fd) < 0) {
+        println("Failed to make socket non-blocking");
+        return -1;
+    }
+
+    if (poller_create(poller) < 0 || poller_add(poller, server_fd) < 0) {
+        println("Failed to setup the event poller");
+        return -1;
+    }
+
     host = {
         .fd = server_fd,
     };
 
-    char buff[2048];
-    while(net_task_running) {
-        int msg_len = recv(server_fd, &buff, sizeof(buff), 0);
-        if (msg_len < 0) {
-            println("Failed to read from server");
-            return -1;
+    UdpClientState state;
+
+    if (impair_enabled) {
+        impair_init(udp_impair, impair_config);
+    }
+    open_metrics_endpoint();
+
+    send_udp_control(server_fd, UdpPacketType::Connect);
+
+    PollerEvent events[MAX_POLL_EVENTS];
+    char buff[MAX_DATAGRAM_SIZE];
+    auto last_connect_attempt = chrono::steady_clock::now();
+
+    while (net_task_running) {
+        int timeout_ms = impair_enabled ? impair_wait_ms(udp_impair, UDP_CONNECT_RETRY_MS) : UDP_CONNECT_RETRY_MS;
+        int num_events = wait_for_events(events, timeout_ms);
+        if (num_events < 0) {
+            println("Failed to wait for network events");
+            break;
         }
-        
+
+        // The connect packet may have been lost, keep asking until the host streams snapshots
+        auto now = chrono::steady_clock::now();
+        if (!state.connected && now - last_connect_attempt >= chrono::milliseconds(UDP_CONNECT_RETRY_MS)) {
+            send_udp_control(server_fd, UdpPacketType::Connect);
+            last_connect_attempt = now;
+        }
+
+        for (int i = 0; i < num_events; ++i) {
+            handle_metrics_event(events[i]);
+        }
+
+        while (true) {
+            ssize_t msg_len = recv(server_fd, buff, sizeof buff, 0);
+            if (msg_len < 0) {
+                if (errno == EINTR) continue;
+                // ECONNREFUSED only means the host isn't up (yet)
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+                    println("Failed to read from server");
+                }
+                break;
+            }
+
+            if (impair_enabled) {
+                impair_push(udp_impair, buff, msg_len, nullptr, false, impair_now_us());
+            } else {
+                handle_server_datagram(server_fd, state, buff, msg_len);
+            }
+        }
+
+        if (impair_enabled) {
+            int64_t now_us = impair_now_us();
+            while (const ImpairedPacket* packet = impair_pop(udp_impair, now_us)) {
+                handle_server_datagram(server_fd, state, packet->data, packet->len);
+            }
+        }
+    }
+
+    if (impair_enabled) {
+        print_impair_stats(udp_impair.stats);
+    }
+
+    send_udp_control(server_fd, UdpPacketType::Disconnect);
+    close(server_fd);
+    close_metrics_endpoint();
+    poller_destroy(poller);
+
+    return 0;
+}
+
+static void handle_server_frames(int server_fd, RecvRing& ring) {
+    // Snapshots get coalesced or split by TCP, hand over every one that is complete
+    FrameView frame;
+    while (ring_next_frame(ring, frame)) {
+        if (frame.type == MsgType::SpawnAcks) {
+            SpawnAcksPayload acks;
+            if (deserialize_spawn_acks(frame.data, frame.len, acks)) {
+                on_spawn_acks_received(acks);
+            }
+            continue;
+        }
+        if (frame.type == MsgType::LockstepFrame) {
+            LockstepFramePayload lockstep_frame;
+            if (deserialize_lockstep_frame(frame.data, frame.len, lockstep_frame)) {
+                on_lockstep_frame_received(lockstep_frame);
+            }
+            continue;
+        }
+
         GameStatePayload received_state;
-        deserialize_game_state(buff, msg_len, received_state);
+        if (!decode_snapshot(frame, received_state)) continue;
+
+        char ack[MSG_HEADER_SIZE + sizeof(SnapshotAckPayload)];
+        size_t ack_len = write_snapshot_ack_frame(ack, sizeof ack, {
+            .server_command_frame = received_state.server_command_frame,
+        });
+        {
+            // Spawns are sent from the game thread on the same socket
+            lock_guard<mutex> lock(net_mtx);
+            if (send(server_fd, ack, ack_len, 0) > 0) {
+                metrics_add(Counter::BytesSent, ack_len);
+            }
+        }
+
         on_state_received(std::move(received_state));
     }
+}
+
+static int run_client_tcp() {
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        println("Failed to create socket");
+        return -1;
+    }
+
+    struct sockaddr_in server;
+    server.sin_family = AF_INET;
+    server.sin_port = htons(PORT);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(server_fd, (struct sockaddr*)&server, sizeof(server)) < 0) {
+        println("Failed to connect to server");
+        return -1;
+    }
+
+    // The socket stays blocking for the game thread's sends, reads use MSG_DONTWAIT
+    if (poller_create(poller) < 0 || poller_add(poller, server_fd) < 0) {
+        println("Failed to setup the event poller");
+        return -1;
+    }
+    
+    host = {
+        .fd = server_fd,
+    };
+
+    // Snapshot frames can be bigger than the default ring with a lot of entities
+    RecvRing ring;
+    ring_init(ring, max(RECV_RING_CAPACITY, 2 * (MSG_HEADER_SIZE + max_game_state_size(true))));
+
+    ImpairLine impair;
+    if (impair_enabled) {
+        impair_init(impair, impair_config);
+    }
+    open_metrics_endpoint();
+
+    PollerEvent events[MAX_POLL_EVENTS];
+    int result = 0;
+
+    while(net_task_running && result == 0) {
+        int timeout_ms = impair_enabled ? impair_wait_ms(impair, -1) : -1;
+        int num_events = wait_for_events(events, timeout_ms);
+        if (num_events < 0) {
+            println("Failed to wait for network events");
+            result = -1;
+            break;
+        }
+
+        for (int i = 0; i < num_events; ++i) {
+            handle_metrics_event(events[i]);
+        }
+
+        // Edge-triggered: drain the socket until it would block
+        while (true) {
+            ssize_t msg_len = impair_enabled ? impaired_recv(impair, server_fd, MSG_DONTWAIT) : ring_recv(ring, server_fd, MSG_DONTWAIT);
+            if (msg_len < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                println("Failed to read from server");
+                result = -1;
+                break;
+            }
+            if (msg_len == 0) {
+                println("Server closed the connection");
+                result = -1;
+                break;
+            }
+
+            metrics_add(Counter::BytesReceived, msg_len);
+            if (!impair_enabled) handle_server_frames(server_fd, ring);
+        }
+
+        if (impair_enabled) {
+            int64_t now = impair_now_us();
+            while (const ImpairedPacket* packet = impair_pop(impair, now)) {
+                if (!ring_write(ring, packet->data, packet->len)) {
+                    println("Failed to read from server");
+                    result = -1;
+                    break;
+                }
+                handle_server_frames(server_fd, ring);
+            }
+        }
+    }
+
+    if (impair_enabled) {
+        print_impair_stats(impair.stats);
+    }
+
+    close(server_fd);
+    close_metrics_endpoint();
+    poller_destroy(poller);
    
-    return 0;
+    return result;
 }
 
-void send_network_message(const SpawnEntityPayload& payload) {
-    if (send(host.fd, &payload, sizeof(SpawnEntityPayload), 0) < 0) {
+int run_client(Transport selected_transport) {
+    TRACE_THREAD_NAME("net");
+    transport = selected_transport;
+    history_init(client_history);
+    return transport == Transport::Udp ? run_client_udp() : run_client_tcp();
+}
+
+// Reliable on both transports, called from the game thread
+static void send_frame_to_host(const char* frame, size_t frame_len) {
+    if (transport == Transport::Udp) {
+        lock_guard<mutex> lock(net_mtx);
+
+        if (!queue_reliable(udp_server_conn, frame, (uint16_t)frame_len)) {
+            println("Too many messages waiting for an acknowledgement, dropping this one");
+            return;
+        }
+
+        char packet[MAX_DATAGRAM_SIZE];
+        packet[0] = (char)UdpPacketType::Data;
+        size_t packet_len = 1 + write_packet_prefix(udp_server_conn, packet + 1, sizeof packet - 1);
+        if (send(host.fd, packet, packet_len, 0) < 0) {
+            println("Failed to send message to the server");
+            return;
+        }
+        metrics_add(Counter::BytesSent, packet_len);
+        return;
+    }
+
+    lock_guard<mutex> lock(net_mtx);
+    if (send(host.fd, frame, frame_len, 0) < 0) {
         println("Failed to send message to the server");
+        return;
     }
+    metrics_add(Counter::BytesSent, frame_len);
 }
 
-void dispatch_game_state(const GameStatePayload& game_state) {
-    char buff[2048];
-    size_t serialized_len = serialize_game_state(buff, sizeof(buff), game_state);
+void send_network_message(const SpawnEntityPayload& payload) {
+    TRACE_SCOPE("send_network_message");
+    char frame[MSG_HEADER_SIZE + sizeof(SpawnEntityPayload)];
+    send_frame_to_host(frame, write_spawn_entity_frame(frame, sizeof frame, payload));
+}
 
-    for (int i = 0; i < num_clients; ++i) {
-        int fd = clients[i].fd;
+void send_network_message(const LockstepChecksumPayload& payload) {
+    char frame[MSG_HEADER_SIZE + sizeof(LockstepChecksumPayload)];
+    send_frame_to_host(frame, write_lockstep_checksum_frame(frame, sizeof frame, payload));
+}
 
-        if (send(fd, buff, serialized_len, 0) < 0) {
-            println("Failed to send game state to client {}", i);
+void dispatch_game_state(GameStatePayload&& game_state) {
+    TRACE_SCOPE("dispatch_game_state");
+    {
+        unique_lock<mutex> lock(pending_snapshot_mtx, defer_lock);
+        trace_lock(lock, "lock pending_snapshot_mtx");
+        pending_snapshot = std::move(game_state);
+        has_pending_snapshot = true;
+    }
+    poller_wake(poller);
+}
+
+void dispatch_spawn_acks(vector<ClientSpawnAcks>&& acks) {
+    if (acks.empty()) return;
+    {
+        unique_lock<mutex> lock(pending_snapshot_mtx, defer_lock);
+        trace_lock(lock, "lock pending_snapshot_mtx");
+        if (pending_spawn_acks.empty()) {
+            swap(pending_spawn_acks, acks);
+        } else {
+            pending_spawn_acks.insert(pending_spawn_acks.end(), acks.begin(), acks.end());
         }
     }
+    poller_wake(poller);
+}
+
+void dispatch_lockstep_frame(const LockstepFramePayload& frame) {
+    {
+        unique_lock<mutex> lock(pending_snapshot_mtx, defer_lock);
+        trace_lock(lock, "lock pending_snapshot_mtx");
+        pending_lockstep_frames.push_back(frame);
+    }
+    poller_wake(poller);
 }
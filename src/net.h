@@ -1,47 +1,108 @@
 #pragma once
 
 #include "game.h"
-#include "raylib.h"
+#include "impair.h"
+#include "protocol.h"
 #include <cstddef>
 #include <cstdint>
-#include <memory>
+#include <vector>
 
-struct EntityPayload {
-    uint16_t id = 0;
-    Vector2 pos {0.f, 0.f};
-};
-
-struct GameStatePayload {
-    uint64_t server_command_frame = 0;
-    float player_pos[2] {0.f, 0.f};
-    float player_angle = 0.f;
-    uint32_t num_entities = 0;
-    std::unique_ptr<EntityPayload[]> entities = nullptr;
-};
-
-struct SpawnEntityPayload {
-    uint64_t command_frame = 0;
-    //WARN: ideally the client should warn the server which ID it used to spawn the entity
-    // but the server should respond with which actual ID it used and the client should sync to it, this is not handled here
-    uint16_t id = 0;
-    Vector2 pos = {0.f, 0.f};
-    Vector2 dir = {0.f, 0.f};
+/*
+ * Outgoing bytes of a TCP client, drained by the net thread whenever the socket is writable.
+ * It holds at most the snapshot being sent and the next one, see queue_snapshot in net.cc
+ */
+struct SendQueue {
+    std::unique_ptr<char[]> buff = nullptr;
+    size_t sent = 0;
+    size_t len = 0;
+    // Offset of the snapshot frame that didn't start going out yet
+    size_t queued_snapshot = SIZE_MAX;
+    uint64_t replaced_snapshots = 0;
 };
 
 struct Client {
     int fd = -1;
+    // Stable across slot swaps, labels the client's metrics
+    uint32_t id = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    RecvRing ring;
+    SendQueue send_queue;
+    // Latest snapshot the client confirmed, the host sends deltas against it
+    bool has_acked = false;
+    uint64_t acked_frame = 0;
+    // Lockstep: next frame of the log to send (counted from the start of the session) and the last frame sent,
+    // see dispatch_lockstep_frame
+    size_t lockstep_log_pos = 0;
+    uint64_t lockstep_sent_frame = 0;
+    // Only set while impairing received traffic, holds bytes back before they reach the ring
+    std::unique_ptr<ImpairLine> impair = nullptr;
 };
 
 struct Host {
     int fd = -1;
 };
 
-int run_host();
-int run_client();
+const uint16_t PORT = 12345;
+// The host serves GET /metrics there by default, see metrics.h
+const uint16_t DEFAULT_METRICS_PORT = 12346;
+
+/*
+ * First byte of every UDP datagram, Data packets carry the reliability prefix (see reliability.h) followed by frames
+ */
+enum class UdpPacketType : uint8_t {Connect = 1, Data, Disconnect};
+
+/*
+ * TCP streams everything over one connection per client.
+ * UDP sends snapshots unreliably (latest wins) and spawns over a reliable-ordered channel, see reliability.h
+ */
+enum class Transport {Tcp, Udp};
+
+/*
+ * Impairs everything this process receives from now on, see impair.h. Call it before run_host/run_client
+ */
+void set_network_impairment(const ImpairConfig& config);
+
+/*
+ * Serves the Prometheus metrics on 127.0.0.1:port from the net thread, 0 turns it off. Call it before run_host/run_client
+ */
+void set_metrics_port(uint16_t port);
+
+/*
+ * Host side: records the full encoding of every snapshot and every spawn received into `path`, see recording.h.
+ * Written from the net thread, never by the tick. Call it before run_host, the file is closed when run_host returns.
+ */
+bool set_recording(const char* path, uint32_t num_entities);
+
+int run_host(Transport transport);
+int run_client(Transport transport);
 /*
  * Schedules the net function to stop in a bit. The thread to runs it can be joined to end the program 
  */
 void stop_net();
 
 void send_network_message(const struct SpawnEntityPayload& payload);
-void dispatch_game_state(const struct GameStatePayload& game_state);
+void send_network_message(const struct LockstepChecksumPayload& payload);
+/*
+ * Hands the snapshot over to the net thread which encodes and sends it, never blocks on the network
+ */
+void dispatch_game_state(struct GameStatePayload&& game_state);
+
+struct ClientSpawnAcks {
+    // Client::id
+    uint32_t client_id = 0;
+    SpawnAcksPayload payload;
+};
+
+/*
+ * Host side: hands a tick's spawn acks over to the net thread, they're sent reliably and ahead of the next snapshot
+ */
+void dispatch_spawn_acks(std::vector<ClientSpawnAcks>&& acks);
+
+/*
+ * Host side, lockstep: hands a tick's frame over to the net thread, which sends it reliably to every client.
+ * Frames carrying spawns or a checksum are kept for late joiners: a client joining late gets all of them first and
+ * simulates its way up to the current frame. The log holds 64K of them at most, once it's full the host refuses new
+ * clients and only keeps the frames connected clients haven't got yet.
+ */
+void dispatch_lockstep_frame(const LockstepFramePayload& frame);
@@ -0,0 +1,180 @@
+#include "poller.h"
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <print>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <sys/event.h>
+#endif
+
+using namespace std;
+
+const int MAX_RAW_EVENTS = 64;
+
+int set_non_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+#ifdef __linux__
+
+int poller_create(Poller& poller) {
+    poller.fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller.fd < 0) {
+        println("Failed to create epoll instance");
+        return -1;
+    }
+
+    poller.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (poller.wake_fd < 0) {
+        println("Failed to create wakeup eventfd");
+        poller_destroy(poller);
+        return -1;
+    }
+
+    struct epoll_event evt = {};
+    evt.events = EPOLLIN | EPOLLET;
+    evt.data.fd = poller.wake_fd;
+    if (epoll_ctl(poller.fd, EPOLL_CTL_ADD, poller.wake_fd, &evt) < 0) {
+        println("Failed to register wakeup eventfd");
+        poller_destroy(poller);
+        return -1;
+    }
+
+    return 0;
+}
+
+void poller_destroy(Poller& poller) {
+    if (poller.wake_fd >= 0) close(poller.wake_fd);
+    if (poller.fd >= 0) close(poller.fd);
+    poller = {};
+}
+
+int poller_add(Poller& poller, int fd) {
+    struct epoll_event evt = {};
+    evt.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    evt.data.fd = fd;
+    return epoll_ctl(poller.fd, EPOLL_CTL_ADD, fd, &evt);
+}
+
+void poller_remove(Poller& poller, int fd) {
+    epoll_ctl(poller.fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int poller_wait(Poller& poller, PollerEvent* events, int max_events, int timeout_ms) {
+    struct epoll_event raw[MAX_RAW_EVENTS];
+    int num_raw = epoll_wait(poller.fd, raw, max_events < MAX_RAW_EVENTS ? max_events : MAX_RAW_EVENTS, timeout_ms);
+    if (num_raw < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    int num_events = 0;
+    for (int i = 0; i < num_raw; ++i) {
+        if (raw[i].data.fd == poller.wake_fd) {
+            uint64_t count;
+            while (read(poller.wake_fd, &count, sizeof count) > 0) {}
+            continue;
+        }
+
+        events[num_events++] = {
+            .fd = raw[i].data.fd,
+            .readable = (raw[i].events & EPOLLIN) != 0,
+            .writable = (raw[i].events & EPOLLOUT) != 0,
+            .hangup = (raw[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) != 0,
+        };
+    }
+
+    return num_events;
+}
+
+void poller_wake(Poller& poller) {
+    if (poller.wake_fd < 0) return;
+    uint64_t one = 1;
+    (void)!write(poller.wake_fd, &one, sizeof one);
+}
+
+#else
+
+// Identifier of the EVFILT_USER event used for wakeups
+const uintptr_t WAKE_IDENT = 0;
+
+int poller_create(Poller& poller) {
+    poller.fd = kqueue();
+    if (poller.fd < 0) {
+        println("Failed to create kqueue");
+        return -1;
+    }
+
+    struct kevent evt;
+    EV_SET(&evt, WAKE_IDENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    if (kevent(poller.fd, &evt, 1, nullptr, 0, nullptr) < 0) {
+        println("Failed to register wakeup event");
+        poller_destroy(poller);
+        return -1;
+    }
+
+    return 0;
+}
+
+void poller_destroy(Poller& poller) {
+    if (poller.fd >= 0) close(poller.fd);
+    poller = {};
+}
+
+int poller_add(Poller& poller, int fd) {
+    struct kevent evts[2];
+    EV_SET(&evts[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    EV_SET(&evts[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    return kevent(poller.fd, evts, 2, nullptr, 0, nullptr);
+}
+
+void poller_remove(Poller& poller, int fd) {
+    struct kevent evts[2];
+    EV_SET(&evts[0], fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    EV_SET(&evts[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+    kevent(poller.fd, evts, 2, nullptr, 0, nullptr);
+}
+
+int poller_wait(Poller& poller, PollerEvent* events, int max_events, int timeout_ms) {
+    struct kevent raw[MAX_RAW_EVENTS];
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L,
+    };
+
+    int num_raw = kevent(poller.fd, nullptr, 0, raw, max_events < MAX_RAW_EVENTS ? max_events : MAX_RAW_EVENTS,
+                         timeout_ms < 0 ? nullptr : &timeout);
+    if (num_raw < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    // kqueue reports read and write readiness as separate events, they are not merged here
+    int num_events = 0;
+    for (int i = 0; i < num_raw; ++i) {
+        if (raw[i].filter == EVFILT_USER) continue;
+
+        events[num_events++] = {
+            .fd = (int)raw[i].ident,
+            .readable = raw[i].filter == EVFILT_READ,
+            .writable = raw[i].filter == EVFILT_WRITE,
+            .hangup = (raw[i].flags & (EV_EOF | EV_ERROR)) != 0,
+        };
+    }
+
+    return num_events;
+}
+
+void poller_wake(Poller& poller) {
+    if (poller.fd < 0) return;
+    struct kevent evt;
+    EV_SET(&evt, WAKE_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+    kevent(poller.fd, &evt, 1, nullptr, 0, nullptr);
+}
+
+#endif
@@ -0,0 +1,39 @@
+#pragma once
+
+/*
+ * Thin edge-triggered readiness poller: epoll + eventfd on Linux, kqueue + EVFILT_USER elsewhere.
+ * Every registered fd is watched for both read and write readiness, since it's edge-triggered
+ * the caller must drain reads/writes until EAGAIN before waiting again.
+ */
+
+struct PollerEvent {
+    int fd = -1;
+    bool readable = false;
+    bool writable = false;
+    bool hangup = false;
+};
+
+struct Poller {
+    int fd = -1;
+    // eventfd used for wakeups on Linux, unused with kqueue
+    int wake_fd = -1;
+};
+
+int poller_create(Poller& poller);
+void poller_destroy(Poller& poller);
+
+int poller_add(Poller& poller, int fd);
+void poller_remove(Poller& poller, int fd);
+
+/*
+ * Blocks until at least one fd is ready, the poller is woken up or timeout_ms expires (-1 waits forever).
+ * Returns the number of events written to `events`, wakeups are consumed and not reported, -1 on error.
+ */
+int poller_wait(Poller& poller, PollerEvent* events, int max_events, int timeout_ms);
+
+/*
+ * Interrupts a thread blocked in poller_wait, safe to call from any thread
+ */
+void poller_wake(Poller& poller);
+
+int set_non_blocking(int fd);
@@ -0,0 +1,528 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <sys/socket.h>
+#include "bits.h"
+#include "game.h"
+#include "protocol.h"
+
+using namespace std;
+
+constexpr int bits_for(uint32_t num_values) {
+    int bits = 0;
+    while ((1ull << bits) < num_values) ++bits;
+    return bits;
+}
+
+const float POS_MIN_X = -POS_MARGIN;
+const float POS_MIN_Y = -POS_MARGIN;
+const uint32_t POS_X_MAX_QUANTA = (uint32_t)((WIN_WIDTH + 2 * POS_MARGIN) / POS_STEP);
+const uint32_t POS_Y_MAX_QUANTA = (uint32_t)((WIN_HEIGHT + 2 * POS_MARGIN) / POS_STEP);
+const int POS_X_BITS = bits_for(POS_X_MAX_QUANTA + 1);
+const int POS_Y_BITS = bits_for(POS_Y_MAX_QUANTA + 1);
+const float ANGLE_RANGE = 6.28318530718f;
+const uint32_t ANGLE_QUANTA = 1u << ANGLE_BITS;
+
+static uint32_t quantize(float value, float min, uint32_t max_quanta) {
+    float quanta = roundf((value - min) / POS_STEP);
+    if (!(quanta > 0.f)) return 0;
+    if (quanta > (float)max_quanta) return max_quanta;
+    return (uint32_t)quanta;
+}
+
+static uint32_t quantize_x(float x) { return quantize(x, POS_MIN_X, POS_X_MAX_QUANTA); }
+static uint32_t quantize_y(float y) { return quantize(y, POS_MIN_Y, POS_Y_MAX_QUANTA); }
+static float dequantize_x(uint32_t x) { return POS_MIN_X + (float)x * POS_STEP; }
+static float dequantize_y(uint32_t y) { return POS_MIN_Y + (float)y * POS_STEP; }
+
+static uint32_t quantize_angle(float angle) {
+    return (uint32_t)lroundf(angle / ANGLE_RANGE * ANGLE_QUANTA) & (ANGLE_QUANTA - 1);
+}
+
+static float dequantize_angle(uint32_t angle) {
+    return (float)angle * ANGLE_RANGE / ANGLE_QUANTA;
+}
+
+// Sorted ids are sent as gaps between slots, consecutive slots take a single bit, followed by the slot's generation
+static void write_id(BitWriter& writer, uint32_t id, int64_t& prev_slot) {
+    uint32_t slot = entity_id_slot(id);
+    writer.write_exp_golomb((uint32_t)(slot - prev_slot - 1));
+    writer.write_bits(entity_id_generation(id), ENTITY_GENERATION_BITS);
+    prev_slot = slot;
+}
+
+// ENTITY_NO_ID if the slot is out of range
+static uint32_t read_id(BitReader& reader, int64_t& prev_slot) {
+    prev_slot += 1 + (int64_t)reader.read_exp_golomb();
+    uint32_t generation = reader.read_bits(ENTITY_GENERATION_BITS);
+    if (prev_slot >= ENTITY_MAX_SLOTS) return ENTITY_NO_ID;
+    return make_entity_id((uint32_t)prev_slot, generation);
+}
+
+template <typename T>
+static void write_ids(BitWriter& writer, const T* items, uint32_t count) {
+    int64_t prev_slot = -1;
+    for (uint32_t i = 0; i < count; ++i) {
+        write_id(writer, items[i].id, prev_slot);
+    }
+}
+
+static bool read_ids(BitReader& reader, EntityPayload* entities, uint32_t count) {
+    int64_t prev_slot = -1;
+    for (uint32_t i = 0; i < count; ++i) {
+        entities[i].id = read_id(reader, prev_slot);
+        if (entities[i].id == ENTITY_NO_ID) return false;
+    }
+    return !reader.overflow;
+}
+
+size_t write_msg_header(char* buff, MsgType type, uint32_t len) {
+    buff[0] = (char)type;
+    memcpy(buff + 1, &len, sizeof len);
+    return MSG_HEADER_SIZE;
+}
+
+size_t read_frame(const char* buff, size_t buff_len, FrameView& frame) {
+    if (buff_len < MSG_HEADER_SIZE) return 0;
+
+    uint32_t len;
+    memcpy(&len, buff + 1, sizeof len);
+    if (buff_len - MSG_HEADER_SIZE < len) return 0;
+
+    frame = {
+        .type = (MsgType)buff[0],
+        .data = buff + MSG_HEADER_SIZE,
+        .len = len,
+    };
+    return MSG_HEADER_SIZE + len;
+}
+
+size_t write_game_state_frame(char* buff, size_t buff_len, const GameStatePayload& payload) {
+    if (buff_len < MSG_HEADER_SIZE) return 0;
+
+    size_t len = serialize_game_state(buff + MSG_HEADER_SIZE, buff_len - MSG_HEADER_SIZE, payload);
+    if (len == 0) return 0;
+
+    write_msg_header(buff, MsgType::GameState, len);
+    return MSG_HEADER_SIZE + len;
+}
+
+size_t write_spawn_entity_frame(char* buff, size_t buff_len, const SpawnEntityPayload& payload) {
+    assert(buff_len >= MSG_HEADER_SIZE + sizeof payload && "Provided buffer is too small to fit a spawn frame.");
+
+    write_msg_header(buff, MsgType::SpawnEntity, sizeof payload);
+    memcpy(buff + MSG_HEADER_SIZE, &payload, sizeof payload);
+    return MSG_HEADER_SIZE + sizeof payload;
+}
+
+size_t write_snapshot_ack_frame(char* buff, size_t buff_len, const SnapshotAckPayload& payload) {
+    assert(buff_len >= MSG_HEADER_SIZE + sizeof payload && "Provided buffer is too small to fit an ack frame.");
+
+    write_msg_header(buff, MsgType::SnapshotAck, sizeof payload);
+    memcpy(buff + MSG_HEADER_SIZE, &payload, sizeof payload);
+    return MSG_HEADER_SIZE + sizeof payload;
+}
+
+size_t write_spawn_acks_frame(char* buff, size_t buff_len, const SpawnAcksPayload& payload) {
+    assert(buff_len >= MSG_HEADER_SIZE + sizeof payload && "Provided buffer is too small to fit a spawn acks frame.");
+
+    write_msg_header(buff, MsgType::SpawnAcks, sizeof payload);
+    memcpy(buff + MSG_HEADER_SIZE, &payload, sizeof payload);
+    return MSG_HEADER_SIZE + sizeof payload;
+}
+
+size_t write_lockstep_frame_frame(char* buff, size_t buff_len, const LockstepFramePayload& payload) {
+    assert(buff_len >= MSG_HEADER_SIZE + sizeof payload && "Provided buffer is too small to fit a lockstep frame.");
+
+    write_msg_header(buff, MsgType::LockstepFrame, sizeof payload);
+    memcpy(buff + MSG_HEADER_SIZE, &payload, sizeof payload);
+    return MSG_HEADER_SIZE + sizeof payload;
+}
+
+size_t write_lockstep_checksum_frame(char* buff, size_t buff_len, const LockstepChecksumPayload& payload) {
+    assert(buff_len >= MSG_HEADER_SIZE + sizeof payload && "Provided buffer is too small to fit a checksum frame.");
+
+    write_msg_header(buff, MsgType::LockstepChecksum, sizeof payload);
+    memcpy(buff + MSG_HEADER_SIZE, &payload, sizeof payload);
+    return MSG_HEADER_SIZE + sizeof payload;
+}
+
+size_t write_game_state_delta_frame(char* buff, size_t buff_len, const GameStatePayload& baseline, const GameStatePayload& payload) {
+    if (buff_len < MSG_HEADER_SIZE) return 0;
+
+    size_t len = serialize_game_state_delta(buff + MSG_HEADER_SIZE, buff_len - MSG_HEADER_SIZE, baseline, payload);
+    if (len == 0) return 0;
+
+    write_msg_header(buff, MsgType::GameStateDelta, len);
+    return MSG_HEADER_SIZE + len;
+}
+
+// Bits write_exp_golomb takes for `value`
+static size_t exp_golomb_bits(uint32_t value) {
+    return 2 * (size_t)(31 - __builtin_clz(value + 1)) + 1;
+}
+
+// Frame, covered slots and entity count varints at their longest
+const size_t GAME_STATE_HEADER_BITS = 8 * (10 + 5 + 5 + 5) + POS_X_BITS + POS_Y_BITS + ANGLE_BITS;
+
+size_t max_game_state_size(bool stream) {
+    if (!stream) return MAX_GAME_STATE_SIZE;
+    // Every entity at the longest slot gap
+    size_t entity_bits = exp_golomb_bits(ENTITY_MAX_SLOTS) + ENTITY_GENERATION_BITS + POS_X_BITS + POS_Y_BITS;
+    size_t bits = GAME_STATE_HEADER_BITS + entity_buffer_capacity() * entity_bits;
+    return min(MAX_STREAM_GAME_STATE_SIZE, (bits + 7) / 8);
+}
+
+uint32_t game_state_entities_fitting(const EntityPayload* entities, uint32_t count, size_t buff_len) {
+    size_t bits = GAME_STATE_HEADER_BITS;
+    size_t max_bits = 8 * buff_len;
+
+    int64_t prev_slot = -1;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t slot = entity_id_slot(entities[i].id);
+        // Wrapped around to the first slots: counting the gap from slot 0 again only overestimates the sorted encoding
+        if (slot <= prev_slot) prev_slot = -1;
+        bits += exp_golomb_bits((uint32_t)(slot - prev_slot - 1)) + ENTITY_GENERATION_BITS + POS_X_BITS + POS_Y_BITS;
+        if (bits > max_bits) return i;
+        prev_slot = slot;
+    }
+    return count;
+}
+
+size_t serialize_game_state(char* buff, size_t buff_len, const GameStatePayload& payload) {
+    BitWriter writer = {.buff = (uint8_t*)buff, .buff_len = buff_len};
+
+    writer.write_varint(payload.server_command_frame);
+    writer.write_bits(quantize_x(payload.player_pos[0]), POS_X_BITS);
+    writer.write_bits(quantize_y(payload.player_pos[1]), POS_Y_BITS);
+    writer.write_bits(quantize_angle(payload.player_angle), ANGLE_BITS);
+    writer.write_varint(payload.first_slot);
+    writer.write_varint(payload.end_slot);
+
+    writer.write_varint(payload.num_entities);
+    write_ids(writer, payload.entities.get(), payload.num_entities);
+
+    for (uint32_t i = 0; i < payload.num_entities; ++i) {
+        writer.write_bits(quantize_x(payload.entities[i].pos.x), POS_X_BITS);
+        writer.write_bits(quantize_y(payload.entities[i].pos.y), POS_Y_BITS);
+    }
+
+    size_t len = writer.flush();
+    return writer.overflow ? 0 : len;
+}
+
+bool deserialize_game_state(const char* msg, size_t msg_len, GameStatePayload& game_state) {
+    BitReader reader = {.buff = (const uint8_t*)msg, .buff_len = msg_len};
+
+    game_state.server_command_frame = reader.read_varint();
+    game_state.player_pos[0] = dequantize_x(reader.read_bits(POS_X_BITS));
+    game_state.player_pos[1] = dequantize_y(reader.read_bits(POS_Y_BITS));
+    game_state.player_angle = dequantize_angle(reader.read_bits(ANGLE_BITS));
+    game_state.first_slot = (uint32_t)reader.read_varint();
+    game_state.end_slot = (uint32_t)reader.read_varint();
+
+    uint64_t num_entities = reader.read_varint();
+    // Every entity takes at least 1 bit of slot, its generation and its coordinates, don't trust a count the message can't hold
+    if (reader.overflow || num_entities > entity_buffer_capacity()
+        || num_entities * (1 + ENTITY_GENERATION_BITS + POS_X_BITS + POS_Y_BITS) > reader.bits_left()) return false;
+    game_state.num_entities = (uint32_t)num_entities;
+
+    if (!game_state.entities) {
+        game_state.entities = acquire_entity_buffer();
+    }
+    if (!read_ids(reader, game_state.entities.get(), game_state.num_entities)) return false;
+
+    for (uint32_t i = 0; i < game_state.num_entities; ++i) {
+        game_state.entities[i].pos.x = dequantize_x(reader.read_bits(POS_X_BITS));
+        game_state.entities[i].pos.y = dequantize_y(reader.read_bits(POS_Y_BITS));
+    }
+
+    return !reader.overflow;
+}
+
+bool deserialize_spawn_entity(const char* msg, size_t msg_len, SpawnEntityPayload& payload) {
+    if (msg_len != sizeof(SpawnEntityPayload)) return false;
+    memcpy(&payload, msg, msg_len);
+    return true;
+}
+
+void ring_init(RecvRing& ring, size_t capacity) {
+    ring.buff = unique_ptr<char[]>(new char[capacity]);
+    ring.capacity = capacity;
+    ring.read_pos = 0;
+    ring.write_pos = 0;
+}
+
+ssize_t ring_recv(RecvRing& ring, int fd, int flags) {
+    if (ring.write_pos == ring.capacity) {
+        if (ring.read_pos == 0) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        // Wrap around, only the trailing partial frame is left to move
+        size_t pending = ring.write_pos - ring.read_pos;
+        memmove(ring.buff.get(), ring.buff.get() + ring.read_pos, pending);
+        ring.read_pos = 0;
+        ring.write_pos = pending;
+    }
+
+    ssize_t len = recv(fd, ring.buff.get() + ring.write_pos, ring.capacity - ring.write_pos, flags);
+    if (len > 0) {
+        ring.write_pos += len;
+    }
+    return len;
+}
+
+bool ring_write(RecvRing& ring, const char* data, size_t len) {
+    if (ring.capacity - ring.write_pos < len) {
+        size_t pending = ring.write_pos - ring.read_pos;
+        if (pending + len > ring.capacity) return false;
+
+        memmove(ring.buff.get(), ring.buff.get() + ring.read_pos, pending);
+        ring.read_pos = 0;
+        ring.write_pos = pending;
+    }
+
+    memcpy(ring.buff.get() + ring.write_pos, data, len);
+    ring.write_pos += len;
+    return true;
+}
+
+bool ring_next_frame(RecvRing& ring, FrameView& frame) {
+    size_t len = read_frame(ring.buff.get() + ring.read_pos, ring.write_pos - ring.read_pos, frame);
+    if (len == 0) return false;
+
+    ring.read_pos += len;
+    // Cheap reset while the ring is empty so the next reads start at the beginning again
+    if (ring.read_pos == ring.write_pos) {
+        ring.read_pos = 0;
+        ring.write_pos = 0;
+    }
+    return true;
+}
+
+bool deserialize_snapshot_ack(const char* msg, size_t msg_len, SnapshotAckPayload& payload) {
+    if (msg_len != sizeof(SnapshotAckPayload)) return false;
+    memcpy(&payload, msg, msg_len);
+    return true;
+}
+
+bool deserialize_spawn_acks(const char* msg, size_t msg_len, SpawnAcksPayload& payload) {
+    if (msg_len != sizeof(SpawnAcksPayload)) return false;
+    memcpy(&payload, msg, msg_len);
+    return payload.num_acks + payload.num_leases <= MAX_SPAWN_ACK_IDS;
+}
+
+bool deserialize_lockstep_frame(const char* msg, size_t msg_len, LockstepFramePayload& payload) {
+    if (msg_len != sizeof(LockstepFramePayload)) return false;
+    memcpy(&payload, msg, msg_len);
+    return payload.num_spawns <= MAX_LOCKSTEP_SPAWNS;
+}
+
+bool deserialize_lockstep_checksum(const char* msg, size_t msg_len, LockstepChecksumPayload& payload) {
+    if (msg_len != sizeof(LockstepChecksumPayload)) return false;
+    memcpy(&payload, msg, msg_len);
+    return true;
+}
+
+void history_init(SnapshotHistory& history) {
+    for (size_t i = 0; i < SNAPSHOT_HISTORY_SIZE; ++i) {
+        history.states[i].entities = acquire_entity_buffer();
+        history.valid[i] = false;
+    }
+    history.initialized = true;
+}
+
+void history_store(SnapshotHistory& history, const GameStatePayload& state) {
+    size_t slot = state.server_command_frame % SNAPSHOT_HISTORY_SIZE;
+    GameStatePayload& stored = history.states[slot];
+    stored.server_command_frame = state.server_command_frame;
+    stored.player_pos[0] = state.player_pos[0];
+    stored.player_pos[1] = state.player_pos[1];
+    stored.player_angle = state.player_angle;
+    stored.first_slot = state.first_slot;
+    stored.end_slot = state.end_slot;
+    stored.num_entities = state.num_entities;
+    memcpy(stored.entities.get(), state.entities.get(), sizeof(EntityPayload) * state.num_entities);
+    history.valid[slot] = true;
+}
+
+const GameStatePayload* history_find(const SnapshotHistory& history, uint64_t server_command_frame) {
+    size_t slot = server_command_frame % SNAPSHOT_HISTORY_SIZE;
+    if (!history.valid[slot] || history.states[slot].server_command_frame != server_command_frame) return nullptr;
+    return &history.states[slot];
+}
+
+// Field masks of the delta encoding
+const uint8_t DELTA_X = 1 << 0;
+const uint8_t DELTA_Y = 1 << 1;
+const uint8_t DELTA_ANGLE = 1 << 2;
+
+size_t serialize_game_state_delta(char* buff, size_t buff_len, const GameStatePayload& baseline, const GameStatePayload& payload) {
+    BitWriter writer = {.buff = (uint8_t*)buff, .buff_len = buff_len};
+
+    writer.write_varint(payload.server_command_frame);
+    writer.write_varint(payload.server_command_frame - baseline.server_command_frame);
+
+    uint32_t player_x = quantize_x(payload.player_pos[0]);
+    uint32_t player_y = quantize_y(payload.player_pos[1]);
+    uint32_t player_angle = quantize_angle(payload.player_angle);
+
+    uint8_t player_mask = 0;
+    if (player_x != quantize_x(baseline.player_pos[0])) player_mask |= DELTA_X;
+    if (player_y != quantize_y(baseline.player_pos[1])) player_mask |= DELTA_Y;
+    if (player_angle != quantize_angle(baseline.player_angle)) player_mask |= DELTA_ANGLE;
+
+    writer.write_bits(player_mask, 3);
+    if (player_mask & DELTA_X) writer.write_bits(player_x, POS_X_BITS);
+    if (player_mask & DELTA_Y) writer.write_bits(player_y, POS_Y_BITS);
+    if (player_mask & DELTA_ANGLE) writer.write_bits(player_angle, ANGLE_BITS);
+    writer.write_varint(payload.first_slot);
+    writer.write_varint(payload.end_slot);
+
+    // Counts are written ahead of the lists, so lists are walked twice: once to count, once to write
+    uint32_t num_removed = 0;
+    uint32_t num_changed = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) writer.write_varint(num_removed);
+
+        int64_t prev_slot = -1;
+        for (uint32_t i = 0, j = 0; i < baseline.num_entities; ++i) {
+            uint32_t id = baseline.entities[i].id;
+            while (j < payload.num_entities && payload.entities[j].id < id) ++j;
+            if (j < payload.num_entities && payload.entities[j].id == id) continue;
+
+            if (pass == 0) {
+                ++num_removed;
+            } else {
+                write_id(writer, id, prev_slot);
+            }
+        }
+
+        if (pass == 1) writer.write_varint(num_changed);
+
+        prev_slot = -1;
+        for (uint32_t i = 0, j = 0; j < payload.num_entities; ++j) {
+            const EntityPayload& entity = payload.entities[j];
+            while (i < baseline.num_entities && baseline.entities[i].id < entity.id) ++i;
+
+            uint32_t x = quantize_x(entity.pos.x);
+            uint32_t y = quantize_y(entity.pos.y);
+            bool is_new = i >= baseline.num_entities || baseline.entities[i].id != entity.id;
+
+            int32_t dx = 0, dy = 0;
+            if (!is_new) {
+                dx = (int32_t)x - (int32_t)quantize_x(baseline.entities[i].pos.x);
+                dy = (int32_t)y - (int32_t)quantize_y(baseline.entities[i].pos.y);
+                if (dx == 0 && dy == 0) continue;
+            }
+
+            if (pass == 0) {
+                ++num_changed;
+                continue;
+            }
+
+            write_id(writer, entity.id, prev_slot);
+
+            // Entities the baseline doesn't know about are sent whole
+            if (is_new) {
+                writer.write_bits(x, POS_X_BITS);
+                writer.write_bits(y, POS_Y_BITS);
+                continue;
+            }
+
+            uint8_t mask = (dx != 0 ? DELTA_X : 0) | (dy != 0 ? DELTA_Y : 0);
+            writer.write_bits(mask, 2);
+            if (mask & DELTA_X) writer.write_signed(dx);
+            if (mask & DELTA_Y) writer.write_signed(dy);
+        }
+    }
+
+    size_t len = writer.flush();
+    return writer.overflow ? 0 : len;
+}
+
+bool deserialize_game_state_delta(const char* msg, size_t msg_len, const SnapshotHistory& history, GameStatePayload& game_state) {
+    BitReader reader = {.buff = (const uint8_t*)msg, .buff_len = msg_len};
+
+    game_state.server_command_frame = reader.read_varint();
+    uint64_t baseline_frame = game_state.server_command_frame - reader.read_varint();
+    if (reader.overflow) return false;
+
+    const GameStatePayload* baseline = history_find(history, baseline_frame);
+    if (baseline == nullptr) return false;
+
+    uint8_t player_mask = reader.read_bits(3);
+    game_state.player_pos[0] = player_mask & DELTA_X ? dequantize_x(reader.read_bits(POS_X_BITS)) : baseline->player_pos[0];
+    game_state.player_pos[1] = player_mask & DELTA_Y ? dequantize_y(reader.read_bits(POS_Y_BITS)) : baseline->player_pos[1];
+    game_state.player_angle = player_mask & DELTA_ANGLE ? dequantize_angle(reader.read_bits(ANGLE_BITS)) : baseline->player_angle;
+    game_state.first_slot = (uint32_t)reader.read_varint();
+    game_state.end_slot = (uint32_t)reader.read_varint();
+
+    uint64_t num_removed = reader.read_varint();
+    if (reader.overflow || num_removed > baseline->num_entities) return false;
+
+    // The removed list is consumed during the merge through a second reader, the main one skips over it
+    BitReader removed = reader;
+    for (uint64_t i = 0; i < num_removed; ++i) {
+        reader.read_exp_golomb();
+        reader.read_bits(ENTITY_GENERATION_BITS);
+    }
+
+    uint64_t num_changed = reader.read_varint();
+    // A changed entity takes at least 1 bit of slot, its generation and 2 bits of mask
+    if (reader.overflow || num_changed * (3 + ENTITY_GENERATION_BITS) > reader.bits_left()) return false;
+
+    if (!game_state.entities) {
+        game_state.entities = acquire_entity_buffer();
+    }
+    game_state.num_entities = 0;
+    uint32_t capacity = entity_buffer_capacity();
+
+    // Merge the baseline with the removed and changed lists, all three are sorted by id.
+    // A slot recycled since the baseline shows up as its old id removed and its new id changed.
+    int64_t removed_slot = -1;
+    int64_t changed_slot = -1;
+    uint32_t next_removed = num_removed > 0 ? read_id(removed, removed_slot) : ENTITY_NO_ID;
+    uint32_t base_idx = 0;
+    uint32_t next_changed = num_changed > 0 ? read_id(reader, changed_slot) : ENTITY_NO_ID;
+    if (num_changed > 0 && next_changed == ENTITY_NO_ID) return false;
+
+    while (base_idx < baseline->num_entities || next_changed != ENTITY_NO_ID) {
+        EntityPayload entity;
+        bool from_baseline = base_idx < baseline->num_entities && (next_changed == ENTITY_NO_ID || baseline->entities[base_idx].id <= next_changed);
+
+        if (from_baseline) {
+            entity = baseline->entities[base_idx++];
+
+            if (next_removed == entity.id) {
+                next_removed = --num_removed > 0 ? read_id(removed, removed_slot) : ENTITY_NO_ID;
+                continue;
+            }
+        } else {
+            entity.id = next_changed;
+        }
+
+        if (next_changed == entity.id) {
+            if (from_baseline) {
+                uint8_t mask = reader.read_bits(2);
+                if (mask & DELTA_X) entity.pos.x = dequantize_x(quantize_x(entity.pos.x) + reader.read_signed());
+                if (mask & DELTA_Y) entity.pos.y = dequantize_y(quantize_y(entity.pos.y) + reader.read_signed());
+            } else {
+                entity.pos.x = dequantize_x(reader.read_bits(POS_X_BITS));
+                entity.pos.y = dequantize_y(reader.read_bits(POS_Y_BITS));
+            }
+
+            next_changed = --num_changed > 0 ? read_id(reader, changed_slot) : ENTITY_NO_ID;
+            if (reader.overflow || (num_changed > 0 && next_changed == ENTITY_NO_ID)) return false;
+        }
+
+        if (game_state.num_entities == capacity) return false;
+        game_state.entities[game_state.num_entities++] = entity;
+    }
+
+    return !reader.overflow;
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include "entity_id.h"
+#include "entity_pool.h"
+#include "raylib.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <sys/types.h>
+
+struct EntityPayload {
+    // See entity_id.h
+    uint32_t id = 0;
+    Vector2 pos {0.f, 0.f};
+};
+
+struct GameStatePayload {
+    uint64_t server_command_frame = 0;
+    float player_pos[2] {0.f, 0.f};
+    float player_angle = 0.f;
+    // Slots the snapshot covers, from first_slot up to end_slot wrapping around past the last one, all of them when
+    // equal. A snapshot too big for a frame only covers some, entities of the other slots are left out, not despawned.
+    uint32_t first_slot = 0;
+    uint32_t end_slot = 0;
+    uint32_t num_entities = 0;
+    // Holds up to entity_buffer_capacity() entities, decoding reuses the buffer already there if any
+    EntityBuffer entities = nullptr;
+};
+
+struct SpawnEntityPayload {
+    uint64_t command_frame = 0;
+    // Numbers the client's spawns in the order they're sent, SpawnAcksPayload refers to them by it
+    uint32_t local_id = 0;
+    // One of the ids the host leased to the client, or ENTITY_NO_ID to have the host pick one
+    uint32_t id = ENTITY_NO_ID;
+    Vector2 pos = {0.f, 0.f};
+    Vector2 dir = {0.f, 0.f};
+};
+
+const uint32_t MAX_SPAWN_ACK_IDS = 12;
+
+/*
+ * Host to client, at most one batch per tick and more only if the ids don't fit one message.
+ * Acks spawns local_ids [first_local_id, first_local_id + num_acks[ with the id the host actually used: the leased id
+ * the client sent, another one if the lease wasn't valid (or there was none), ENTITY_NO_ID if every slot was taken.
+ * Then grants num_leases more ids the client can spawn with.
+ */
+struct SpawnAcksPayload {
+    uint32_t first_local_id = 0;
+    uint8_t num_acks = 0;
+    uint8_t num_leases = 0;
+    // Acked ids first, then the leases
+    uint32_t ids[MAX_SPAWN_ACK_IDS] = {};
+};
+
+/*
+ * Lockstep: a spawn the host accepted, already in the fixed point the simulation runs on (see ENTITY_FIXED_ONE)
+ */
+struct LockstepSpawn {
+    uint32_t id = 0;
+    int32_t x = 0;
+    int32_t y = 0;
+    // Per tick
+    int16_t vx = 0;
+    int16_t vy = 0;
+};
+
+const uint32_t MAX_LOCKSTEP_SPAWNS = 2;
+
+/*
+ * Lockstep, host to client, reliable: closes every frame up to `frame`, the spawns apply at `frame`.
+ * Frames with nothing in them may be skipped, the next frame sent closes them. A host with more spawns in a tick
+ * than fit pushes the rest to the following frames.
+ */
+struct LockstepFramePayload {
+    uint64_t frame = 0;
+    // entity_store_checksum after the frame, when has_checksum
+    uint32_t checksum = 0;
+    uint8_t num_spawns = 0;
+    bool has_checksum = false;
+    // The host's ship, whole pixels and 1/65536 of a turn. Shown but not simulated by clients.
+    int16_t player_x = 0;
+    int16_t player_y = 0;
+    uint16_t player_angle = 0;
+    LockstepSpawn spawns[MAX_LOCKSTEP_SPAWNS];
+};
+
+/*
+ * Lockstep, client to host: the client's checksum for a frame the host sent one for
+ */
+struct LockstepChecksumPayload {
+    uint64_t frame = 0;
+    uint32_t checksum = 0;
+};
+
+/*
+ * Sent by clients for every snapshot they decoded, the host then delta encodes against the latest acked one
+ */
+struct SnapshotAckPayload {
+    uint64_t server_command_frame = 0;
+};
+
+/*
+ * Every message on the wire is a frame: a 1 byte type and a 4 bytes payload length followed by the payload.
+ * TCP connections are a stream of frames, UDP datagrams carry frames after the reliability prefix.
+ */
+enum class MsgType : uint8_t {GameState = 1, SpawnEntity, GameStateDelta, SnapshotAck, SpawnAcks, LockstepFrame, LockstepChecksum};
+
+const size_t MSG_HEADER_SIZE = sizeof(uint8_t) + sizeof(uint32_t);
+
+struct FrameView {
+    MsgType type;
+    const char* data = nullptr;
+    uint32_t len = 0;
+};
+
+size_t write_msg_header(char* buff, MsgType type, uint32_t len);
+
+/*
+ * Parses the frame at the start of buff, returns the number of bytes it spans or 0 if it's not complete yet
+ */
+size_t read_frame(const char* buff, size_t buff_len, FrameView& frame);
+
+/*
+ * Writes a whole frame (header + payload), returns its length. Game states return 0 when they don't fit.
+ */
+size_t write_game_state_frame(char* buff, size_t buff_len, const GameStatePayload& payload);
+size_t write_spawn_entity_frame(char* buff, size_t buff_len, const SpawnEntityPayload& payload);
+size_t write_snapshot_ack_frame(char* buff, size_t buff_len, const SnapshotAckPayload& payload);
+size_t write_spawn_acks_frame(char* buff, size_t buff_len, const SpawnAcksPayload& payload);
+size_t write_lockstep_frame_frame(char* buff, size_t buff_len, const LockstepFramePayload& payload);
+size_t write_lockstep_checksum_frame(char* buff, size_t buff_len, const LockstepChecksumPayload& payload);
+/*
+ * Returns 0 if the delta doesn't fit, a full game state should be sent instead
+ */
+size_t write_game_state_delta_frame(char* buff, size_t buff_len, const GameStatePayload& baseline, const GameStatePayload& payload);
+
+/*
+ * Game states are bit-packed (see bits.h): server_command_frame as a varint, ids as a sorted gap-coded list and
+ * positions/angle quantized. Positions are rounded to POS_STEP inside the window extended by POS_MARGIN on every side,
+ * anything further out is clamped. The angle is expected in [0, 2π) and rounded to 2π / 2^ANGLE_BITS.
+ * Within those bounds a round trip is off by at most POS_STEP / 2 per axis and π / 2^ANGLE_BITS for the angle.
+ */
+const int POS_FRAC_BITS = 0;
+const float POS_STEP = 1.f / (1 << POS_FRAC_BITS);
+const float POS_MARGIN = 64.f;
+const int ANGLE_BITS = 12;
+
+/*
+ * Snapshots (full or delta) sent in datagrams are kept under MAX_GAME_STATE_SIZE bytes, header excluded, so one always
+ * fits next to a full reliability prefix. Over a stream they go up to MAX_STREAM_GAME_STATE_SIZE, enough for
+ * MAX_NETWORKED_ENTITIES. The host leaves the entities that don't fit out, see game_state_entities_fitting.
+ */
+const size_t MAX_GAME_STATE_SIZE = 1400;
+const size_t MAX_STREAM_GAME_STATE_SIZE = 320 * 1024;
+
+/*
+ * Biggest game state the host sends over a stream or in a datagram: the limit above, less for stream snapshots that
+ * can't get that big with entity_buffer_capacity() entities
+ */
+size_t max_game_state_size(bool stream);
+
+/*
+ * How many of the first `count` entities a full game state can hold in `buff_len` bytes. They're sorted by id, or
+ * in two sorted runs when the host starts from a slot in the middle and wraps around to the first ones.
+ */
+uint32_t game_state_entities_fitting(const EntityPayload* entities, uint32_t count, size_t buff_len);
+
+/*
+ * Whether `slot` is one of the slots `state` covers, see GameStatePayload
+ */
+inline bool game_state_covers(const GameStatePayload& state, uint32_t slot) {
+    if (state.first_slot == state.end_slot) return true;
+    if (state.first_slot < state.end_slot) return slot >= state.first_slot && slot < state.end_slot;
+    return slot >= state.first_slot || slot < state.end_slot;
+}
+
+/*
+ * Returns 0 if the game state doesn't fit in buff_len
+ */
+size_t serialize_game_state(char* buff, size_t buff_len, const GameStatePayload& payload);
+bool deserialize_game_state(const char* msg, size_t msg_len, GameStatePayload& game_state);
+bool deserialize_spawn_entity(const char* msg, size_t msg_len, SpawnEntityPayload& payload);
+bool deserialize_snapshot_ack(const char* msg, size_t msg_len, SnapshotAckPayload& payload);
+bool deserialize_spawn_acks(const char* msg, size_t msg_len, SpawnAcksPayload& payload);
+bool deserialize_lockstep_frame(const char* msg, size_t msg_len, LockstepFramePayload& payload);
+bool deserialize_lockstep_checksum(const char* msg, size_t msg_len, LockstepChecksumPayload& payload);
+
+/*
+ * Recent snapshots indexed by server_command_frame, used as delta baselines by both ends.
+ * Slots hold on to their entity buffers so storing a snapshot never allocates.
+ */
+const size_t SNAPSHOT_HISTORY_SIZE = 64;
+
+struct SnapshotHistory {
+    GameStatePayload states[SNAPSHOT_HISTORY_SIZE];
+    bool valid[SNAPSHOT_HISTORY_SIZE] = {};
+    bool initialized = false;
+};
+
+void history_init(SnapshotHistory& history);
+void history_store(SnapshotHistory& history, const GameStatePayload& state);
+const GameStatePayload* history_find(const SnapshotHistory& history, uint64_t server_command_frame);
+
+/*
+ * Delta snapshots only carry the player fields and entities that changed since the baseline, plus the ids of entities
+ * that went away. Both entity lists must be sorted by id, which the host guarantees by sending entities in slot order.
+ * Changes are detected on quantized values, coordinates of known entities are sent as the difference from the baseline.
+ */
+size_t serialize_game_state_delta(char* buff, size_t buff_len, const GameStatePayload& baseline, const GameStatePayload& payload);
+/*
+ * Looks the baseline up in `history`, fails if it's not there anymore
+ */
+bool deserialize_game_state_delta(const char* msg, size_t msg_len, const SnapshotHistory& history, GameStatePayload& game_state);
+
+const size_t RECV_RING_CAPACITY = 64 * 1024;
+
+/*
+ * Per-connection receive buffer reassembling frames out of a TCP stream.
+ * Reads are appended at the write cursor, when it reaches the end of the buffer the leftover partial frame
+ * is moved back to the start so complete frames always sit contiguously and can be handed out as views.
+ */
+struct RecvRing {
+    std::unique_ptr<char[]> buff = nullptr;
+    size_t capacity = 0;
+    size_t read_pos = 0;
+    size_t write_pos = 0;
+};
+
+void ring_init(RecvRing& ring, size_t capacity = RECV_RING_CAPACITY);
+
+/*
+ * Single recv into the ring. Same return values as recv, frames that can't fit the ring fail with EMSGSIZE.
+ * Views handed out by ring_next_frame are invalidated by this call.
+ */
+ssize_t ring_recv(RecvRing& ring, int fd, int flags);
+
+/*
+ * Appends bytes that were received earlier (e.g. held back by impair.h), returns false if they can't fit the ring.
+ * Same invalidation rule as ring_recv.
+ */
+bool ring_write(RecvRing& ring, const char* data, size_t len);
+
+/*
+ * Hands out the next complete frame and consumes it, returns false once only a partial frame (or nothing) is left
+ */
+bool ring_next_frame(RecvRing& ring, FrameView& frame);
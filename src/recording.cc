@@ -0,0 +1,159 @@
+#include "recording.h"
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <print>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static uint64_t recording_now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Grows the file to hold a whole segment at `offset` and maps it, the new bytes read as zeros
+static bool map_segment(Recorder& recorder, size_t offset) {
+    if (recorder.segment) {
+        munmap(recorder.segment, RECORDING_SEGMENT_SIZE);
+        recorder.segment = nullptr;
+    }
+    if (ftruncate(recorder.fd, (off_t)(offset + RECORDING_SEGMENT_SIZE)) < 0) {
+        println("Failed to grow the recording");
+        return false;
+    }
+
+    void* segment = mmap(nullptr, RECORDING_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, recorder.fd, (off_t)offset);
+    if (segment == MAP_FAILED) {
+        println("Failed to map the recording");
+        return false;
+    }
+    recorder.segment = static_cast<char*>(segment);
+    recorder.segment_offset = offset;
+    return true;
+}
+
+bool recorder_open(Recorder& recorder, const char* path, uint32_t num_entities) {
+    recorder_close(recorder);
+
+    recorder.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (recorder.fd < 0) {
+        println("Failed to create recording {}", path);
+        return false;
+    }
+    if (!map_segment(recorder, 0)) {
+        recorder_close(recorder);
+        return false;
+    }
+
+    RecordingFileHeader header = {.magic = {}, .version = RECORDING_VERSION, .num_entities = num_entities};
+    memcpy(header.magic, RECORDING_MAGIC, sizeof header.magic);
+    memcpy(recorder.segment, &header, sizeof header);
+    recorder.pos = sizeof header;
+    recorder.start_ns = recording_now_ns();
+    recorder.num_records = 0;
+    return true;
+}
+
+bool recorder_append(Recorder& recorder, uint32_t client_id, const char* frame, size_t len) {
+    if (!recorder_is_open(recorder)) return false;
+
+    size_t record_len = sizeof(RecordHeader) + len;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    // A record has to fit a segment even when the segment starts up to a page before it
+    if (len == 0 || record_len > RECORDING_SEGMENT_SIZE - page_size) return false;
+
+    if (recorder.pos + record_len > recorder.segment_offset + RECORDING_SEGMENT_SIZE
+        && !map_segment(recorder, recorder.pos / page_size * page_size)) {
+        recorder_close(recorder);
+        return false;
+    }
+
+    RecordHeader header = {
+        .time_ns = recording_now_ns() - recorder.start_ns,
+        .client_id = client_id,
+        .len = (uint32_t)len,
+    };
+    char* at = recorder.segment + (recorder.pos - recorder.segment_offset);
+    memcpy(at, &header, sizeof header);
+    memcpy(at + sizeof header, frame, len);
+    recorder.pos += record_len;
+    ++recorder.num_records;
+    return true;
+}
+
+void recorder_close(Recorder& recorder) {
+    if (recorder.segment) {
+        munmap(recorder.segment, RECORDING_SEGMENT_SIZE);
+        recorder.segment = nullptr;
+    }
+    if (recorder.fd >= 0) {
+        // Drops the zeroed tail of the last segment
+        if (ftruncate(recorder.fd, (off_t)recorder.pos) < 0) {
+            println("Failed to trim the recording");
+        }
+        close(recorder.fd);
+        recorder.fd = -1;
+    }
+}
+
+bool recording_open(RecordingReader& reader, const char* path) {
+    recording_close(reader);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        println("Failed to open recording {}", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(RecordingFileHeader)) {
+        println("{} is not a recording", path);
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive
+    close(fd);
+    if (data == MAP_FAILED) {
+        println("Failed to map recording {}", path);
+        return false;
+    }
+    reader.data = static_cast<const char*>(data);
+    reader.size = (size_t)st.st_size;
+    // Read front to back once, or again for every loop
+    madvise(data, reader.size, MADV_SEQUENTIAL);
+
+    memcpy(&reader.header, reader.data, sizeof reader.header);
+    if (memcmp(reader.header.magic, RECORDING_MAGIC, sizeof RECORDING_MAGIC) != 0 || reader.header.version != RECORDING_VERSION) {
+        println("{} is not a version {} recording", path, RECORDING_VERSION);
+        recording_close(reader);
+        return false;
+    }
+    recording_rewind(reader);
+    return true;
+}
+
+bool recording_next(RecordingReader& reader, Record& record) {
+    if (reader.size - reader.pos < sizeof(RecordHeader)) return false;
+
+    memcpy(&record.header, reader.data + reader.pos, sizeof record.header);
+    size_t len = record.header.len;
+    if (len == 0 || reader.size - reader.pos - sizeof(RecordHeader) < len) return false;
+
+    record.frame = reader.data + reader.pos + sizeof(RecordHeader);
+    reader.pos += sizeof(RecordHeader) + len;
+    return true;
+}
+
+void recording_rewind(RecordingReader& reader) {
+    reader.pos = sizeof(RecordingFileHeader);
+}
+
+void recording_close(RecordingReader& reader) {
+    if (reader.data) {
+        munmap(const_cast<char*>(reader.data), reader.size);
+    }
+    reader = {};
+}
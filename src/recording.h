@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Session recordings: an append-only file of whole wire frames (see protocol.h) as the host saw them, each one behind
+ * a RecordHeader with the time it was taken and the client it came from. The host records the full encoding of every
+ * snapshot it sends and every spawn it receives, tools/netreplay plays them back.
+ *
+ * The file is written through a memory-mapped segment: appending is a memcpy, the kernel writes the pages back on its
+ * own time. When a record doesn't fit what's left of the segment the file is grown and the next segment mapped.
+ * A recording cut short (crash, kill -9) ends at the first zeroed header, everything before it is readable.
+ */
+
+const char RECORDING_MAGIC[8] = {'N', 'G', 'R', 'E', 'C', 'O', 'R', 'D'};
+const uint32_t RECORDING_VERSION = 1;
+// Records sent by the host itself (snapshots) rather than received from a client
+const uint32_t RECORDING_HOST = UINT32_MAX;
+
+struct RecordingFileHeader {
+    char magic[8];
+    uint32_t version = RECORDING_VERSION;
+    // The host's --entities, a client replaying the recording has to use the same
+    uint32_t num_entities = 0;
+};
+
+struct RecordHeader {
+    // Since the recording started
+    uint64_t time_ns = 0;
+    uint32_t client_id = RECORDING_HOST;
+    // Of the frame that follows, header included, never 0
+    uint32_t len = 0;
+};
+
+// Mapped at once while recording, a record never spans two segments
+const size_t RECORDING_SEGMENT_SIZE = 4 << 20;
+
+struct Recorder {
+    int fd = -1;
+    char* segment = nullptr;
+    // File offset of the segment, a multiple of the page size
+    size_t segment_offset = 0;
+    // Where the next record goes, the file's length once closed
+    size_t pos = 0;
+    uint64_t start_ns = 0;
+    uint64_t num_records = 0;
+};
+
+/*
+ * Creates (or truncates) `path` and writes the file header, false if the file can't be created or mapped
+ */
+bool recorder_open(Recorder& recorder, const char* path, uint32_t num_entities);
+
+/*
+ * Appends one whole frame. Only stalls when a new segment gets mapped, every RECORDING_SEGMENT_SIZE bytes.
+ * Recording stops (and false is returned) if the file can't grow anymore.
+ */
+bool recorder_append(Recorder& recorder, uint32_t client_id, const char* frame, size_t len);
+
+/*
+ * Unmaps the segment and trims the file to what was recorded
+ */
+void recorder_close(Recorder& recorder);
+
+inline bool recorder_is_open(const Recorder& recorder) {
+    return recorder.fd >= 0;
+}
+
+/*
+ * Read side, the whole file is mapped at once
+ */
+struct RecordingReader {
+    const char* data = nullptr;
+    size_t size = 0;
+    size_t pos = 0;
+    RecordingFileHeader header;
+};
+
+struct Record {
+    RecordHeader header;
+    const char* frame = nullptr;
+};
+
+/*
+ * False if `path` can't be mapped or isn't a recording of this version
+ */
+bool recording_open(RecordingReader& reader, const char* path);
+
+/*
+ * Next record, false at the end of the recording. `record.frame` stays valid until recording_close.
+ */
+bool recording_next(RecordingReader& reader, Record& record);
+
+/*
+ * Back to the first record
+ */
+void recording_rewind(RecordingReader& reader);
+
+void recording_close(RecordingReader& reader);
@@ -0,0 +1,166 @@
+#include "reliability.h"
+#include <cstring>
+
+bool seq_greater(uint16_t a, uint16_t b) {
+    return (a > b && a - b <= 32768) || (a < b && b - a > 32768);
+}
+
+static void ack_packet(UdpConnection& conn, uint16_t seq) {
+    SentPacket& sent = conn.sent[seq % SENT_PACKETS_BUFFER_SIZE];
+    if (!sent.valid || sent.seq != seq) return;
+
+    for (uint8_t i = 0; i < sent.num_reliable; ++i) {
+        ReliableMessage& msg = conn.send_queue[sent.reliable_ids[i] % RELIABLE_WINDOW];
+        if (msg.id == sent.reliable_ids[i]) {
+            msg.pending = false;
+        }
+    }
+    sent.valid = false;
+
+    while (conn.oldest_unacked_id != conn.next_send_id && !conn.send_queue[conn.oldest_unacked_id % RELIABLE_WINDOW].pending) {
+        ++conn.oldest_unacked_id;
+    }
+}
+
+// Returns false for packets that were already received or that are too old to be tracked
+static bool track_received(UdpConnection& conn, uint16_t seq) {
+    if (!conn.has_received) {
+        conn.has_received = true;
+        conn.remote_seq = seq;
+        conn.received_bits = 0;
+        return true;
+    }
+
+    if (seq_greater(seq, conn.remote_seq)) {
+        uint16_t shift = seq - conn.remote_seq;
+        if (shift > 32) {
+            conn.received_bits = 0;
+        } else if (shift == 32) {
+            conn.received_bits = 1u << 31;
+        } else {
+            conn.received_bits = (conn.received_bits << shift) | (1u << (shift - 1));
+        }
+        conn.remote_seq = seq;
+        return true;
+    }
+
+    uint16_t diff = conn.remote_seq - seq;
+    if (diff == 0 || diff > 32) return false;
+
+    uint32_t bit = 1u << (diff - 1);
+    if (conn.received_bits & bit) return false;
+    conn.received_bits |= bit;
+    return true;
+}
+
+size_t write_packet_prefix(UdpConnection& conn, char* buff, size_t buff_len) {
+    if (buff_len < PACKET_HEADER_SIZE + 1) return 0;
+
+    uint16_t seq = conn.local_seq++;
+    size_t offset = 0;
+
+    memcpy(buff + offset, &seq, sizeof seq);
+    offset += sizeof seq;
+    memcpy(buff + offset, &conn.remote_seq, sizeof conn.remote_seq);
+    offset += sizeof conn.remote_seq;
+    memcpy(buff + offset, &conn.received_bits, sizeof conn.received_bits);
+    offset += sizeof conn.received_bits;
+    buff[offset++] = conn.has_received ? 1 : 0;
+
+    SentPacket& sent = conn.sent[seq % SENT_PACKETS_BUFFER_SIZE];
+    sent = {
+        .valid = true,
+        .seq = seq,
+    };
+
+    size_t count_offset = offset++;
+    for (uint16_t id = conn.oldest_unacked_id; id != conn.next_send_id && sent.num_reliable < MAX_RELIABLE_PER_PACKET; ++id) {
+        const ReliableMessage& msg = conn.send_queue[id % RELIABLE_WINDOW];
+        if (!msg.pending) continue;
+        if (buff_len - offset < sizeof msg.id + sizeof msg.len + msg.len) break;
+
+        memcpy(buff + offset, &msg.id, sizeof msg.id);
+        offset += sizeof msg.id;
+        memcpy(buff + offset, &msg.len, sizeof msg.len);
+        offset += sizeof msg.len;
+        memcpy(buff + offset, msg.data, msg.len);
+        offset += msg.len;
+
+        sent.reliable_ids[sent.num_reliable++] = msg.id;
+    }
+    buff[count_offset] = (char)sent.num_reliable;
+
+    return offset;
+}
+
+size_t read_packet_prefix(UdpConnection& conn, const char* msg, size_t msg_len, uint16_t& seq) {
+    if (msg_len < PACKET_HEADER_SIZE + 1) return 0;
+
+    PacketHeader header;
+    size_t offset = 0;
+    memcpy(&header.seq, msg + offset, sizeof header.seq);
+    offset += sizeof header.seq;
+    memcpy(&header.ack, msg + offset, sizeof header.ack);
+    offset += sizeof header.ack;
+    memcpy(&header.ack_bits, msg + offset, sizeof header.ack_bits);
+    offset += sizeof header.ack_bits;
+    header.has_ack = msg[offset++] != 0;
+
+    if (!track_received(conn, header.seq)) return 0;
+    seq = header.seq;
+
+    if (header.has_ack) {
+        ack_packet(conn, header.ack);
+        for (uint16_t i = 0; i < 32; ++i) {
+            if (header.ack_bits & (1u << i)) {
+                ack_packet(conn, header.ack - 1 - i);
+            }
+        }
+    }
+
+    uint8_t num_reliable = (uint8_t)msg[offset++];
+    for (uint8_t i = 0; i < num_reliable; ++i) {
+        uint16_t id, len;
+        if (msg_len - offset < sizeof id + sizeof len) return 0;
+        memcpy(&id, msg + offset, sizeof id);
+        offset += sizeof id;
+        memcpy(&len, msg + offset, sizeof len);
+        offset += sizeof len;
+        if (len > MAX_RELIABLE_MSG_SIZE || msg_len - offset < len) return 0;
+
+        // Already delivered or too far ahead of what we can buffer
+        bool in_window = !seq_greater(conn.next_recv_id, id) && (uint16_t)(id - conn.next_recv_id) < RELIABLE_WINDOW;
+        ReliableMessage& slot = conn.recv_queue[id % RELIABLE_WINDOW];
+        if (in_window && !slot.pending) {
+            slot.pending = true;
+            slot.id = id;
+            slot.len = len;
+            memcpy(slot.data, msg + offset, len);
+        }
+        offset += len;
+    }
+
+    return offset;
+}
+
+bool queue_reliable(UdpConnection& conn, const void* data, uint16_t len) {
+    if (len > MAX_RELIABLE_MSG_SIZE) return false;
+    if ((uint16_t)(conn.next_send_id - conn.oldest_unacked_id) >= RELIABLE_WINDOW) return false;
+
+    ReliableMessage& msg = conn.send_queue[conn.next_send_id % RELIABLE_WINDOW];
+    msg.pending = true;
+    msg.id = conn.next_send_id++;
+    msg.len = len;
+    memcpy(msg.data, data, len);
+
+    return true;
+}
+
+const ReliableMessage* pop_reliable(UdpConnection& conn) {
+    ReliableMessage& slot = conn.recv_queue[conn.next_recv_id % RELIABLE_WINDOW];
+    if (!slot.pending || slot.id != conn.next_recv_id) return nullptr;
+
+    slot.pending = false;
+    ++conn.next_recv_id;
+    return &slot;
+}
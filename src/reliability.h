@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Lightweight reliability layer for the UDP transport.
+ * Every packet carries a sequence number plus an ack of the latest packet received from the peer
+ * and a bitfield acking the 32 packets before it. Unreliable data (snapshots) relies on that alone,
+ * reliable-ordered messages are resent in every outgoing packet until a packet carrying them is acked
+ * and are delivered to the receiver in order.
+ */
+
+const size_t SENT_PACKETS_BUFFER_SIZE = 64;
+const size_t RELIABLE_WINDOW = 32;
+const size_t MAX_RELIABLE_MSG_SIZE = 64;
+const size_t MAX_RELIABLE_PER_PACKET = 8;
+
+struct PacketHeader {
+    uint16_t seq = 0;
+    uint16_t ack = 0;
+    uint32_t ack_bits = 0;
+    // false until the sender received anything from us, ack fields are meaningless then
+    bool has_ack = false;
+};
+
+const size_t PACKET_HEADER_SIZE = sizeof(uint16_t) * 2 + sizeof(uint32_t) + sizeof(uint8_t);
+
+struct SentPacket {
+    bool valid = false;
+    uint16_t seq = 0;
+    uint8_t num_reliable = 0;
+    uint16_t reliable_ids[MAX_RELIABLE_PER_PACKET] = {};
+};
+
+struct ReliableMessage {
+    bool pending = false;
+    uint16_t id = 0;
+    uint16_t len = 0;
+    char data[MAX_RELIABLE_MSG_SIZE] = {};
+};
+
+struct UdpConnection {
+    uint16_t local_seq = 0;
+
+    bool has_received = false;
+    uint16_t remote_seq = 0;
+    uint32_t received_bits = 0;
+
+    SentPacket sent[SENT_PACKETS_BUFFER_SIZE];
+
+    uint16_t next_send_id = 0;
+    uint16_t oldest_unacked_id = 0;
+    ReliableMessage send_queue[RELIABLE_WINDOW];
+
+    uint16_t next_recv_id = 0;
+    ReliableMessage recv_queue[RELIABLE_WINDOW];
+};
+
+/*
+ * True if sequence number a is more recent than b, accounting for wrap around
+ */
+bool seq_greater(uint16_t a, uint16_t b);
+
+/*
+ * Writes a packet header with the next sequence number followed by every unacked reliable message.
+ * Returns the number of bytes written, unreliable data can be appended right after.
+ */
+size_t write_packet_prefix(UdpConnection& conn, char* buff, size_t buff_len);
+
+/*
+ * Reads the header and reliable messages of a received packet, processing its acks.
+ * Returns the offset of the unreliable data or 0 if the packet is a duplicate, too old or malformed.
+ * `seq` receives the packet sequence number.
+ */
+size_t read_packet_prefix(UdpConnection& conn, const char* msg, size_t msg_len, uint16_t& seq);
+
+/*
+ * Queues a reliable-ordered message, returns false if the window is full
+ */
+bool queue_reliable(UdpConnection& conn, const void* data, uint16_t len);
+
+/*
+ * Returns the next in-order reliable message or nullptr, the message stays valid until the next packet is read
+ */
+const ReliableMessage* pop_reliable(UdpConnection& conn);
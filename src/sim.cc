@@ -0,0 +1,1033 @@
+#include "sim.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "net.h"
+#include "raymath.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <print>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "spsc_ring.h"
+#include "trace.h"
+
+using namespace std;
+
+// 30 snapshots per second
+const uint64_t SNAPSHOT_INTERVAL_TICKS = 2;
+const float PLAYER_TURN_STEP = 3.f * CF_UPDATE_RATE;
+const float PLAYER_MOVE_STEP = 200.f * CF_UPDATE_RATE;
+const float ENTITY_MOVE_STEP = 200.f * CF_UPDATE_RATE;
+// Lifetimes are checked about once a second, entities may outlive theirs by that much
+const uint64_t DESPAWN_CHECK_INTERVAL_TICKS = 60;
+// Slots per job, stores below that are updated inline on the game thread
+const uint32_t ENTITY_JOB_GRAIN = 16384;
+// Headroom so the net thread can keep pushing while the game thread is busy, the excess is dropped on the game thread
+const size_t STATE_RING_CAPACITY = 8;
+// Ids leased to each client, topped up once it's down to SPAWN_LEASE_REFILL_BELOW. A few seconds of spawning at
+// human speed, the refill comes back well before they run out.
+const size_t SPAWN_LEASE_BLOCK = 8;
+const size_t SPAWN_LEASE_REFILL_BELOW = 4;
+// Leases never take the last 1/SPAWN_LEASE_RESERVE_FRACTION of the free slots, spawns without one get those
+const uint32_t SPAWN_LEASE_RESERVE_FRACTION = 4;
+// Client side: spawns waiting for an ack, more than that in flight and the oldest ones can't be remapped anymore
+const size_t MAX_UNACKED_SPAWNS = 256;
+// Client side: own entities predicted at once, past that the oldest one is left to snapshot interpolation
+const uint32_t MAX_PREDICTED_ENTITIES = 64;
+const uint64_t PREDICTION_HISTORY_FRAMES = 64;
+// A snapshot older than that is ignored rather than replayed, a newer one follows anyway
+const uint64_t MAX_REPLAY_FRAMES = 30;
+// Share of the remaining correction blended out every tick, further than the snap distance it isn't blended at all
+const float PREDICTION_BLEND = 0.2f;
+const float PREDICTION_SNAP_DISTANCE = 64.f;
+// Lockstep: frames between checksums, and how many host checksums are kept to compare with the clients' reports
+const uint64_t LOCKSTEP_CHECKSUM_INTERVAL = 60;
+const size_t LOCKSTEP_CHECKSUM_HISTORY = 64;
+// Lockstep, client side: further behind the newest frame received than that, the client catches up at once instead of
+// at the tick rate. At most that many ticks per call, joining a long session takes a few frames.
+const uint64_t LOCKSTEP_MAX_LAG_FRAMES = 6;
+const uint32_t LOCKSTEP_MAX_CATCHUP_TICKS = 6000;
+
+uint64_t command_frame = 0;
+
+Player player;
+Player prev_player;
+EntityStore entities;
+
+// Host side: command frame each entity was spawned at, for lifetimes. 0 ticks means entities live forever.
+static unique_ptr<uint64_t[]> spawned_at;
+static uint64_t entity_lifetime_ticks = 0;
+
+// Host side: how far back client events are evaluated
+static uint64_t max_rewind_ticks = (uint64_t)lroundf(DEFAULT_MAX_REWIND_MS / 1000.f / CF_UPDATE_RATE);
+
+// Host side: bytes a snapshot may take and the slot the next one starts from, see try_send_network_packets
+static size_t snapshot_size_limit = MAX_GAME_STATE_SIZE;
+static uint32_t snapshot_first_slot = 0;
+
+/*
+ * The host owns every id. Each client holds a few leased ids (popped off the free list, still EntityState::No) it
+ * spawns with right away, the host checks the lease and acks with the id it used at its next tick.
+ * Spawns without a valid lease still go through, with an id the host picks.
+ */
+enum class ClientEventType {Connected, Disconnected, Spawn, LockstepChecksum};
+
+struct ClientEvent {
+    ClientEventType type;
+    uint32_t client_id = 0;
+    SpawnEntityPayload spawn;
+    LockstepChecksumPayload checksum;
+};
+
+struct ClientSpawns {
+    vector<uint32_t> leases;
+    // Batches to send at the end of the tick, the last one is still being filled
+    vector<SpawnAcksPayload> acks;
+};
+
+struct UnackedSpawn {
+    uint32_t local_id = 0;
+    // Id the ghost is at, ENTITY_NO_ID once acked
+    uint32_t id = ENTITY_NO_ID;
+};
+
+// Net thread to game thread, both sides (host: client events, client: acks) go through the same lock
+static mutex spawn_events_mtx;
+static vector<ClientEvent> client_events;
+static vector<SpawnAcksPayload> received_spawn_acks;
+
+// Host side, game thread
+static unordered_map<uint32_t, ClientSpawns> client_spawns;
+static vector<ClientEvent> processed_events;
+static vector<ClientSpawnAcks> outgoing_spawn_acks;
+
+/*
+ * Lockstep: no snapshots, the host sends every frame's spawns (see LockstepFramePayload) and host and clients all run
+ * lockstep_step on them in fixed point, so they end up with the same world. Checksums every LOCKSTEP_CHECKSUM_INTERVAL
+ * frames tell a desync apart.
+ */
+static bool lockstep = false;
+// Host side: accepted spawns that didn't fit a frame yet, and the host's own checksums
+static deque<LockstepSpawn> pending_lockstep_spawns;
+static LockstepChecksumPayload lockstep_checksums[LOCKSTEP_CHECKSUM_HISTORY];
+// Client side: frames from the net thread (under spawn_events_mtx), frames waiting for their tick and the newest frame
+// the host closed, the client can't tick past it
+static vector<LockstepFramePayload> received_lockstep_frames;
+static vector<LockstepFramePayload> processed_lockstep_frames;
+static deque<LockstepFramePayload> lockstep_frames;
+static uint64_t lockstep_closed_frame = 0;
+
+/*
+ * Client side: the client's own entities stay Ghosts, simulated at the client's frame ahead of the interpolated snapshots.
+ * Their state after every tick is kept by command_frame, when a snapshot disagrees with what was predicted for its frame
+ * the entity is rewound to the host's state, replayed up to now and the jump is blended out when drawing.
+ */
+struct PredictedEntity {
+    uint32_t id = ENTITY_NO_ID;
+    uint64_t spawn_frame = 0;
+    // Seen in a snapshot, the host despawning it is a despawn and not a lag
+    bool confirmed = false;
+    // What's left of the last correction, added when drawing
+    float error_x = 0.f;
+    float error_y = 0.f;
+};
+
+struct PredictionSample {
+    float x = 0.f;
+    float y = 0.f;
+    float dx = 0.f;
+    float dy = 0.f;
+};
+
+struct PredictionFrame {
+    uint64_t frame = UINT64_MAX;
+    // By index in predicted_entities[]
+    PredictionSample samples[MAX_PREDICTED_ENTITIES];
+};
+
+// Client side, game thread
+static PredictedEntity predicted_entities[MAX_PREDICTED_ENTITIES];
+static PredictionFrame prediction_history[PREDICTION_HISTORY_FRAMES];
+static vector<uint32_t> spawn_leases;
+static vector<SpawnAcksPayload> processed_spawn_acks;
+static UnackedSpawn unacked_spawns[MAX_UNACKED_SPAWNS];
+static uint32_t next_local_spawn_id = 0;
+
+struct ReceivedState {
+    GameStatePayload state;
+    double received_at = 0.0;
+};
+
+// Filled by the net thread, drained into the jitter buffer by the game thread
+SpscRing<ReceivedState, STATE_RING_CAPACITY> received_states;
+
+JitterBuffer jitter_buffer;
+
+// Simulation randomness, kept away from raylib so the simulation doesn't need it
+static mt19937 sim_rng;
+
+double now_seconds() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void apply_host_input(const HostInput& input) {
+    if (input.turn_right) {
+        player.angle += PLAYER_TURN_STEP;
+        while (player.angle > 6.28f) {
+            player.angle = 0.f + (player.angle - 6.28f);
+        }
+    } else if (input.turn_left) {
+        player.angle -= PLAYER_TURN_STEP;
+        while (player.angle < 0.f) {
+            player.angle += 6.28f;
+        }
+    }
+
+    if (input.forward) {
+        Vector2 direction = {-sinf(player.angle), cosf(player.angle)};
+
+        player.position.x += direction.x * PLAYER_MOVE_STEP;
+        player.position.y += direction.y * PLAYER_MOVE_STEP;
+
+        if (player.position.x > WIN_WIDTH) {
+            player.position.x = WIN_WIDTH;
+        } else if (player.position.x < 0) {
+            player.position.x = 0;
+        }
+
+        if (player.position.y > WIN_HEIGHT) {
+            player.position.y = WIN_HEIGHT;
+        } else if (player.position.y < 0) {
+            player.position.y = 0;
+        }
+    }
+}
+
+static int find_prediction(uint32_t id) {
+    for (uint32_t i = 0; i < MAX_PREDICTED_ENTITIES; ++i) {
+        if (predicted_entities[i].id == id) return (int)i;
+    }
+    return -1;
+}
+
+static void start_prediction(uint32_t id) {
+    int free_idx = find_prediction(ENTITY_NO_ID);
+    if (free_idx < 0) {
+        // Handed over to the snapshots, it pops once
+        free_idx = 0;
+        for (uint32_t i = 1; i < MAX_PREDICTED_ENTITIES; ++i) {
+            if (predicted_entities[i].spawn_frame < predicted_entities[free_idx].spawn_frame) free_idx = (int)i;
+        }
+        uint32_t slot = entity_slot(entities, predicted_entities[free_idx].id);
+        if (slot != ENTITY_NO_SLOT) entities.state[slot] = EntityState::ServerHandled;
+    }
+    predicted_entities[free_idx] = {.id = id, .spawn_frame = command_frame};
+}
+
+Vector2 prediction_error(uint32_t id) {
+    int idx = find_prediction(id);
+    if (idx < 0) return {0.f, 0.f};
+    return {predicted_entities[idx].error_x, predicted_entities[idx].error_y};
+}
+
+// Client side: keeps this tick's predictions and blends corrections out, drops entities that aren't Ghosts anymore
+static void record_predictions() {
+    PredictionFrame& history = prediction_history[command_frame % PREDICTION_HISTORY_FRAMES];
+    history.frame = command_frame;
+
+    for (uint32_t i = 0; i < MAX_PREDICTED_ENTITIES; ++i) {
+        PredictedEntity& predicted = predicted_entities[i];
+        if (predicted.id == ENTITY_NO_ID) continue;
+
+        uint32_t slot = entity_slot(entities, predicted.id);
+        if (slot == ENTITY_NO_SLOT || entities.state[slot] != EntityState::Ghost) {
+            predicted = {};
+            continue;
+        }
+
+        history.samples[i] = {
+            .x = entities.x[slot],
+            .y = entities.y[slot],
+            .dx = entities.dx[slot],
+            .dy = entities.dy[slot],
+        };
+        predicted.error_x *= 1.f - PREDICTION_BLEND;
+        predicted.error_y *= 1.f - PREDICTION_BLEND;
+    }
+}
+
+// Client side: checks the predictions against a snapshot as soon as it arrives, before it waits in the jitter buffer
+static void reconcile_predictions(const GameStatePayload& state) {
+    uint64_t frame = state.server_command_frame;
+    if (frame > command_frame || command_frame - frame > MAX_REPLAY_FRAMES) return;
+    const PredictionFrame& history = prediction_history[frame % PREDICTION_HISTORY_FRAMES];
+    if (history.frame != frame) return;
+
+    for (uint32_t i = 0; i < MAX_PREDICTED_ENTITIES; ++i) {
+        PredictedEntity& predicted = predicted_entities[i];
+        if (predicted.id == ENTITY_NO_ID || predicted.spawn_frame >= frame) continue;
+
+        const EntityPayload* begin = state.entities.get();
+        const EntityPayload* end = begin + state.num_entities;
+        const EntityPayload* received = lower_bound(begin, end, predicted.id, [](const EntityPayload& e, uint32_t id) {
+            return e.id < id;
+        });
+        if (received == end || received->id != predicted.id) continue;
+        predicted.confirmed = true;
+
+        // Snapshot positions are rounded, that much is no misprediction
+        const PredictionSample& sample = history.samples[i];
+        if (fabsf(received->pos.x - sample.x) <= POS_STEP && fabsf(received->pos.y - sample.y) <= POS_STEP) continue;
+
+        uint32_t slot = entity_slot(entities, predicted.id);
+        if (slot == ENTITY_NO_SLOT) continue;
+        float old_x = entities.x[slot];
+        float old_y = entities.y[slot];
+
+        // Snapshots don't carry directions, the predicted one is the best guess
+        entities.x[slot] = received->pos.x;
+        entities.y[slot] = received->pos.y;
+        entities.dx[slot] = sample.dx;
+        entities.dy[slot] = sample.dy;
+        for (uint64_t f = frame + 1; f <= command_frame; ++f) {
+            entity_update_slot(entities, slot, ENTITY_MOVE_STEP, WIN_WIDTH, WIN_HEIGHT);
+            PredictionFrame& replayed = prediction_history[f % PREDICTION_HISTORY_FRAMES];
+            if (replayed.frame == f) {
+                replayed.samples[i] = {.x = entities.x[slot], .y = entities.y[slot], .dx = entities.dx[slot], .dy = entities.dy[slot]};
+            }
+        }
+
+        // Drawn where it was, the error fades over the next ticks
+        float jump_x = entities.x[slot] - old_x;
+        float jump_y = entities.y[slot] - old_y;
+        entities.prev_x[slot] += jump_x;
+        entities.prev_y[slot] += jump_y;
+        predicted.error_x -= jump_x;
+        predicted.error_y -= jump_y;
+        if (predicted.error_x * predicted.error_x + predicted.error_y * predicted.error_y > PREDICTION_SNAP_DISTANCE * PREDICTION_SNAP_DISTANCE) {
+            predicted.error_x = predicted.error_y = 0.f;
+        }
+        metrics_add(Counter::PredictionCorrections);
+    }
+}
+
+bool spawn_ghost_entity(Vector2 pos, Vector2 dir) {
+    // Lockstep: nothing to predict, the entity shows up once the host puts it in a frame
+    if (lockstep) {
+        uint32_t leased_id = ENTITY_NO_ID;
+        if (!spawn_leases.empty()) {
+            leased_id = spawn_leases.back();
+            spawn_leases.pop_back();
+        }
+        metrics_add(Counter::Spawns);
+        send_network_message({
+            .command_frame = command_frame,
+            .local_id = next_local_spawn_id++,
+            .id = leased_id,
+            .pos = pos,
+            .dir = dir,
+        });
+        return true;
+    }
+
+    // A leased slot is the one the host will use, otherwise the ghost waits in any free slot until the host says where it goes
+    uint32_t leased_id = ENTITY_NO_ID;
+    uint32_t slot = ENTITY_NO_SLOT;
+    if (!spawn_leases.empty()) {
+        leased_id = spawn_leases.back();
+        spawn_leases.pop_back();
+        slot = entity_claim(entities, leased_id);
+    }
+    if (slot == ENTITY_NO_SLOT) {
+        uint32_t id = entity_alloc(entities);
+        if (id == ENTITY_NO_ID) return false;
+        slot = entity_id_slot(id);
+    }
+
+    entities.state[slot] = EntityState::Ghost;
+    entities.x[slot] = pos.x;
+    entities.y[slot] = pos.y;
+    entities.dx[slot] = dir.x;
+    entities.dy[slot] = dir.y;
+
+    start_prediction(entities.id[slot]);
+
+    uint32_t local_id = next_local_spawn_id++;
+    unacked_spawns[local_id % MAX_UNACKED_SPAWNS] = {
+        .local_id = local_id,
+        .id = entities.id[slot],
+    };
+
+    metrics_add(Counter::Spawns);
+    send_network_message({
+        .command_frame = command_frame,
+        .local_id = local_id,
+        .id = leased_id,
+        .pos = pos,
+        .dir = dir,
+    });
+    return true;
+}
+
+// Client side: the host used `id` for the spawn, moves the ghost there if it isn't already
+static void on_spawn_acked(uint32_t local_id, uint32_t id) {
+    UnackedSpawn& unacked = unacked_spawns[local_id % MAX_UNACKED_SPAWNS];
+    if (unacked.local_id != local_id || unacked.id == ENTITY_NO_ID) return;
+
+    uint32_t ghost_id = unacked.id;
+    unacked.id = ENTITY_NO_ID;
+    if (id == ghost_id) return;
+
+    // Gone already if a snapshot took the slot over
+    uint32_t from = entity_slot(entities, ghost_id);
+    if (from == ENTITY_NO_SLOT || entities.state[from] != EntityState::Ghost) return;
+
+    uint32_t to = id != ENTITY_NO_ID ? entity_claim(entities, id) : ENTITY_NO_SLOT;
+    if (to != ENTITY_NO_SLOT && to != from && entities.state[to] != EntityState::ServerHandled) {
+        entities.state[to] = EntityState::Ghost;
+        entities.x[to] = entities.x[from];
+        entities.y[to] = entities.y[from];
+        entities.prev_x[to] = entities.prev_x[from];
+        entities.prev_y[to] = entities.prev_y[from];
+        entities.dx[to] = entities.dx[from];
+        entities.dy[to] = entities.dy[from];
+    }
+    // No-op when the host kept the slot under another generation, the claim above renamed the ghost
+    entity_free(entities, ghost_id);
+
+    int predicted = find_prediction(ghost_id);
+    if (predicted >= 0) {
+        predicted_entities[predicted].id = to != ENTITY_NO_SLOT && entities.state[to] == EntityState::Ghost ? id : ENTITY_NO_ID;
+    }
+}
+
+void on_spawn_acks_received(const SpawnAcksPayload& p) {
+    lock_guard<mutex> lock(spawn_events_mtx);
+    received_spawn_acks.push_back(p);
+}
+
+// Client side: acks and leases the net thread received since the last frame
+static void process_spawn_acks() {
+    {
+        lock_guard<mutex> lock(spawn_events_mtx);
+        swap(processed_spawn_acks, received_spawn_acks);
+    }
+
+    for (const SpawnAcksPayload& acks : processed_spawn_acks) {
+        for (uint8_t i = 0; i < acks.num_acks; ++i) {
+            on_spawn_acked(acks.first_local_id + i, acks.ids[i]);
+        }
+        for (uint8_t i = 0; i < acks.num_leases; ++i) {
+            spawn_leases.push_back(acks.ids[acks.num_acks + i]);
+        }
+    }
+    processed_spawn_acks.clear();
+}
+
+void try_send_network_packets() {
+    if (command_frame % SNAPSHOT_INTERVAL_TICKS == 0) {
+        TRACE_SCOPE("build_snapshot");
+        // Pooled buffer with room for every slot, handed back to the pool once the net thread is done with the snapshot
+        EntityBuffer active_entities = acquire_entity_buffer();
+
+        // Entities are taken from snapshot_first_slot on, wrapping around to the first slots. When they don't all fit
+        // the snapshot only covers the slots up to the first one left out, and the next one starts from there: every
+        // entity gets through in turn and clients keep the others where they last saw them.
+        uint32_t num_written = 0;
+        uint32_t max_written = entity_buffer_capacity();
+        uint32_t first_slot = snapshot_first_slot < entities.capacity ? snapshot_first_slot : 0;
+        uint32_t end_slot = first_slot;
+        bool capped = false;
+        for (uint32_t n = 0; n < entities.capacity; ++n) {
+            uint32_t i = first_slot + n < entities.capacity ? first_slot + n : first_slot + n - entities.capacity;
+            if (entities.state[i] != EntityState::ServerHandled) continue;
+            if (num_written == max_written) {
+                capped = true;
+                end_slot = i;
+                break;
+            }
+            active_entities[num_written].id = entities.id[i];
+            active_entities[num_written].pos = {entities.x[i], entities.y[i]};
+            ++num_written;
+        }
+
+        uint32_t num_fitting = game_state_entities_fitting(active_entities.get(), num_written, snapshot_size_limit);
+        if (num_fitting < num_written) {
+            capped = true;
+            end_slot = entity_id_slot(active_entities[num_fitting].id);
+            num_written = num_fitting;
+        }
+        if (capped) {
+            snapshot_first_slot = end_slot;
+            metrics_add(Counter::SnapshotsCapped);
+        } else {
+            first_slot = end_slot = 0;
+        }
+
+        // Back in slot order so the payload is sorted by id, delta encoding relies on it
+        EntityPayload* written = active_entities.get();
+        EntityPayload* wrapped = find_if(written, written + num_written, [first_slot](const EntityPayload& e) {
+            return entity_id_slot(e.id) < first_slot;
+        });
+        rotate(written, wrapped, written + num_written);
+
+        GameStatePayload game_state = {
+            .server_command_frame = command_frame,
+            .player_pos = {player.position.x, player.position.y},
+            .player_angle = player.angle,
+            .first_slot = first_slot,
+            .end_slot = end_slot,
+            .num_entities = num_written,
+            .entities = std::move(active_entities),
+        };
+
+        dispatch_game_state(std::move(game_state));
+    }
+}
+
+// Shortest way around, angles are kept in [0, 2pi[ by the host
+float lerp_angle(float from, float to, float t) {
+    float diff = fmodf(to - from, 2.f * PI);
+    if (diff > PI) diff -= 2.f * PI;
+    if (diff < -PI) diff += 2.f * PI;
+    return from + diff * t;
+}
+
+void interp_game_states(const GameStatePayload& from, const GameStatePayload& to, float t) {
+    TRACE_SCOPE("interp_game_states");
+    player.position.x = Lerp(from.player_pos[0], to.player_pos[0], t);
+    player.position.y = Lerp(from.player_pos[1], to.player_pos[1], t);
+    player.angle = lerp_angle(from.player_angle, to.player_angle, t);
+    prev_player = player;
+
+    // Both lists are sorted by id, entities that just appeared in `to` snap to their position
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < to.num_entities; ++i) {
+        const EntityPayload& target = to.entities[i];
+        while (k < from.num_entities && from.entities[k].id < target.id) ++k;
+
+        Vector2 pos = target.pos;
+        if (k < from.num_entities && from.entities[k].id == target.id) {
+            pos = Vector2Lerp(from.entities[k].pos, target.pos, t);
+        }
+
+        // A Ghost under the same id is one of ours, reconcile_predictions took care of it
+        uint32_t slot = entity_slot(entities, target.id);
+        if (slot != ENTITY_NO_SLOT && entities.state[slot] == EntityState::Ghost) continue;
+
+        // The host's ids win, over a ghost that was in that slot or an older generation
+        slot = entity_claim(entities, target.id);
+        if (slot == ENTITY_NO_SLOT) continue;
+
+        entities.x[slot] = entities.prev_x[slot] = pos.x;
+        entities.y[slot] = entities.prev_y[slot] = pos.y;
+        entities.state[slot] = EntityState::ServerHandled;
+    }
+
+    // What `from` has and `to` doesn't was despawned if `to` covers its slot, a stale id (already freed or reused) is
+    // just skipped
+    uint32_t j = 0;
+    for (uint32_t i = 0; i < from.num_entities; ++i) {
+        uint32_t id = from.entities[i].id;
+        while (j < to.num_entities && to.entities[j].id < id) ++j;
+        if (j < to.num_entities && to.entities[j].id == id) continue;
+        if (!game_state_covers(to, entity_id_slot(id))) continue;
+        entity_free(entities, id);
+    }
+}
+
+void apply_game_state(const GameStatePayload& s) {
+    TRACE_SCOPE("apply_game_state");
+    command_frame = s.server_command_frame;
+
+    player.position = {s.player_pos[0], s.player_pos[1]};
+    player.angle = s.player_angle;
+    prev_player = player;
+
+    for (uint32_t i = 0; i < s.num_entities; ++i) {
+        EntityPayload& received_entity = s.entities[i];
+        uint32_t slot = entity_slot(entities, received_entity.id);
+        if (slot != ENTITY_NO_SLOT && entities.state[slot] == EntityState::Ghost) continue;
+
+        slot = entity_claim(entities, received_entity.id);
+        if (slot == ENTITY_NO_SLOT) continue;
+
+        entities.state[slot] = EntityState::ServerHandled;
+        entities.x[slot] = entities.prev_x[slot] = received_entity.pos.x;
+        entities.y[slot] = entities.prev_y[slot] = received_entity.pos.y;
+    }
+
+    // No previous state to compare with here, host entities missing from the slots the snapshot covers were despawned
+    uint32_t k = 0;
+    for (uint32_t slot = 0; slot < entities.capacity; ++slot) {
+        if (entities.state[slot] == EntityState::No || !game_state_covers(s, slot)) continue;
+        if (entities.state[slot] == EntityState::Ghost) {
+            int predicted = find_prediction(entities.id[slot]);
+            if (predicted < 0 || !predicted_entities[predicted].confirmed) continue;
+        }
+        while (k < s.num_entities && entity_id_slot(s.entities[k].id) < slot) ++k;
+        if (k < s.num_entities && s.entities[k].id == entities.id[slot]) continue;
+        entity_free(entities, entities.id[slot]);
+    }
+}
+
+// Moves the entities passing `filter` one tick, spread over the job system for big stores
+static void update_entities(EntityFilter filter) {
+    parallel_for(0, entities.padded, ENTITY_JOB_GRAIN, [filter](uint32_t begin, uint32_t end) {
+        entity_store_update_range(entities, begin, end, filter, ENTITY_MOVE_STEP, WIN_WIDTH, WIN_HEIGHT);
+    });
+}
+
+void on_state_received(GameStatePayload &&s) {
+    TRACE_SCOPE("on_state_received");
+    ReceivedState* slot = received_states.begin_push();
+
+    // Only happens if the game thread stalls for a while, it catches up on the newest states anyway
+    if (slot == nullptr) {
+        metrics_add(Counter::SnapshotsDropped);
+        return;
+    }
+
+    slot->state = std::move(s);
+    slot->received_at = now_seconds();
+    received_states.commit_push();
+}
+
+void on_client_connected(uint32_t client_id) {
+    lock_guard<mutex> lock(spawn_events_mtx);
+    client_events.push_back({.type = ClientEventType::Connected, .client_id = client_id, .spawn = {}, .checksum = {}});
+}
+
+void on_client_disconnected(uint32_t client_id) {
+    lock_guard<mutex> lock(spawn_events_mtx);
+    client_events.push_back({.type = ClientEventType::Disconnected, .client_id = client_id, .spawn = {}, .checksum = {}});
+}
+
+void on_entity_spawned(uint32_t client_id, const SpawnEntityPayload& p) {
+    lock_guard<mutex> lock(spawn_events_mtx);
+    client_events.push_back({.type = ClientEventType::Spawn, .client_id = client_id, .spawn = p, .checksum = {}});
+}
+
+void on_lockstep_checksum_received(uint32_t client_id, const LockstepChecksumPayload& p) {
+    lock_guard<mutex> lock(spawn_events_mtx);
+    client_events.push_back({.type = ClientEventType::LockstepChecksum, .client_id = client_id, .spawn = {}, .checksum = p});
+}
+
+void on_lockstep_frame_received(const LockstepFramePayload& p) {
+    lock_guard<mutex> lock(spawn_events_mtx);
+    received_lockstep_frames.push_back(p);
+}
+
+// Host side: appends to the client's current batch, acks have to stay consecutive and come before any lease
+static void add_spawn_ack(ClientSpawns& client, uint32_t local_id, uint32_t id) {
+    SpawnAcksPayload* acks = client.acks.empty() ? nullptr : &client.acks.back();
+    if (!acks || acks->num_leases > 0 || acks->num_acks == MAX_SPAWN_ACK_IDS || acks->first_local_id + acks->num_acks != local_id) {
+        acks = &client.acks.emplace_back();
+        acks->first_local_id = local_id;
+    }
+    acks->ids[acks->num_acks++] = id;
+}
+
+static void add_spawn_lease(ClientSpawns& client, uint32_t id) {
+    SpawnAcksPayload* acks = client.acks.empty() ? nullptr : &client.acks.back();
+    if (!acks || acks->num_acks + acks->num_leases == MAX_SPAWN_ACK_IDS) {
+        acks = &client.acks.emplace_back();
+    }
+    acks->ids[acks->num_acks + acks->num_leases++] = id;
+}
+
+static void spawn_entity(uint32_t slot, const SpawnEntityPayload& p) {
+    TRACE_SCOPE("spawn_entity");
+    entities.state[slot] = EntityState::ServerHandled;
+    entities.x[slot] = p.pos.x;
+    entities.y[slot] = p.pos.y;
+    entities.dx[slot] = p.dir.x;
+    entities.dy[slot] = p.dir.y;
+
+    // The spawn happened at the client's frame: replayed from there tick by tick so it ends up where the client's ghost is,
+    // bounces included
+    uint64_t frame = clamp(p.command_frame, command_frame - min(command_frame, max_rewind_ticks), command_frame);
+    for (uint64_t f = frame; f < command_frame; ++f) {
+        entity_update_slot(entities, slot, ENTITY_MOVE_STEP, WIN_WIDTH, WIN_HEIGHT);
+    }
+    entities.prev_x[slot] = entities.x[slot];
+    entities.prev_y[slot] = entities.y[slot];
+    // Lifetimes count from the client's frame too
+    spawned_at[slot] = frame;
+    metrics_add(Counter::Spawns);
+}
+
+static int32_t to_fixed(float value) {
+    return (int32_t)lroundf(value * ENTITY_FIXED_ONE);
+}
+
+// Lockstep, host side: the only place floats turn into fixed point, every peer then applies the exact same values.
+// No lag compensation, the spawn starts where it was clicked at the frame it gets into.
+static void queue_lockstep_spawn(uint32_t id, const SpawnEntityPayload& p) {
+    pending_lockstep_spawns.push_back({
+        .id = id,
+        .x = to_fixed(clamp(p.pos.x, 0.f, (float)WIN_WIDTH)),
+        .y = to_fixed(clamp(p.pos.y, 0.f, (float)WIN_HEIGHT)),
+        .vx = (int16_t)clamp(to_fixed(p.dir.x * ENTITY_MOVE_STEP), (int32_t)INT16_MIN, (int32_t)INT16_MAX),
+        .vy = (int16_t)clamp(to_fixed(p.dir.y * ENTITY_MOVE_STEP), (int32_t)INT16_MIN, (int32_t)INT16_MAX),
+    });
+    metrics_add(Counter::Spawns);
+}
+
+static void on_client_spawn(ClientSpawns& client, const SpawnEntityPayload& p) {
+    uint32_t id = ENTITY_NO_ID;
+    auto lease = find(client.leases.begin(), client.leases.end(), p.id);
+    if (lease != client.leases.end()) {
+        id = p.id;
+        *lease = client.leases.back();
+        client.leases.pop_back();
+    } else {
+        // No lease left or a bogus one, the ghost moves to wherever this lands
+        id = entity_alloc(entities);
+        metrics_add(id == ENTITY_NO_ID ? Counter::SpawnsRejected : Counter::SpawnsRemapped);
+    }
+
+    if (id != ENTITY_NO_ID && lockstep) {
+        queue_lockstep_spawn(id, p);
+    } else if (id != ENTITY_NO_ID) {
+        spawn_entity(entity_id_slot(id), p);
+    }
+    add_spawn_ack(client, p.local_id, id);
+}
+
+// Host side: reports about frames older than LOCKSTEP_CHECKSUM_HISTORY checksums can't be checked anymore
+static void check_lockstep_checksum(uint32_t client_id, const LockstepChecksumPayload& reported) {
+    const LockstepChecksumPayload& own = lockstep_checksums[reported.frame / LOCKSTEP_CHECKSUM_INTERVAL % LOCKSTEP_CHECKSUM_HISTORY];
+    if (own.frame != reported.frame || own.checksum == reported.checksum) return;
+
+    metrics_add(Counter::LockstepDesyncs);
+    println("Client {} desynced at frame {}", client_id, reported.frame);
+}
+
+// Host side: what the net thread received since the last tick, in the order it came in
+static void process_client_events() {
+    {
+        lock_guard<mutex> lock(spawn_events_mtx);
+        swap(processed_events, client_events);
+    }
+    if (processed_events.empty()) return;
+    TRACE_SCOPE("process_client_events");
+
+    for (const ClientEvent& event : processed_events) {
+        if (event.type == ClientEventType::Connected) {
+            client_spawns[event.client_id] = {};
+            continue;
+        }
+
+        auto it = client_spawns.find(event.client_id);
+        if (it == client_spawns.end()) continue;
+
+        if (event.type == ClientEventType::Spawn) {
+            on_client_spawn(it->second, event.spawn);
+        } else if (event.type == ClientEventType::LockstepChecksum) {
+            check_lockstep_checksum(event.client_id, event.checksum);
+        } else {
+            // Unspent leases go back to the free list, under a new generation in case a spawn with them is still on its way
+            for (uint32_t id : it->second.leases) {
+                entity_free(entities, id);
+            }
+            client_spawns.erase(it);
+        }
+    }
+    processed_events.clear();
+}
+
+// Host side: tops up the clients running low on leases and sends everyone's acks of the tick
+static void flush_spawn_acks() {
+    for (auto& [client_id, client] : client_spawns) {
+        if (client.leases.size() < SPAWN_LEASE_REFILL_BELOW) {
+            while (client.leases.size() < SPAWN_LEASE_BLOCK && entities.num_free > entities.capacity / SPAWN_LEASE_RESERVE_FRACTION) {
+                uint32_t id = entity_alloc(entities);
+                if (id == ENTITY_NO_ID) break;
+                client.leases.push_back(id);
+                add_spawn_lease(client, id);
+            }
+        }
+
+        for (const SpawnAcksPayload& acks : client.acks) {
+            outgoing_spawn_acks.push_back({.client_id = client_id, .payload = acks});
+        }
+        client.acks.clear();
+    }
+
+    dispatch_spawn_acks(std::move(outgoing_spawn_acks));
+    outgoing_spawn_acks.clear();
+}
+
+void set_snapshot_size_limit(size_t max_size) {
+    snapshot_size_limit = max_size;
+}
+
+void set_max_rewind(float max_rewind_ms) {
+    max_rewind_ticks = max_rewind_ms > 0.f ? (uint64_t)lroundf(max_rewind_ms / 1000.f / CF_UPDATE_RATE) : 0;
+}
+
+void set_entity_lifetime(float seconds) {
+    entity_lifetime_ticks = seconds > 0.f ? (uint64_t)(seconds / CF_UPDATE_RATE) : 0;
+}
+
+// Host side: frees entities older than their lifetime, they disappear from the next snapshot
+static void despawn_expired_entities() {
+    if (entity_lifetime_ticks == 0 || command_frame % DESPAWN_CHECK_INTERVAL_TICKS != 0) return;
+
+    for (uint32_t slot = 0; slot < entities.capacity; ++slot) {
+        if (entities.state[slot] != EntityState::ServerHandled) continue;
+        if (command_frame - spawned_at[slot] < entity_lifetime_ticks) continue;
+
+        entity_free(entities, entities.id[slot]);
+        metrics_add(Counter::Despawns);
+    }
+}
+
+// Lockstep: floats are only written for drawing, the fixed point state is what gets simulated
+static void apply_lockstep_spawn(const LockstepSpawn& spawn) {
+    uint32_t slot = entity_claim(entities, spawn.id);
+    if (slot == ENTITY_NO_SLOT) return;
+
+    entities.state[slot] = EntityState::ServerHandled;
+    entities.fixed_x[slot] = spawn.x;
+    entities.fixed_y[slot] = spawn.y;
+    entities.fixed_vx[slot] = spawn.vx;
+    entities.fixed_vy[slot] = spawn.vy;
+    entities.x[slot] = entities.prev_x[slot] = (float)spawn.x / ENTITY_FIXED_ONE;
+    entities.y[slot] = entities.prev_y[slot] = (float)spawn.y / ENTITY_FIXED_ONE;
+    spawned_at[slot] = command_frame;
+}
+
+// Lockstep: one frame, the same on the host and every client given the same spawns
+static void lockstep_step(const LockstepFramePayload* frame) {
+    if (frame) {
+        for (uint8_t i = 0; i < frame->num_spawns; ++i) {
+            apply_lockstep_spawn(frame->spawns[i]);
+        }
+    }
+    despawn_expired_entities();
+
+    parallel_for(0, entities.padded, ENTITY_JOB_GRAIN, [](uint32_t begin, uint32_t end) {
+        entity_store_update_fixed_range(entities, begin, end, WIN_WIDTH * ENTITY_FIXED_ONE, WIN_HEIGHT * ENTITY_FIXED_ONE);
+    });
+}
+
+// Lockstep, host side: closes the frame with whatever spawns fit in it and sends it
+static void lockstep_host_tick() {
+    LockstepFramePayload frame = {};
+    frame.frame = command_frame;
+    while (frame.num_spawns < MAX_LOCKSTEP_SPAWNS && !pending_lockstep_spawns.empty()) {
+        frame.spawns[frame.num_spawns++] = pending_lockstep_spawns.front();
+        pending_lockstep_spawns.pop_front();
+    }
+    lockstep_step(&frame);
+
+    if (command_frame % LOCKSTEP_CHECKSUM_INTERVAL == 0) {
+        frame.has_checksum = true;
+        frame.checksum = entity_store_checksum(entities);
+        lockstep_checksums[command_frame / LOCKSTEP_CHECKSUM_INTERVAL % LOCKSTEP_CHECKSUM_HISTORY] = {
+            .frame = command_frame,
+            .checksum = frame.checksum,
+        };
+    }
+
+    frame.player_x = (int16_t)lroundf(player.position.x);
+    frame.player_y = (int16_t)lroundf(player.position.y);
+    frame.player_angle = (uint16_t)(uint32_t)lroundf(player.angle / (2.f * PI) * 65536.f);
+    dispatch_lockstep_frame(frame);
+}
+
+void set_lockstep(bool enabled) {
+    lockstep = enabled;
+}
+
+bool set_entity_capacity(uint32_t capacity) {
+    if (capacity == 0 || capacity > ENTITY_MAX_SLOTS || !set_entity_buffer_capacity(min(capacity, MAX_NETWORKED_ENTITIES))) return false;
+    entity_store_init(entities, capacity, lockstep);
+    spawned_at = make_unique<uint64_t[]>(capacity);
+    return true;
+}
+
+void common_init() {
+    // Unless set_entity_capacity already allocated them
+    if (entities.capacity == 0) {
+        set_entity_capacity(DEFAULT_ENTITY_COUNT);
+    }
+}
+
+void save_previous_state() {
+    prev_player = player;
+    entity_store_save_previous(entities);
+}
+
+int fixed_step_advance(FixedStep& step, double elapsed) {
+    step.accumulator += elapsed;
+
+    int num_ticks = 0;
+    while (step.accumulator >= CF_UPDATE_RATE) {
+        step.accumulator -= CF_UPDATE_RATE;
+        if (num_ticks == MAX_TICKS_PER_FRAME) {
+            ++step.dropped_ticks;
+            continue;
+        }
+        ++num_ticks;
+    }
+    return num_ticks;
+}
+
+float fixed_step_alpha(const FixedStep& step) {
+    return (float)(step.accumulator / CF_UPDATE_RATE);
+}
+
+void host_init() {
+    for (uint32_t i = 0; i < entities.capacity; ++i) {
+        entities.x[i] = uniform_int_distribution<int>(0, WIN_WIDTH)(sim_rng);
+        entities.y[i] = uniform_int_distribution<int>(0, WIN_HEIGHT)(sim_rng);
+        entities.dx[i] = i % 2 == 0 ? 1 : -1;
+        entities.dy[i] = i % 2 == 0 ? -1 : 1;
+    }
+    save_previous_state();
+}
+
+void sim_init(bool host_mode, float interp_delay_ms) {
+    sim_rng.seed(random_device{}());
+    common_init();
+
+    if (host_mode) {
+        host_init();
+    } else {
+        jitter_buffer_init(jitter_buffer, 1.f / CF_UPDATE_RATE, interp_delay_ms);
+    }
+}
+
+void host_tick(const HostInput& input) {
+    TRACE_SCOPE("host_tick");
+    uint64_t start = metrics_now_ns();
+    save_previous_state();
+    ++command_frame;
+
+    apply_host_input(input);
+    process_client_events();
+    if (lockstep) {
+        lockstep_host_tick();
+    } else {
+        despawn_expired_entities();
+        update_entities(EntityFilter::Active);
+    }
+
+    flush_spawn_acks();
+    if (!lockstep) {
+        try_send_network_packets();
+    }
+
+    metrics_add(Counter::Ticks);
+    metrics_observe(Histogram::TickDuration, metrics_now_ns() - start);
+}
+
+// Lockstep, client side: the frame at command_frame, with what the host sent for it if anything
+static void lockstep_client_step() {
+    save_previous_state();
+    ++command_frame;
+
+    while (!lockstep_frames.empty() && lockstep_frames.front().frame < command_frame) {
+        lockstep_frames.pop_front();
+    }
+    const LockstepFramePayload* frame = nullptr;
+    if (!lockstep_frames.empty() && lockstep_frames.front().frame == command_frame) {
+        frame = &lockstep_frames.front();
+    }
+    lockstep_step(frame);
+    if (!frame) return;
+
+    player.position = {(float)frame->player_x, (float)frame->player_y};
+    player.angle = frame->player_angle / 65536.f * 2.f * PI;
+
+    if (frame->has_checksum) {
+        uint32_t checksum = entity_store_checksum(entities);
+        if (checksum != frame->checksum) {
+            metrics_add(Counter::LockstepDesyncs);
+            println("Desynced from the host at frame {}", command_frame);
+        }
+        send_network_message(LockstepChecksumPayload{.frame = command_frame, .checksum = checksum});
+    }
+    lockstep_frames.pop_front();
+}
+
+// Lockstep, client side: takes in the frames the host sent and catches up when far behind them
+static void lockstep_client_sync() {
+    {
+        lock_guard<mutex> lock(spawn_events_mtx);
+        swap(processed_lockstep_frames, received_lockstep_frames);
+    }
+    for (const LockstepFramePayload& frame : processed_lockstep_frames) {
+        lockstep_closed_frame = max(lockstep_closed_frame, frame.frame);
+        // Frames without spawns or a checksum only close the frames before them
+        if (frame.num_spawns > 0 || frame.has_checksum) {
+            lockstep_frames.push_back(frame);
+        }
+    }
+    processed_lockstep_frames.clear();
+
+    uint32_t num_ticks = 0;
+    while (command_frame + LOCKSTEP_MAX_LAG_FRAMES < lockstep_closed_frame && num_ticks++ < LOCKSTEP_MAX_CATCHUP_TICKS) {
+        lockstep_client_step();
+    }
+}
+
+void client_sync(double now) {
+    TRACE_SCOPE("client_sync");
+    process_spawn_acks();
+    if (lockstep) {
+        lockstep_client_sync();
+        return;
+    }
+    while (ReceivedState* received = received_states.front()) {
+        reconcile_predictions(received->state);
+        jitter_buffer_insert(jitter_buffer, std::move(received->state), received->received_at);
+        received_states.pop();
+    }
+
+    const GameStatePayload* from;
+    const GameStatePayload* to;
+    float t;
+    if (jitter_buffer_sample(jitter_buffer, now, from, to, t)) {
+        // resync command frame
+        command_frame = jitter_buffer_server_frame(jitter_buffer, now);
+
+#ifdef NO_NET_INTERP
+        apply_game_state(jitter_buffer.states[jitter_buffer.count - 1]);
+#else
+        interp_game_states(*from, *to, t);
+#endif
+    }
+}
+
+void client_tick() {
+    TRACE_SCOPE("client_tick");
+    uint64_t start = metrics_now_ns();
+    if (lockstep) {
+        // Can't run ahead of the host, it may still add spawns to the frame
+        if (command_frame < lockstep_closed_frame) {
+            lockstep_client_step();
+            metrics_add(Counter::Ticks);
+            metrics_observe(Histogram::TickDuration, metrics_now_ns() - start);
+        }
+        return;
+    }
+    save_previous_state();
+    ++command_frame;
+
+    // Client is tasked to update its own entities, the host's come from snapshots
+    update_entities(EntityFilter::Ghosts);
+    record_predictions();
+
+    metrics_add(Counter::Ticks);
+    metrics_observe(Histogram::TickDuration, metrics_now_ns() - start);
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "entity_store.h"
+#include "game.h"
+#include "jitter_buffer.h"
+#include "protocol.h"
+#include "raylib.h"
+#include <cstdint>
+
+/*
+ * Game simulation and its network side, shared by the windowed game and the headless host.
+ * Nothing in here opens a window, reads input or draws, the caller feeds input through HostInput/spawn_ghost_entity.
+ */
+
+/*
+ * The simulation advances in fixed ticks of CF_UPDATE_RATE, one command frame each, whatever the frame rate.
+ * Callers accumulate real time with FixedStep and run as many ticks as it says, rendering then interpolates
+ * between the state before and after the last tick.
+ */
+const float CF_UPDATE_RATE = 1.f / 60.f;
+// Past that many ticks in one go the remaining time is dropped, so a slow frame can't snowball into slower ones
+const int MAX_TICKS_PER_FRAME = 5;
+
+struct Player {
+    Vector2 position = {(int)(WIN_WIDTH/2), (int)(WIN_HEIGHT/2)};
+    float angle = 0.f;
+};
+
+extern uint64_t command_frame;
+extern Player player;
+extern Player prev_player;
+extern EntityStore entities;
+extern JitterBuffer jitter_buffer;
+
+struct HostInput {
+    bool turn_left = false;
+    bool turn_right = false;
+    bool forward = false;
+};
+
+struct FixedStep {
+    double accumulator = 0.0;
+    uint64_t dropped_ticks = 0;
+};
+
+/*
+ * Adds the elapsed real time and returns the number of ticks to run now
+ */
+int fixed_step_advance(FixedStep& step, double elapsed);
+
+/*
+ * How far rendering is between the previous and the current tick, in [0, 1[
+ */
+float fixed_step_alpha(const FixedStep& step);
+
+/*
+ * Lockstep instead of snapshots: the host only sends spawns, every peer simulates all entities in fixed point and
+ * checksums tell desyncs apart. Host and clients have to agree on it, on the entity count and on the entity lifetime.
+ * Call before set_entity_capacity.
+ */
+void set_lockstep(bool enabled);
+
+/*
+ * Allocates `capacity` entity slots (DEFAULT_ENTITY_COUNT otherwise), host and clients have to agree on it.
+ * Call before the net thread starts: it also sizes the pooled snapshot buffers, which can't change while snapshots are in flight.
+ */
+bool set_entity_capacity(uint32_t capacity);
+
+/*
+ * Host side: entities get despawned that long after being spawned, their slots go back to the free list. 0 (the default) keeps them forever.
+ */
+void set_entity_lifetime(float seconds);
+
+/*
+ * Host side: snapshots bigger than `max_size` bytes only cover some of the slots, taken in turn (see
+ * max_game_state_size). Call after set_entity_capacity.
+ */
+void set_snapshot_size_limit(size_t max_size);
+
+// Client events older than that aren't rewound all the way
+const float DEFAULT_MAX_REWIND_MS = 2000.f;
+
+/*
+ * Host side: client events are evaluated at the frame they happened at on the client, up to `max_rewind_ms` back, and
+ * replayed tick by tick up to now
+ */
+void set_max_rewind(float max_rewind_ms);
+
+void sim_init(bool host_mode, float interp_delay_ms);
+
+void host_tick(const HostInput& input);
+
+/*
+ * Client side: the host drives everything but ghost entities, client_sync applies the snapshots due at `now`
+ * once per rendered frame and client_tick advances ghosts
+ */
+void client_sync(double now);
+void client_tick();
+
+/*
+ * Client side: spawns a ghost entity right away and tells the host about it, false if every slot is taken.
+ * The ghost goes in a slot the host leased to this client when there's one left, the host's ack moves it otherwise.
+ */
+bool spawn_ghost_entity(Vector2 pos, Vector2 dir);
+
+/*
+ * Client side: what's left to blend out of the last prediction correction of entity `id`, to add when drawing it
+ */
+Vector2 prediction_error(uint32_t id);
+
+void interp_game_states(const GameStatePayload& from, const GameStatePayload& to, float t);
+void apply_game_state(const GameStatePayload& s);
+
+float lerp_angle(float from, float to, float t);
+
+// Monotonic clock, in seconds
+double now_seconds();
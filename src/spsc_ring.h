@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+const size_t CACHE_LINE_SIZE = 64;
+
+/*
+ * Fixed-capacity single-producer/single-consumer ring. Slots are allocated once with the ring and written in place,
+ * the producer and the consumer never wait on each other: a full ring makes try_push fail, an empty one makes front return nullptr.
+ * Each side owns its index on a separate cache line and keeps a cached copy of the other side's index
+ * so it only touches the shared one when the cached copy says full/empty.
+ */
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+public:
+    /*
+     * Producer side: returns the slot to fill or nullptr if the ring is full, the slot is published by commit_push
+     */
+    T* begin_push() {
+        size_t write_pos = write_idx.load(std::memory_order_relaxed);
+        if (write_pos - cached_read_idx == Capacity) {
+            cached_read_idx = read_idx.load(std::memory_order_acquire);
+            if (write_pos - cached_read_idx == Capacity) return nullptr;
+        }
+        return &slots[write_pos & (Capacity - 1)];
+    }
+
+    void commit_push() {
+        write_idx.store(write_idx.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /*
+     * Consumer side: oldest published slot or nullptr, it stays valid until pop
+     */
+    T* front() {
+        size_t read_pos = read_idx.load(std::memory_order_relaxed);
+        if (read_pos == cached_write_idx) {
+            cached_write_idx = write_idx.load(std::memory_order_acquire);
+            if (read_pos == cached_write_idx) return nullptr;
+        }
+        return &slots[read_pos & (Capacity - 1)];
+    }
+
+    void pop() {
+        read_idx.store(read_idx.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /*
+     * May already be stale when it returns, both sides keep moving
+     */
+    size_t size() const {
+        return write_idx.load(std::memory_order_acquire) - read_idx.load(std::memory_order_acquire);
+    }
+
+private:
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> read_idx = 0;
+    size_t cached_write_idx = 0;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> write_idx = 0;
+    size_t cached_read_idx = 0;
+
+    alignas(CACHE_LINE_SIZE) T slots[Capacity];
+};
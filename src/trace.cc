@@ -0,0 +1,150 @@
+#include "trace.h"
+#include <cstdio>
+#include <mutex>
+#include <print>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+struct TraceEvent {
+    // Relaxed atomics so a flush racing with the owning thread reads stale values instead of tearing
+    atomic<const char*> name;
+    atomic<uint64_t> start_ns;
+    atomic<uint64_t> dur_ns;
+};
+
+struct TraceRing {
+    uint32_t tid = 0;
+    atomic<const char*> thread_name = nullptr;
+    // Events [write_idx - capacity, write_idx) are readable, only the owning thread moves it
+    atomic<uint64_t> write_idx = 0;
+    TraceEvent events[TRACE_RING_CAPACITY];
+    TraceRing* next = nullptr;
+};
+
+static mutex rings_mtx;
+static TraceRing* rings = nullptr;
+static uint32_t num_rings = 0;
+static thread_local TraceRing* local_ring = nullptr;
+static string output_path;
+
+static TraceRing& thread_ring() {
+    if (local_ring) return *local_ring;
+
+    TraceRing* ring = new TraceRing();
+    lock_guard<mutex> lock(rings_mtx);
+    ring->tid = ++num_rings;
+    ring->next = rings;
+    rings = ring;
+    local_ring = ring;
+    return *ring;
+}
+
+void trace_thread_name(const char* name) {
+    thread_ring().thread_name.store(name, memory_order_relaxed);
+}
+
+void trace_record(const char* name, uint64_t start_ns, uint64_t end_ns) {
+    TraceRing& ring = thread_ring();
+    uint64_t idx = ring.write_idx.load(memory_order_relaxed);
+
+    TraceEvent& event = ring.events[idx & (TRACE_RING_CAPACITY - 1)];
+    event.name.store(name, memory_order_relaxed);
+    event.start_ns.store(start_ns, memory_order_relaxed);
+    event.dur_ns.store(end_ns - start_ns, memory_order_relaxed);
+
+    ring.write_idx.store(idx + 1, memory_order_release);
+}
+
+void trace_set_output(const char* path) {
+    lock_guard<mutex> lock(rings_mtx);
+    output_path = path;
+}
+
+struct CopiedEvent {
+    const char* name;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    uint32_t tid;
+};
+
+bool trace_flush() {
+#ifndef NET_TRACE
+    println("Trace points are compiled out, build with -DNET_TRACE=ON");
+    return false;
+#else
+    vector<CopiedEvent> copied;
+    vector<pair<uint32_t, const char*>> thread_names;
+    string path;
+
+    {
+        lock_guard<mutex> lock(rings_mtx);
+        path = output_path;
+        if (path.empty()) {
+            println("No trace output set, pass --trace FILE");
+            return false;
+        }
+
+        for (TraceRing* ring = rings; ring; ring = ring->next) {
+            uint64_t end = ring->write_idx.load(memory_order_acquire);
+            uint64_t begin = end > TRACE_RING_CAPACITY ? end - TRACE_RING_CAPACITY : 0;
+            size_t first = copied.size();
+
+            for (uint64_t idx = begin; idx < end; ++idx) {
+                const TraceEvent& event = ring->events[idx & (TRACE_RING_CAPACITY - 1)];
+                copied.push_back({
+                    .name = event.name.load(memory_order_relaxed),
+                    .start_ns = event.start_ns.load(memory_order_relaxed),
+                    .dur_ns = event.dur_ns.load(memory_order_relaxed),
+                    .tid = ring->tid,
+                });
+            }
+
+            // The owner may have lapped the copy, a slot is only intact if it wasn't reused since (including the one being written)
+            uint64_t after = ring->write_idx.load(memory_order_acquire);
+            uint64_t num_overwritten = after + 1 > begin + TRACE_RING_CAPACITY ? after + 1 - begin - TRACE_RING_CAPACITY : 0;
+            if (num_overwritten > 0) {
+                size_t erase = min<size_t>(num_overwritten, copied.size() - first);
+                copied.erase(copied.begin() + first, copied.begin() + first + erase);
+            }
+
+            if (const char* name = ring->thread_name.load(memory_order_relaxed)) {
+                thread_names.push_back({ring->tid, name});
+            }
+        }
+    }
+
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        println("Failed to open {}", path);
+        return false;
+    }
+
+    uint64_t base_ns = UINT64_MAX;
+    for (const CopiedEvent& event : copied) {
+        base_ns = min(base_ns, event.start_ns);
+    }
+
+    int pid = getpid();
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for (const auto& [tid, name] : thread_names) {
+        fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+                first ? "" : ",\n", pid, tid, name);
+        first = false;
+    }
+    for (const CopiedEvent& event : copied) {
+        fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}",
+                first ? "" : ",\n", event.name, pid, event.tid,
+                (double)(event.start_ns - base_ns) * 1e-3, (double)event.dur_ns * 1e-3);
+        first = false;
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    println("Wrote {} trace events to {}", copied.size(), path);
+    return true;
+#endif
+}
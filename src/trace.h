@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Timeline of what each thread spends its time on, written as a Chrome trace (chrome://tracing or ui.perfetto.dev).
+ * Trace points only exist in builds with NET_TRACE defined (cmake -DNET_TRACE=ON), otherwise the macros expand to nothing.
+ *
+ * TRACE_SCOPE records one complete event (begin + duration) when the scope exits into the calling thread's ring,
+ * rings never block and overwrite their oldest events once full.
+ */
+
+#ifdef NET_TRACE
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+// name must outlive the trace, use string literals
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) trace_thread_name(name)
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_THREAD_NAME(name) do {} while (0)
+#endif
+
+// Per thread, ~1.5MB each
+const size_t TRACE_RING_CAPACITY = 1 << 16;
+
+inline uint64_t trace_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_thread_name(const char* name);
+void trace_record(const char* name, uint64_t start_ns, uint64_t end_ns);
+
+struct TraceScope {
+    const char* name;
+    uint64_t start_ns;
+
+    explicit TraceScope(const char* name) : name(name), start_ns(trace_now_ns()) {}
+    ~TraceScope() { trace_record(name, start_ns, trace_now_ns()); }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+/*
+ * Locks a deferred lock, the wait shows up as its own event so contention stands out from the critical section
+ */
+template <typename Lock>
+void trace_lock(Lock& lock, [[maybe_unused]] const char* name) {
+    TRACE_SCOPE(name);
+    lock.lock();
+}
+
+/*
+ * File trace_flush writes to, nothing is written until it's set
+ */
+void trace_set_output(const char* path);
+
+/*
+ * Writes what the rings currently hold, threads can keep tracing meanwhile: events overwritten during the copy are left out.
+ * Returns false if there is no output, it can't be written or trace points are compiled out.
+ */
+bool trace_flush();
@@ -0,0 +1,761 @@
+/*
+ * Load tester for the host: opens a swarm of bot clients from one process and reports how the host keeps up.
+ * Bots decode every snapshot with the real deserializer and spawn balls at a configurable rate, they never ack
+ * snapshots so the host keeps sending them full states. Everything runs on a single thread around one Poller.
+ *
+ * Bots spawn with the ids the host leases them, like the game client does, and spawn-to-ack latency is the time until
+ * the host's batched SpawnAcks for the spawn comes back.
+ * --impair runs what each bot receives through impair.h, to see how snapshot gaps and acks hold up on a bad link.
+ *
+ * Snapshot age is how old the newest snapshot a bot holds is, sampled every host tick: now minus the time the host sent
+ * that frame. Bots don't share a clock with the host, a frame is taken to be sent at its number of ticks after the
+ * earliest arrival seen, so the age leaves out the link's constant delay but counts gaps, jitter and retransmissions.
+ */
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <netinet/in.h>
+#include <print>
+#include <random>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#include "impair.h"
+#include "net.h"
+#include "poller.h"
+#include "protocol.h"
+#include "reliability.h"
+#include "sim.h"
+
+using namespace std;
+
+const int MAX_POLL_EVENTS = 256;
+const size_t MAX_DATAGRAM_SIZE = 2048;
+const size_t BOT_RECV_RING_CAPACITY = 16 * 1024;
+const int UDP_CONNECT_RETRY_MS = 250;
+const size_t MAX_PENDING_SPAWNS = 32;
+const int64_t SPAWN_ACK_TIMEOUT_US = 5000000;
+// Spawns stay that far from the edges
+const int SPAWN_MARGIN = 20;
+const int64_t REPORT_INTERVAL_US = 1000000;
+const double TICK_US = (double)CF_UPDATE_RATE * 1e6;
+
+enum class SpawnDist {Fixed, Poisson, Burst};
+
+struct Options {
+    const char* addr = "127.0.0.1";
+    Transport transport = Transport::Tcp;
+    int num_bots = 100;
+    double duration_s = 10.0;
+    double spawn_rate = 1.0;
+    SpawnDist spawn_dist = SpawnDist::Poisson;
+    int burst_size = 5;
+    // Has to match the host's --entities
+    uint32_t num_entities = DEFAULT_ENTITY_COUNT;
+    ImpairConfig impair;
+};
+
+/*
+ * Log-linear histogram: exact below 16, then 16 sub-buckets per power of 2 (~6% resolution)
+ */
+const int HISTOGRAM_SUB_BITS = 4;
+const int HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS;
+
+struct Histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+    double sum = 0.0;
+
+    static int bucket_of(uint64_t value) {
+        if (value < (1u << HISTOGRAM_SUB_BITS)) return (int)value;
+        int msb = 63 - __builtin_clzll(value);
+        int sub = (int)((value >> (msb - HISTOGRAM_SUB_BITS)) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+        return ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+    }
+
+    // Upper bound of the bucket
+    static uint64_t value_of(int bucket) {
+        if (bucket < (1 << HISTOGRAM_SUB_BITS)) return (uint64_t)bucket;
+        int msb = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+        uint64_t sub = (uint64_t)(bucket & ((1 << HISTOGRAM_SUB_BITS) - 1));
+        return ((1ull << msb) | (sub << (msb - HISTOGRAM_SUB_BITS))) + (1ull << (msb - HISTOGRAM_SUB_BITS)) - 1;
+    }
+
+    void record(uint64_t value) {
+        ++buckets[bucket_of(value)];
+        ++count;
+        sum += (double)value;
+        if (value < min) min = value;
+        if (value > max) max = value;
+    }
+
+    uint64_t percentile(double p) const {
+        if (count == 0) return 0;
+        uint64_t rank = (uint64_t)ceil(p * (double)count);
+        if (rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            seen += buckets[i];
+            if (seen >= rank) return value_of(i) < max ? value_of(i) : max;
+        }
+        return max;
+    }
+
+    void print(const char* name, const char* unit) const {
+        if (count == 0) {
+            println("{:<22} no samples", name);
+            return;
+        }
+        println("{:<22} n={} min={}{} p50={}{} p90={}{} p99={}{} p99.9={}{} max={}{} mean={:.1f}{}",
+                name, count, min, unit, percentile(0.5), unit, percentile(0.9), unit, percentile(0.99), unit,
+                percentile(0.999), unit, max, unit, sum / (double)count, unit);
+    }
+};
+
+struct PendingSpawn {
+    bool active = false;
+    uint32_t local_id = 0;
+    // Leased id the spawn used, ENTITY_NO_ID if the bot had none left
+    uint32_t id = ENTITY_NO_ID;
+    int64_t sent_at = 0;
+};
+
+struct Bot {
+    int fd = -1;
+    bool connected = false;
+    bool closed = false;
+
+    RecvRing ring;
+    std::unique_ptr<UdpConnection> udp = nullptr;
+    std::unique_ptr<ImpairLine> impair = nullptr;
+    bool has_snapshot_seq = false;
+    uint16_t last_snapshot_seq = 0;
+    int64_t next_connect_at = 0;
+
+    // Decoded into over and over, keeps its pooled entity buffer
+    GameStatePayload state;
+    int64_t last_snapshot_at = 0;
+    uint64_t last_frame = 0;
+    double mean_interarrival_us = 0.0;
+    // Arrival time minus frame * TICK_US, the smallest one seen is when frame 0 was sent
+    int64_t frame_clock_offset_us = INT64_MAX;
+    int64_t next_age_sample_at = 0;
+
+    int64_t next_spawn_at = 0;
+    uint32_t next_local_id = 0;
+    PendingSpawn pending[MAX_PENDING_SPAWNS];
+    std::vector<uint32_t> leases;
+};
+
+struct Stats {
+    uint64_t snapshots = 0;
+    uint64_t bytes = 0;
+    uint64_t decode_failures = 0;
+    uint64_t ignored_frames = 0;
+    uint64_t spawns_sent = 0;
+    uint64_t spawns_acked = 0;
+    uint64_t spawns_timed_out = 0;
+    uint64_t spawns_dropped = 0;
+    uint64_t spawns_rejected = 0;
+    uint64_t spawns_remapped = 0;
+    uint64_t disconnects = 0;
+
+    Histogram interarrival_us;
+    Histogram jitter_us;
+    Histogram decode_ns;
+    Histogram spawn_ack_us;
+    Histogram snapshot_age_us;
+};
+
+static atomic<bool> running = true;
+static Options options;
+static Stats stats;
+static vector<Bot> bots;
+// Bot index by fd, -1 for fds that aren't bots
+static vector<int> bot_by_fd;
+static Poller poller;
+static struct sockaddr_in host_addr;
+static mt19937_64 rng(12345);
+static chrono::steady_clock::time_point start_time;
+
+static void on_stop_signal(int) {
+    running = false;
+}
+
+static int64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count();
+}
+
+static int64_t now_us() {
+    return now_ns() / 1000;
+}
+
+static void usage() {
+    println("Usage: netbot [--clients N] [--udp] [--addr IP] [--duration S] [--spawn-rate PER_BOT_PER_S]");
+    println("              [--spawn-dist fixed|poisson|burst] [--burst-size N] [--entities N] [--impair SPEC]");
+}
+
+static bool parse_options(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--clients") == 0 && has_value) {
+            options.num_bots = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--udp") == 0) {
+            options.transport = Transport::Udp;
+        } else if (strcmp(argv[i], "--addr") == 0 && has_value) {
+            options.addr = argv[++i];
+        } else if (strcmp(argv[i], "--duration") == 0 && has_value) {
+            options.duration_s = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--spawn-rate") == 0 && has_value) {
+            options.spawn_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--spawn-dist") == 0 && has_value) {
+            const char* dist = argv[++i];
+            if (strcmp(dist, "fixed") == 0) {
+                options.spawn_dist = SpawnDist::Fixed;
+            } else if (strcmp(dist, "poisson") == 0) {
+                options.spawn_dist = SpawnDist::Poisson;
+            } else if (strcmp(dist, "burst") == 0) {
+                options.spawn_dist = SpawnDist::Burst;
+            } else {
+                return false;
+            }
+        } else if (strcmp(argv[i], "--burst-size") == 0 && has_value) {
+            options.burst_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--entities") == 0 && has_value) {
+            options.num_entities = (uint32_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--impair") == 0 && has_value) {
+            if (!parse_impair_config(argv[++i], options.impair)) return false;
+        } else {
+            return false;
+        }
+    }
+    return options.num_bots > 0 && options.duration_s > 0.0 && options.spawn_rate >= 0.0 && options.burst_size > 0
+        && options.num_entities > 0 && options.num_entities <= ENTITY_MAX_SLOTS;
+}
+
+// Time until the bot's next spawn (or burst of spawns)
+static int64_t next_spawn_delay_us() {
+    double rate = options.spawn_rate;
+    if (options.spawn_dist == SpawnDist::Burst) rate /= options.burst_size;
+
+    double interval_s = 1.0 / rate;
+    if (options.spawn_dist == SpawnDist::Poisson) {
+        interval_s = exponential_distribution<double>(rate)(rng);
+    }
+    return (int64_t)(interval_s * 1e6);
+}
+
+static void close_bot(Bot& bot) {
+    if (bot.closed) return;
+    bot.closed = true;
+    bot.connected = false;
+    ++stats.disconnects;
+    poller_remove(poller, bot.fd);
+    close(bot.fd);
+}
+
+static void send_udp_control(Bot& bot, UdpPacketType type) {
+    char packet = (char)type;
+    send(bot.fd, &packet, sizeof packet, 0);
+}
+
+static bool open_bot(Bot& bot) {
+    bool udp = options.transport == Transport::Udp;
+    bot.fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (bot.fd < 0) {
+        println("Failed to create socket: {}", strerror(errno));
+        return false;
+    }
+
+    if (set_non_blocking(bot.fd) < 0) {
+        println("Failed to make socket non-blocking");
+        close(bot.fd);
+        return false;
+    }
+
+    if (connect(bot.fd, (struct sockaddr*)&host_addr, sizeof host_addr) < 0 && errno != EINPROGRESS) {
+        println("Failed to connect: {}", strerror(errno));
+        close(bot.fd);
+        return false;
+    }
+
+    if (poller_add(poller, bot.fd) < 0) {
+        println("Failed to watch socket");
+        close(bot.fd);
+        return false;
+    }
+
+    if ((size_t)bot.fd >= bot_by_fd.size()) {
+        bot_by_fd.resize(bot.fd + 1, -1);
+    }
+
+    if (options.impair.enabled()) {
+        ImpairConfig config = options.impair;
+        config.seed += bot.fd;
+        bot.impair = make_unique<ImpairLine>();
+        impair_init(*bot.impair, config);
+    }
+
+    if (udp) {
+        bot.udp = make_unique<UdpConnection>();
+        send_udp_control(bot, UdpPacketType::Connect);
+        bot.next_connect_at = now_us() + UDP_CONNECT_RETRY_MS * 1000;
+    } else {
+        // Has to hold a whole snapshot frame, those get big with a lot of entities
+        ring_init(bot.ring, max(BOT_RECV_RING_CAPACITY, 2 * (MSG_HEADER_SIZE + max_game_state_size(true))));
+    }
+
+    // Random phase so bots don't all spawn in lockstep
+    if (options.spawn_rate > 0.0) {
+        bot.next_spawn_at = now_us() + (int64_t)(uniform_real_distribution<double>(0.0, 1.0)(rng) * (double)next_spawn_delay_us());
+    }
+    return true;
+}
+
+// Bots simulate nothing, their frame is the last snapshot's frame moved forward by the time since it arrived
+static uint64_t estimated_server_frame(const Bot& bot, int64_t now) {
+    if (bot.last_snapshot_at == 0) return 0;
+    return bot.last_frame + (uint64_t)((double)(now - bot.last_snapshot_at) * 1e-6 / CF_UPDATE_RATE);
+}
+
+static void on_spawn_acks(Bot& bot, const SpawnAcksPayload& acks, int64_t now) {
+    for (uint8_t i = 0; i < acks.num_acks; ++i) {
+        uint32_t local_id = acks.first_local_id + i;
+        PendingSpawn& pending = bot.pending[local_id % MAX_PENDING_SPAWNS];
+        if (!pending.active || pending.local_id != local_id) continue;
+
+        stats.spawn_ack_us.record(now - pending.sent_at);
+        ++stats.spawns_acked;
+        if (acks.ids[i] == ENTITY_NO_ID) {
+            ++stats.spawns_rejected;
+        } else if (acks.ids[i] != pending.id) {
+            ++stats.spawns_remapped;
+        }
+        pending.active = false;
+    }
+
+    for (uint8_t i = 0; i < acks.num_leases; ++i) {
+        bot.leases.push_back(acks.ids[acks.num_acks + i]);
+    }
+}
+
+static void on_frame(Bot& bot, const FrameView& frame, int64_t now) {
+    if (frame.type == MsgType::SpawnAcks) {
+        SpawnAcksPayload acks;
+        if (deserialize_spawn_acks(frame.data, frame.len, acks)) {
+            on_spawn_acks(bot, acks, now);
+        }
+        return;
+    }
+    if (frame.type != MsgType::GameState) {
+        ++stats.ignored_frames;
+        return;
+    }
+
+    int64_t decode_start = now_ns();
+    bool decoded = deserialize_game_state(frame.data, frame.len, bot.state);
+    stats.decode_ns.record(now_ns() - decode_start);
+
+    if (!decoded) {
+        ++stats.decode_failures;
+        return;
+    }
+
+    ++stats.snapshots;
+    stats.bytes += MSG_HEADER_SIZE + frame.len;
+
+    if (bot.last_snapshot_at != 0) {
+        double interarrival = (double)(now - bot.last_snapshot_at);
+        stats.interarrival_us.record((uint64_t)interarrival);
+
+        // Deviation from the bot's own running mean, the host's send rate doesn't need to be known
+        if (bot.mean_interarrival_us == 0.0) {
+            bot.mean_interarrival_us = interarrival;
+        } else {
+            stats.jitter_us.record((uint64_t)fabs(interarrival - bot.mean_interarrival_us));
+            bot.mean_interarrival_us += (interarrival - bot.mean_interarrival_us) / 16.0;
+        }
+    }
+    bot.last_snapshot_at = now;
+    bot.last_frame = bot.state.server_command_frame;
+    bot.frame_clock_offset_us = min(bot.frame_clock_offset_us, now - (int64_t)((double)bot.last_frame * TICK_US));
+}
+
+static void sample_snapshot_age(Bot& bot, int64_t now) {
+    if (bot.last_snapshot_at == 0) return;
+    int64_t sent_at = bot.frame_clock_offset_us + (int64_t)((double)bot.last_frame * TICK_US);
+    stats.snapshot_age_us.record((uint64_t)max<int64_t>(now - sent_at, 0));
+}
+
+static void on_tcp_frames(Bot& bot, int64_t now) {
+    FrameView frame;
+    while (ring_next_frame(bot.ring, frame)) {
+        on_frame(bot, frame, now);
+    }
+}
+
+static void read_tcp(Bot& bot) {
+    char buff[MAX_IMPAIRED_PACKET_SIZE];
+
+    while (true) {
+        ssize_t msg_len = bot.impair ? recv(bot.fd, buff, sizeof buff, 0) : ring_recv(bot.ring, bot.fd, 0);
+        if (msg_len < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) close_bot(bot);
+            return;
+        }
+        if (msg_len == 0) {
+            close_bot(bot);
+            return;
+        }
+
+        if (bot.impair) {
+            impair_push(*bot.impair, buff, msg_len, nullptr, true, now_us());
+        } else {
+            on_tcp_frames(bot, now_us());
+        }
+    }
+}
+
+static void on_datagram(Bot& bot, const char* buff, size_t msg_len) {
+    if (msg_len < 1 || (UdpPacketType)buff[0] != UdpPacketType::Data) return;
+
+    uint16_t seq;
+    size_t offset = read_packet_prefix(*bot.udp, buff + 1, msg_len - 1, seq);
+    if (offset == 0) return;
+    bot.connected = true;
+
+    int64_t now = now_us();
+    while (const ReliableMessage* msg = pop_reliable(*bot.udp)) {
+        FrameView frame;
+        if (read_frame(msg->data, msg->len, frame) > 0) {
+            on_frame(bot, frame, now);
+        }
+    }
+
+    // Same latest-wins rule as the game client
+    if (!bot.has_snapshot_seq || seq_greater(seq, bot.last_snapshot_seq)) {
+        offset += 1;
+        FrameView frame;
+        if (read_frame(buff + offset, msg_len - offset, frame) > 0) {
+            bot.has_snapshot_seq = true;
+            bot.last_snapshot_seq = seq;
+            on_frame(bot, frame, now);
+        }
+    }
+
+    // Acks the packet so spawns get confirmed, no snapshot ack: the host keeps sending full states
+    char reply[MAX_DATAGRAM_SIZE];
+    reply[0] = (char)UdpPacketType::Data;
+    size_t reply_len = 1 + write_packet_prefix(*bot.udp, reply + 1, sizeof reply - 1);
+    send(bot.fd, reply, reply_len, 0);
+}
+
+static void read_udp(Bot& bot) {
+    char buff[MAX_DATAGRAM_SIZE];
+
+    while (true) {
+        ssize_t msg_len = recv(bot.fd, buff, sizeof buff, 0);
+        if (msg_len < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        if (bot.impair) {
+            impair_push(*bot.impair, buff, msg_len, nullptr, false, now_us());
+        } else {
+            on_datagram(bot, buff, msg_len);
+        }
+    }
+}
+
+// Hands over what the bot's impairment held back and is now due
+static void release_impaired(Bot& bot, int64_t now) {
+    while (const ImpairedPacket* packet = impair_pop(*bot.impair, now)) {
+        if (bot.udp) {
+            on_datagram(bot, packet->data, packet->len);
+            continue;
+        }
+
+        if (!ring_write(bot.ring, packet->data, packet->len)) {
+            close_bot(bot);
+            return;
+        }
+        on_tcp_frames(bot, now);
+    }
+}
+
+static void send_spawn(Bot& bot, int64_t now) {
+    // Acks come back in order, a slot still waiting means MAX_PENDING_SPAWNS are in flight
+    PendingSpawn& pending = bot.pending[bot.next_local_id % MAX_PENDING_SPAWNS];
+    if (pending.active) {
+        ++stats.spawns_dropped;
+        return;
+    }
+
+    SpawnEntityPayload payload = {
+        .command_frame = estimated_server_frame(bot, now),
+        .local_id = bot.next_local_id,
+        .id = bot.leases.empty() ? ENTITY_NO_ID : bot.leases.back(),
+        .pos = {
+            (float)uniform_int_distribution<int>(SPAWN_MARGIN, WIN_WIDTH - SPAWN_MARGIN)(rng),
+            (float)uniform_int_distribution<int>(SPAWN_MARGIN, WIN_HEIGHT - SPAWN_MARGIN)(rng),
+        },
+        .dir = {0.f, 0.f},
+    };
+
+    char frame[MSG_HEADER_SIZE + sizeof(SpawnEntityPayload)];
+    size_t frame_len = write_spawn_entity_frame(frame, sizeof frame, payload);
+    if (options.transport == Transport::Udp) {
+        if (!queue_reliable(*bot.udp, frame, (uint16_t)frame_len)) {
+            ++stats.spawns_dropped;
+            return;
+        }
+
+        char packet[MAX_DATAGRAM_SIZE];
+        packet[0] = (char)UdpPacketType::Data;
+        size_t packet_len = 1 + write_packet_prefix(*bot.udp, packet + 1, sizeof packet - 1);
+        send(bot.fd, packet, packet_len, 0);
+    } else {
+        // A spawn doesn't get queued behind a full socket buffer, the bot is too far behind anyway
+        if (send(bot.fd, frame, frame_len, 0) != (ssize_t)frame_len) {
+            ++stats.spawns_dropped;
+            return;
+        }
+    }
+
+    if (!bot.leases.empty()) bot.leases.pop_back();
+    ++bot.next_local_id;
+    pending = {
+        .active = true,
+        .local_id = payload.local_id,
+        .id = payload.id,
+        .sent_at = now,
+    };
+    ++stats.spawns_sent;
+}
+
+// Returns the time until the next timer is due
+static int64_t run_timers(int64_t now) {
+    int64_t next_due = now + REPORT_INTERVAL_US;
+
+    for (Bot& bot : bots) {
+        if (bot.closed) continue;
+
+        if (bot.impair) {
+            release_impaired(bot, now);
+            int due_ms = impair_timeout_ms(*bot.impair, now);
+            if (due_ms >= 0 && now + due_ms * 1000 < next_due) next_due = now + due_ms * 1000;
+            if (bot.closed) continue;
+        }
+
+        if (bot.udp && !bot.connected) {
+            if (now >= bot.next_connect_at) {
+                send_udp_control(bot, UdpPacketType::Connect);
+                bot.next_connect_at = now + UDP_CONNECT_RETRY_MS * 1000;
+            }
+            if (bot.next_connect_at < next_due) next_due = bot.next_connect_at;
+            continue;
+        }
+
+        for (PendingSpawn& pending : bot.pending) {
+            if (pending.active && now - pending.sent_at > SPAWN_ACK_TIMEOUT_US) {
+                pending.active = false;
+                ++stats.spawns_timed_out;
+            }
+        }
+
+        if (bot.connected && now >= bot.next_age_sample_at) {
+            sample_snapshot_age(bot, now);
+            bot.next_age_sample_at = max(bot.next_age_sample_at + (int64_t)TICK_US, now);
+        }
+        if (bot.connected && bot.next_age_sample_at < next_due) next_due = bot.next_age_sample_at;
+
+        if (!bot.connected || options.spawn_rate <= 0.0) continue;
+
+        if (now >= bot.next_spawn_at) {
+            int num_spawns = options.spawn_dist == SpawnDist::Burst ? options.burst_size : 1;
+            for (int i = 0; i < num_spawns; ++i) {
+                send_spawn(bot, now);
+            }
+            bot.next_spawn_at = now + next_spawn_delay_us();
+        }
+        if (bot.next_spawn_at < next_due) next_due = bot.next_spawn_at;
+    }
+
+    return next_due - now;
+}
+
+static void print_progress(int64_t now, const Stats& last) {
+    double elapsed = (double)now * 1e-6;
+    int num_connected = 0;
+    for (const Bot& bot : bots) {
+        if (bot.connected) ++num_connected;
+    }
+
+    println("[{:6.1f}s] connected: {}/{}, snapshots/s: {}, KB/s: {:.1f}, spawns/s: {}, acked/s: {}",
+            elapsed, num_connected, bots.size(),
+            stats.snapshots - last.snapshots,
+            (double)(stats.bytes - last.bytes) / 1024.0,
+            stats.spawns_sent - last.spawns_sent,
+            stats.spawns_acked - last.spawns_acked);
+}
+
+static void print_report(double elapsed) {
+    println("");
+    println("{} bots over {}, {:.1f}s", bots.size(), options.transport == Transport::Udp ? "UDP" : "TCP", elapsed);
+    println("Snapshots: {} ({:.0f}/s, {:.1f}/s per bot), {:.1f} KB/s, decode failures: {}, ignored frames: {}",
+            stats.snapshots, (double)stats.snapshots / elapsed, (double)stats.snapshots / elapsed / (double)bots.size(),
+            (double)stats.bytes / 1024.0 / elapsed, stats.decode_failures, stats.ignored_frames);
+    println("Spawns: {} sent, {} acked ({} rejected, {} remapped), {} timed out, {} dropped (window full or socket busy)",
+            stats.spawns_sent, stats.spawns_acked, stats.spawns_rejected, stats.spawns_remapped, stats.spawns_timed_out,
+            stats.spawns_dropped);
+    println("Disconnects: {}", stats.disconnects);
+    stats.interarrival_us.print("Inter-arrival", "us");
+    stats.jitter_us.print("Inter-arrival jitter", "us");
+    stats.decode_ns.print("Decode", "ns");
+    stats.spawn_ack_us.print("Spawn to ack", "us");
+    stats.snapshot_age_us.print("Snapshot age", "us");
+
+    if (options.impair.enabled()) {
+        ImpairStats impair_stats;
+        for (const Bot& bot : bots) {
+            impair_stats_add(impair_stats, bot.impair->stats);
+        }
+        println("Impairment: {} received, {} delivered, {} lost, {} retransmitted, {} over the rate limit, {} over the queue limit, {} duplicated, {} reordered",
+                impair_stats.received, impair_stats.delivered, impair_stats.lost, impair_stats.retransmitted,
+                impair_stats.rate_dropped, impair_stats.overflow_dropped, impair_stats.duplicated, impair_stats.reordered);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_options(argc, argv)) {
+        usage();
+        return 1;
+    }
+
+    // Snapshots can hold every networked slot, bots decode into buffers of that size
+    set_entity_buffer_capacity(min(options.num_entities, MAX_NETWORKED_ENTITIES));
+
+    signal(SIGINT, on_stop_signal);
+    signal(SIGTERM, on_stop_signal);
+    // Sends to a host that went away fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    // One fd per bot
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max) {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    host_addr.sin_family = AF_INET;
+    host_addr.sin_port = htons(PORT);
+    if (inet_pton(AF_INET, options.addr, &host_addr.sin_addr) != 1) {
+        println("Invalid address {}", options.addr);
+        return 1;
+    }
+
+    if (poller_create(poller) < 0) {
+        println("Failed to setup the event poller");
+        return 1;
+    }
+
+    start_time = chrono::steady_clock::now();
+
+    bots.resize(options.num_bots);
+    for (int i = 0; i < options.num_bots; ++i) {
+        if (!open_bot(bots[i])) {
+            println("Opened {} bots only", i);
+            bots.resize(i);
+            break;
+        }
+        bot_by_fd[bots[i].fd] = i;
+    }
+    if (bots.empty()) return 1;
+
+    println("Started {} bots against {}:{} over {}", bots.size(), options.addr, PORT,
+            options.transport == Transport::Udp ? "UDP" : "TCP");
+
+    PollerEvent events[MAX_POLL_EVENTS];
+    int64_t end_at = (int64_t)(options.duration_s * 1e6);
+    int64_t next_report = REPORT_INTERVAL_US;
+    Stats last_report;
+
+    while (running) {
+        int64_t now = now_us();
+        if (now >= end_at) break;
+
+        int64_t next_timer_us = run_timers(now);
+        if (next_timer_us > next_report - now) next_timer_us = next_report - now;
+        int timeout_ms = next_timer_us > 0 ? (int)((next_timer_us + 999) / 1000) : 0;
+
+        int num_events = poller_wait(poller, events, MAX_POLL_EVENTS, timeout_ms);
+        if (num_events < 0) {
+            println("Failed to wait for network events");
+            break;
+        }
+
+        for (int i = 0; i < num_events; ++i) {
+            const PollerEvent& evt = events[i];
+            if (evt.fd < 0 || (size_t)evt.fd >= bot_by_fd.size() || bot_by_fd[evt.fd] < 0) continue;
+            Bot& bot = bots[bot_by_fd[evt.fd]];
+            if (bot.closed) continue;
+
+            if (bot.udp) {
+                if (evt.readable) read_udp(bot);
+                continue;
+            }
+
+            if (!bot.connected && evt.writable) {
+                int err = 0;
+                socklen_t err_len = sizeof err;
+                getsockopt(bot.fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+                if (err != 0) {
+                    close_bot(bot);
+                    continue;
+                }
+                bot.connected = true;
+            }
+
+            if (evt.readable) {
+                read_tcp(bot);
+            } else if (evt.hangup) {
+                close_bot(bot);
+            }
+        }
+
+        now = now_us();
+        if (now >= next_report) {
+            print_progress(now, last_report);
+            last_report.snapshots = stats.snapshots;
+            last_report.bytes = stats.bytes;
+            last_report.spawns_sent = stats.spawns_sent;
+            last_report.spawns_acked = stats.spawns_acked;
+            next_report += REPORT_INTERVAL_US;
+        }
+    }
+
+    double elapsed = (double)now_us() * 1e-6;
+
+    for (Bot& bot : bots) {
+        if (bot.closed) continue;
+        if (bot.udp) send_udp_control(bot, UdpPacketType::Disconnect);
+        close(bot.fd);
+    }
+    poller_destroy(poller);
+
+    print_report(elapsed);
+    return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * Plays back a session the host recorded with --record (see recording.h).
+ *
+ * By default it stands in for the host: it listens on the game port, waits for a client and streams the recorded
+ * snapshots to it at their recorded pace (--speed to change it). Only over TCP, the client's own messages are read
+ * and dropped. Recorded spawns aren't sent, the client sees them land in the snapshots like it did live.
+ *
+ * --decode instead runs every recorded message through the real deserializers as fast as it can and reports the
+ * decode times, which makes any recording a benchmark corpus. --repeat goes over it several times.
+ */
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <print>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "game.h"
+#include "net.h"
+#include "protocol.h"
+#include "recording.h"
+
+using namespace std;
+
+struct Options {
+    const char* path = nullptr;
+    bool decode = false;
+    int repeat = 1;
+    double speed = 1.0;
+};
+
+static Options options;
+static atomic<bool> running = true;
+
+static void on_stop_signal(int) {
+    running = false;
+}
+
+static int64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void usage() {
+    println("Usage: netreplay RECORDING [--speed X]");
+    println("       netreplay RECORDING --decode [--repeat N]");
+}
+
+static bool parse_options(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--decode") == 0) {
+            options.decode = true;
+        } else if (strcmp(argv[i], "--repeat") == 0 && has_value) {
+            options.repeat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--speed") == 0 && has_value) {
+            options.speed = atof(argv[++i]);
+        } else if (argv[i][0] != '-' && !options.path) {
+            options.path = argv[i];
+        } else {
+            return false;
+        }
+    }
+    return options.path && options.repeat > 0 && options.speed > 0.0;
+}
+
+static uint64_t percentile(const vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = (size_t)(p * (double)(sorted.size() - 1));
+    return sorted[rank];
+}
+
+static int run_decode(RecordingReader& reader) {
+    GameStatePayload state;
+    vector<uint64_t> snapshot_ns;
+    uint64_t num_spawns = 0;
+    uint64_t num_failures = 0;
+    uint64_t num_entities = 0;
+    uint64_t bytes = 0;
+
+    signal(SIGINT, on_stop_signal);
+    signal(SIGTERM, on_stop_signal);
+
+    int64_t start = now_ns();
+    for (int pass = 0; pass < options.repeat && running; ++pass) {
+        recording_rewind(reader);
+        Record record;
+        while (recording_next(reader, record)) {
+            FrameView frame;
+            if (read_frame(record.frame, record.header.len, frame) == 0) {
+                ++num_failures;
+                continue;
+            }
+            bytes += record.header.len;
+
+            if (frame.type == MsgType::GameState) {
+                int64_t decode_start = now_ns();
+                bool decoded = deserialize_game_state(frame.data, frame.len, state);
+                snapshot_ns.push_back((uint64_t)(now_ns() - decode_start));
+                if (!decoded) ++num_failures;
+                num_entities += state.num_entities;
+            } else if (frame.type == MsgType::SpawnEntity) {
+                SpawnEntityPayload spawn;
+                if (!deserialize_spawn_entity(frame.data, frame.len, spawn)) ++num_failures;
+                ++num_spawns;
+            }
+        }
+    }
+    double elapsed_s = (double)(now_ns() - start) * 1e-9;
+
+    println("{} snapshots ({} entities per snapshot on average), {} spawns, {} failures in {:.3f}s",
+            snapshot_ns.size(), snapshot_ns.empty() ? 0 : num_entities / snapshot_ns.size(), num_spawns, num_failures, elapsed_s);
+    println("{:.0f} snapshots/s, {:.1f} MB/s", (double)snapshot_ns.size() / elapsed_s, (double)bytes / elapsed_s / 1e6);
+
+    sort(snapshot_ns.begin(), snapshot_ns.end());
+    if (!snapshot_ns.empty()) {
+        println("Snapshot decode p50={}ns p90={}ns p99={}ns max={}ns", percentile(snapshot_ns, 0.5),
+                percentile(snapshot_ns, 0.9), percentile(snapshot_ns, 0.99), snapshot_ns.back());
+    }
+    return num_failures == 0 ? 0 : 1;
+}
+
+static int accept_client() {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        println("Failed to create socket");
+        return -1;
+    }
+    int opt_val = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof(opt_val));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof addr) < 0 || listen(listen_fd, 1) < 0) {
+        println("Failed to listen on port {}: {}", PORT, strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+
+    println("Waiting for a client on port {}", PORT);
+    int client_fd = accept(listen_fd, nullptr, nullptr);
+    close(listen_fd);
+    if (client_fd < 0) {
+        println("Failed to accept the client");
+    }
+    return client_fd;
+}
+
+static bool send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += sent;
+        len -= (size_t)sent;
+    }
+    return true;
+}
+
+static int run_serve(RecordingReader& reader) {
+    int client_fd = accept_client();
+    if (client_fd < 0) return 1;
+    // Only from now on, Ctrl-C while waiting for the client just quits
+    signal(SIGINT, on_stop_signal);
+    signal(SIGTERM, on_stop_signal);
+
+    uint64_t num_sent = 0;
+    char drain[4096];
+    int64_t start = now_ns();
+    // Paced from the first snapshot, the host may have run for a while before anyone connected
+    uint64_t first_time_ns = UINT64_MAX;
+    Record record;
+    while (running && recording_next(reader, record)) {
+        FrameView frame;
+        if (read_frame(record.frame, record.header.len, frame) == 0 || frame.type != MsgType::GameState) continue;
+
+        first_time_ns = min(first_time_ns, record.header.time_ns);
+        int64_t due = start + (int64_t)((double)(record.header.time_ns - first_time_ns) / options.speed);
+        int64_t wait = due - now_ns();
+        if (wait > 0) {
+            this_thread::sleep_for(chrono::nanoseconds(wait));
+        }
+
+        // Acks and spawns, nobody is there to handle them
+        while (recv(client_fd, drain, sizeof drain, MSG_DONTWAIT) > 0) {}
+
+        if (!send_all(client_fd, record.frame, record.header.len)) {
+            println("Client went away");
+            break;
+        }
+        ++num_sent;
+    }
+
+    println("Sent {} snapshots in {:.1f}s", num_sent, (double)(now_ns() - start) * 1e-9);
+    close(client_fd);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_options(argc, argv)) {
+        usage();
+        return 1;
+    }
+
+    RecordingReader reader;
+    if (!recording_open(reader, options.path)) return 1;
+    println("{}: {} KB recorded with {} entity slots", options.path, reader.size / 1024, reader.header.num_entities);
+
+    // Decoding needs buffers as big as the host's snapshots, a client needs the same --entities
+    set_entity_buffer_capacity(min(reader.header.num_entities, MAX_NETWORKED_ENTITIES));
+
+    int result = options.decode ? run_decode(reader) : run_serve(reader);
+    recording_close(reader);
+    return result;
+}